@@ -385,7 +385,9 @@ setup(
     setup_requires=setup_requires,
     install_requires=install_requires,
     tests_require=test_require,
-    ext_modules=[Extension('rhsm._certificate', ['src/certificate.c'],
-                           libraries=['ssl', 'crypto'])],
+    ext_modules=[Extension('rhsm._certificate',
+                           ['src/certificate.c', 'src/rhsmcert/rhsmcert.c'],
+                           include_dirs=['src/rhsmcert'],
+                           libraries=['ssl', 'crypto', 'pthread', 'z'])],
     test_suite='nose.collector',
 )
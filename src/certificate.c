@@ -24,6 +24,9 @@
  * print x509.get_extension('10.11.1.2.9.7')
  * print x509.get_extension(name='subjectAltName')
  *
+ * loaded, failed = _certificate.load_directory('/etc/pki/entitlement',
+ *                                              exclude='-key.pem')
+ *
  * So why do we need this? The same versions of all python ssl bindings aren't
  * available everywhere we need it (el 5 vs 6, etc), and in some cases, the
  * behaviour of the libraries or commands changes across versions.
@@ -41,10 +44,21 @@
  * Thus, we write our own binding!
  */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
 #include <openssl/asn1.h>
 #include <openssl/asn1t.h>
+#include <openssl/err.h>
 #include <openssl/opensslv.h>
 #include <openssl/pem.h>
 #include <openssl/x509.h>
@@ -52,7 +66,10 @@
 
 #include "structmember.h"
 
+#include "rhsmcert.h"
+
 #define MAX_BUF 256
+#define MAX_LOAD_THREADS 16
 
 /* Python 2/3 compatiblity defines */
 #if PY_MAJOR_VERSION >= 3
@@ -69,9 +86,189 @@
 	#define ASN1_STRING_get0_data(o) ASN1_STRING_data(o)
 #endif
 
+/*
+ * OpenSSL work is done without holding the GIL, so the dbus service and
+ * the gui can keep running other threads while we parse. Since 1.1.0
+ * OpenSSL is thread safe on its own (including the lazily computed caches
+ * hanging off an X509); older versions need locking callbacks which we
+ * don't install, so there the GIL keeps serializing everything.
+ *
+ * The X509 and EVP_PKEY wrapped by our objects are never modified after
+ * load, so no further locking is needed on our side.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define BEGIN_OPENSSL Py_BEGIN_ALLOW_THREADS
+#define END_OPENSSL Py_END_ALLOW_THREADS
+#else
+#define BEGIN_OPENSSL {
+#define END_OPENSSL }
+#endif
+
+/* Format unit for binary input (der=) */
+#if PY_MAJOR_VERSION >= 3
+#define BINARY_FORMAT "y*"
+#else
+#define BINARY_FORMAT "s*"
+#endif
+
+/*
+ * Types are heap types created from the specs below when the module is
+ * executed, so every module instance (one per sub-interpreter) gets its
+ * own. Python 2 has no PyType_Spec; there type_from_spec fills in an
+ * ordinary type that lives as long as the process.
+ */
+#if PY_MAJOR_VERSION < 3
+typedef struct {
+	int slot;
+	void *pfunc;
+} PyType_Slot;
+
+typedef struct {
+	const char *name;
+	int basicsize;
+	int itemsize;
+	unsigned int flags;
+	PyType_Slot *slots;
+} PyType_Spec;
+
+#define Py_bf_getbuffer 1
+#define Py_sq_length 45
+#define Py_tp_dealloc 52
+#define Py_tp_doc 56
+#define Py_tp_iter 62
+#define Py_tp_iternext 63
+#define Py_tp_methods 64
+#define Py_tp_new 65
+
+static PyObject *
+PyType_FromSpec (PyType_Spec *spec)
+{
+	struct {
+		PyTypeObject type;
+		PySequenceMethods sequence;
+		PyBufferProcs buffer;
+	} *block = calloc (1, sizeof (*block));
+	if (block == NULL) {
+		return PyErr_NoMemory ();
+	}
+
+	PyTypeObject *type = &block->type;
+	Py_REFCNT (type) = 1;
+	type->tp_name = spec->name;
+	type->tp_basicsize = spec->basicsize;
+	type->tp_itemsize = spec->itemsize;
+	type->tp_flags = spec->flags;
+
+	PyType_Slot *slot;
+	for (slot = spec->slots; slot->slot != 0; slot++) {
+		switch (slot->slot) {
+		case Py_bf_getbuffer:
+			block->buffer.bf_getbuffer = slot->pfunc;
+			type->tp_as_buffer = &block->buffer;
+			break;
+		case Py_sq_length:
+			block->sequence.sq_length = slot->pfunc;
+			type->tp_as_sequence = &block->sequence;
+			break;
+		case Py_tp_dealloc:
+			type->tp_dealloc = slot->pfunc;
+			break;
+		case Py_tp_doc:
+			type->tp_doc = slot->pfunc;
+			break;
+		case Py_tp_iter:
+			type->tp_iter = slot->pfunc;
+			break;
+		case Py_tp_iternext:
+			type->tp_iternext = slot->pfunc;
+			break;
+		case Py_tp_methods:
+			type->tp_methods = slot->pfunc;
+			break;
+		case Py_tp_new:
+			type->tp_new = slot->pfunc;
+			break;
+		}
+	}
+
+	if (PyType_Ready (type) < 0) {
+		/* Types are never freed, nor is a type that failed */
+		return NULL;
+	}
+	return (PyObject *) type;
+}
+#endif
+
+/* Like static types, ours can't be subclassed or have attributes set */
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE)
+#else
+#define TYPE_FLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+/* For types without Py_tp_new, see certificate_exec for older pythons */
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define NO_NEW_FLAGS Py_TPFLAGS_DISALLOW_INSTANTIATION
+#else
+#define NO_NEW_FLAGS 0
+#endif
+
+/*
+ * Objects with state that changes after creation (lazily built caches,
+ * a reader's position, an index being added to) lock themselves while
+ * touching it. On free-threaded builds this is a per-object lock, with
+ * the GIL it costs nothing. The lock is given up whenever the thread
+ * detaches (BEGIN_OPENSSL), so it must not be held across OpenSSL work.
+ */
+#if PY_VERSION_HEX >= 0x030D0000
+#define BEGIN_OBJECT_LOCK(o) Py_BEGIN_CRITICAL_SECTION (o)
+#define END_OBJECT_LOCK Py_END_CRITICAL_SECTION ()
+#else
+#define BEGIN_OBJECT_LOCK(o) {
+#define END_OBJECT_LOCK }
+#endif
+
+/* Python 3.7 and up have METH_FASTCALL with keyword names */
+#if PY_VERSION_HEX >= 0x030700F0
+#define USE_FASTCALL 1
+#endif
+
+/* Per module instance state */
+typedef struct {
+	PyTypeObject *x509_type;
+	PyTypeObject *private_key_type;
+	PyTypeObject *pem_reader_type;
+} certificate_state;
+
+#if PY_MAJOR_VERSION >= 3
+#define get_state(module) ((certificate_state *) PyModule_GetState (module))
+#else
+static certificate_state module_state;
+#define get_state(module) (&module_state)
+#endif
+
+/* The end of every tp_dealloc */
+static void
+object_free (PyObject *self)
+{
+	PyTypeObject *type = Py_TYPE (self);
+	type->tp_free (self);
+#if PY_MAJOR_VERSION >= 3
+	/* Instances of heap types hold a reference to their type */
+	Py_DECREF (type);
+#endif
+}
+
+/* Exactly one of x509 and compact is set */
 typedef struct {
 	PyObject_HEAD;
 	X509 *x509;
+	rhsm_cert *compact;
+	rhsm_ext *ext_table;
+	int ext_count;
+	/* DER of a full x509, encoded on first use of the buffer interface */
+	unsigned char *der;
+	int der_length;
 } certificate_x509;
 
 typedef struct {
@@ -82,131 +279,127 @@ typedef struct {
 static void
 certificate_x509_dealloc (certificate_x509 *self)
 {
-	X509_free (self->x509);
-	Py_TYPE(self)->tp_free ((PyObject *) self);
+	if (self->compact != NULL) {
+		/* The extension table is part of the compact block */
+		rhsm_cert_free (self->compact);
+	} else {
+		rhsm_ext_table_free (self->ext_table, self->ext_count);
+		X509_free (self->x509);
+		OPENSSL_free (self->der);
+	}
+	object_free ((PyObject *) self);
 }
 
 static void
 private_key_dealloc (private_key *self)
 {
 	EVP_PKEY_free (self->key);
-	Py_TYPE(self)->tp_free ((PyObject *) self);
+	object_free ((PyObject *) self);
 }
 
 static PyObject *get_not_before (certificate_x509 *self, PyObject *varargs);
 static PyObject *get_not_after (certificate_x509 *self, PyObject *varargs);
+static PyObject *get_validity (certificate_x509 *self, PyObject *varargs);
 static PyObject *get_serial_number (certificate_x509 *self, PyObject *varargs);
 static PyObject *get_subject (certificate_x509 *self, PyObject *varargs);
 static PyObject *get_issuer(certificate_x509 *self, PyObject *varargs);
+#ifdef USE_FASTCALL
+static PyObject *get_extension (certificate_x509 *self, PyObject *const *args,
+				Py_ssize_t nargs, PyObject *kwnames);
+#else
 static PyObject *get_extension (certificate_x509 *self, PyObject *varargs,
 				PyObject *keywords);
+#endif
 static PyObject *get_all_extensions (certificate_x509 *self, PyObject *varargs);
+static PyObject *get_extensions (certificate_x509 *self, PyObject *varargs,
+				 PyObject *keywords);
+static PyObject *find_extensions (certificate_x509 *self, PyObject *varargs,
+				  PyObject *keywords);
+static PyObject *decode_redhat_v1 (certificate_x509 *self, PyObject *varargs);
 static PyObject *as_pem (certificate_x509 *self, PyObject *varargs);
+static PyObject *as_der (certificate_x509 *self, PyObject *varargs);
 static PyObject *as_text (certificate_x509 *self, PyObject *varargs);
 
+/*
+ * X509 objects export their DER through the buffer interface, so as_der()
+ * and bytes(x509) need no copy beyond the one the caller asks for.
+ */
+static int certificate_x509_getbuffer (certificate_x509 *self,
+				       Py_buffer *view, int flags);
+
 static PyMethodDef x509_methods[] = {
-	{"get_not_before", (PyCFunction) get_not_before, METH_VARARGS,
+	{"get_not_before", (PyCFunction) get_not_before, METH_NOARGS,
 	 "get the certificate's start time"},
-	{"get_not_after", (PyCFunction) get_not_after, METH_VARARGS,
+	{"get_not_after", (PyCFunction) get_not_after, METH_NOARGS,
 	 "get the certificate's end time"},
-	{"get_serial_number", (PyCFunction) get_serial_number, METH_VARARGS,
+	{"get_validity", (PyCFunction) get_validity, METH_NOARGS,
+	 "get the certificate's (start, end) times as UTC epoch seconds"},
+	{"get_serial_number", (PyCFunction) get_serial_number, METH_NOARGS,
 	 "get the certificate's serial number"},
-	{"get_subject", (PyCFunction) get_subject, METH_VARARGS,
+	{"get_subject", (PyCFunction) get_subject, METH_NOARGS,
 	 "get the certificate's subject"},
-	{"get_issuer", (PyCFunction) get_issuer, METH_VARARGS,
+	{"get_issuer", (PyCFunction) get_issuer, METH_NOARGS,
 	 "get the certificate's issuer"},
-	{"get_extension", (PyCFunction) get_extension,
+	{"get_extension", (PyCFunction) (void (*) (void)) get_extension,
+#ifdef USE_FASTCALL
+	 METH_FASTCALL | METH_KEYWORDS,
+#else
 	 METH_VARARGS | METH_KEYWORDS,
+#endif
 	 "get the string representation of an extension by oid"},
-	{"get_all_extensions", (PyCFunction) get_all_extensions, METH_VARARGS,
+	{"get_all_extensions", (PyCFunction) get_all_extensions, METH_NOARGS,
 	 "get a dict of oid: value"},
-	{"as_pem", (PyCFunction) as_pem, METH_VARARGS,
+	{"get_extensions", (PyCFunction) get_extensions,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "get a dict of oid: value for the extensions under prefix, with the prefix removed from each oid"},
+	{"find_extensions", (PyCFunction) find_extensions,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "get a sorted list of (oid, value) for the extensions matching an oid pattern such as '1.*.1'"},
+	{"decode_redhat_v1", (PyCFunction) decode_redhat_v1, METH_NOARGS,
+	 "decode the products, order and content of a v1 certificate into a dict"},
+	{"as_pem", (PyCFunction) as_pem, METH_NOARGS,
 	 "return the pem representation of this certificate"},
-	{"as_text", (PyCFunction) as_text, METH_VARARGS,
+	{"as_der", (PyCFunction) as_der, METH_NOARGS,
+	 "return a read only memoryview of the DER encoding of this certificate"},
+	{"as_text", (PyCFunction) as_text, METH_NOARGS,
 	 "return the text representation of this certificate (such as printed by openssl x509 -noout -text)"},
 	{NULL}
 };
 
-static PyTypeObject certificate_x509_type = {
-	PyVarObject_HEAD_INIT (NULL, 0)
+static PyType_Slot certificate_x509_slots[] = {
+	{Py_tp_dealloc, (void *) certificate_x509_dealloc},
+	{Py_tp_doc, (void *) "X509 Certificate"},
+	{Py_tp_methods, x509_methods},
+	{Py_tp_new, (void *) PyType_GenericNew},
+	{Py_bf_getbuffer, (void *) certificate_x509_getbuffer},
+	{0, NULL}
+};
+
+static PyType_Spec certificate_x509_spec = {
 	"_certificate.X509",
 	sizeof (certificate_x509),
-	0,			/*tp_itemsize */
-	(destructor) certificate_x509_dealloc,
-	0,			/*tp_print */
-	0,			/*tp_getattr */
-	0,			/*tp_setattr */
-	0,			/*tp_compare */
-	0,			/*tp_repr */
-	0,			/*tp_as_number */
-	0,			/*tp_as_sequence */
-	0,			/*tp_as_mapping */
-	0,			/*tp_hash */
-	0,			/*tp_call */
-	0,			/*tp_str */
-	0,			/*tp_getattro */
-	0,			/*tp_setattro */
-	0,			/*tp_as_buffer */
-	Py_TPFLAGS_DEFAULT,	/*tp_flags */
-	"X509 Certificate",	/* tp_doc */
-	0,			/* tp_traverse */
-	0,			/* tp_clear */
-	0,			/* tp_richcompare */
-	0,			/* tp_weaklistoffset */
-	0,			/* tp_iter */
-	0,			/* tp_iternext */
-	x509_methods,		/* tp_methods */
-	0,			/* tp_members */
-	0,			/* tp_getset */
-	0,			/* tp_base */
-	0,			/* tp_dict */
-	0,			/* tp_descr_get */
-	0,			/* tp_descr_set */
-	0,			/* tp_dictoffset */
-	0,			/* tp_init */
-	0,			/* tp_alloc */
-	0,			/* tp_new */
+	0,
+#if PY_MAJOR_VERSION >= 3
+	TYPE_FLAGS,
+#else
+	TYPE_FLAGS | Py_TPFLAGS_HAVE_NEWBUFFER,
+#endif
+	certificate_x509_slots
+};
+
+static PyType_Slot private_key_slots[] = {
+	{Py_tp_dealloc, (void *) private_key_dealloc},
+	{Py_tp_doc, (void *) "Private Key"},
+	{Py_tp_new, (void *) PyType_GenericNew},
+	{0, NULL}
 };
 
-static PyTypeObject private_key_type = {
-	PyVarObject_HEAD_INIT (NULL, 0)
+static PyType_Spec private_key_spec = {
 	"_certificate.PrivateKey",
 	sizeof (private_key),
-	0,			/*tp_itemsize */
-	(destructor) private_key_dealloc,
-	0,			/*tp_print */
-	0,			/*tp_getattr */
-	0,			/*tp_setattr */
-	0,			/*tp_compare */
-	0,			/*tp_repr */
-	0,			/*tp_as_number */
-	0,			/*tp_as_sequence */
-	0,			/*tp_as_mapping */
-	0,			/*tp_hash */
-	0,			/*tp_call */
-	0,			/*tp_str */
-	0,			/*tp_getattro */
-	0,			/*tp_setattro */
-	0,			/*tp_as_buffer */
-	Py_TPFLAGS_DEFAULT,	/*tp_flags */
-	"Private Key",	    /* tp_doc */
-	0,			/* tp_traverse */
-	0,			/* tp_clear */
-	0,			/* tp_richcompare */
-	0,			/* tp_weaklistoffset */
-	0,			/* tp_iter */
-	0,			/* tp_iternext */
-	0,			/* tp_methods */
-	0,			/* tp_members */
-	0,			/* tp_getset */
-	0,			/* tp_base */
-	0,			/* tp_dict */
-	0,			/* tp_descr_get */
-	0,			/* tp_descr_set */
-	0,			/* tp_dictoffset */
-	0,			/* tp_init */
-	0,			/* tp_alloc */
-	0,			/* tp_new */
+	0,
+	TYPE_FLAGS,
+	private_key_slots
 };
 
 static size_t
@@ -216,55 +409,7 @@ get_extension_by_object (X509 *x509, ASN1_OBJECT *obj, char **output)
 	if (pos < 0) {
 		return 0;
 	}
-	X509_EXTENSION *ext = X509_get_ext (x509, pos);
-
-	int tag;
-	long len;
-	int tc;
-	const unsigned char *p = X509_EXTENSION_get_data(ext)->data;
-
-	ASN1_get_object (&p, &len, &tag, &tc, X509_EXTENSION_get_data(ext)->length);
-
-	size_t size;
-	switch (tag) {
-		case V_ASN1_UTF8STRING:
-			{
-				ASN1_UTF8STRING *str =
-					ASN1_item_unpack (X509_EXTENSION_get_data(ext),
-							  ASN1_ITEM_rptr
-							  (ASN1_UTF8STRING));
-				*output = strndup ((const char *)
-						   ASN1_STRING_get0_data (str),
-						   str->length);
-				size = str->length;
-				ASN1_UTF8STRING_free (str);
-				return size;
-			}
-		case V_ASN1_OCTET_STRING:
-			{
-				ASN1_OCTET_STRING *octstr =
-					ASN1_item_unpack (X509_EXTENSION_get_data(ext),
-							  ASN1_ITEM_rptr
-							  (ASN1_OCTET_STRING));
-				*output = malloc (octstr->length);
-				memcpy (*output, octstr->data, octstr->length);
-				size = octstr->length;
-				ASN1_OCTET_STRING_free (octstr);
-				return size;
-			}
-		default:
-			{
-				BIO *bio = BIO_new (BIO_s_mem ());
-				X509V3_EXT_print (bio, ext, 0, 0);
-
-				size_t size = BIO_ctrl_pending (bio);
-				char *buf = malloc (sizeof (char) * size);
-				BIO_read (bio, buf, size);
-				*output = buf;
-				BIO_free (bio);
-				return size;
-			}
-	}
+	return rhsm_extension_value (X509_get_ext (x509, pos), output);
 }
 
 static ASN1_OBJECT *
@@ -280,352 +425,4158 @@ get_object_by_name (const char *name)
 	return OBJ_nid2obj (nid);
 }
 
+/* Wrap either x509 or compact, taking ownership */
 static PyObject *
-load_cert (PyObject *self, PyObject *args, PyObject *keywords)
+certificate_x509_new (certificate_state *state, X509 *x509,
+		      rhsm_cert *compact)
 {
-	const char *file_name = NULL;
-	const char *pem = NULL;
+	PyTypeObject *type = state->x509_type;
+	certificate_x509 *py_x509 =
+		(certificate_x509 *) type->tp_alloc (type, 0);
+	if (py_x509 == NULL) {
+		X509_free (x509);
+		free (compact);
+		return NULL;
+	}
+	py_x509->x509 = x509;
+	py_x509->compact = compact;
+	py_x509->ext_table = compact != NULL ? compact->ext_table : NULL;
+	py_x509->ext_count = compact != NULL ? compact->ext_count : 0;
+	return (PyObject *) py_x509;
+}
 
-	static char *keywordlist[] = { "file", "pem", NULL };
+/*
+ * There is an X509 type per module instance, so certificates are
+ * recognised by their dealloc; certificate_x509_converter does the same
+ * as an "O&" converter.
+ */
+static int
+certificate_x509_check (PyObject *object)
+{
+	return Py_TYPE (object)->tp_dealloc ==
+		(destructor) certificate_x509_dealloc;
+}
 
-	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|ss", keywordlist,
-					  &file_name, &pem)) {
-		return NULL;
+static int
+certificate_x509_converter (PyObject *object, void *cert)
+{
+	if (!certificate_x509_check (object)) {
+		PyErr_Format (PyExc_TypeError,
+			      "expected a _certificate.X509, not %.50s",
+			      Py_TYPE (object)->tp_name);
+		return 0;
 	}
+	*(certificate_x509 **) cert = (certificate_x509 *) object;
+	return 1;
+}
 
-	BIO *bio;
-	if (pem != NULL) {
-		bio = BIO_new_mem_buf ((void *) pem, strlen (pem));
-	} else {
-		bio = BIO_new_file (file_name, "r");
+/*
+ * A BIO reading data in place, or the file if there is no data. data may
+ * come from any buffer (str, bytes, bytearray, memoryview, mmap), which
+ * must stay held while the BIO is used.
+ */
+static BIO *
+input_bio (const char *file_name, const void *data, Py_ssize_t length)
+{
+	if (data != NULL) {
+		return BIO_new_mem_buf ((void *) data, length);
+	} else if (file_name != NULL) {
+		return BIO_new_file (file_name, "r");
+	}
+	return NULL;
+}
+
+static void
+input_release (Py_buffer *pem, Py_buffer *der)
+{
+	if (pem->buf != NULL) {
+		PyBuffer_Release (pem);
 	}
+	if (der->buf != NULL) {
+		PyBuffer_Release (der);
+	}
+}
 
-	X509 *x509 = PEM_read_bio_X509 (bio, NULL, NULL, NULL);
+/*
+ * Wrap the certificate in data (or the file), or return None if there is
+ * none. The GIL is released while OpenSSL decodes it.
+ */
+static PyObject *
+certificate_decode (certificate_state *state, const char *file_name,
+		    const void *data, Py_ssize_t length, int is_der,
+		    int compact)
+{
+	X509 *x509 = NULL;
+	rhsm_cert *compact_cert = NULL;
+	int compact_failed = 0;
+	BEGIN_OPENSSL;
+	BIO *bio = input_bio (file_name, data, length);
+	if (bio != NULL && is_der) {
+		x509 = d2i_X509_bio (bio, NULL);
+	} else if (bio != NULL) {
+		x509 = PEM_read_bio_X509 (bio, NULL, NULL, NULL);
+	}
 	BIO_free (bio);
+	if (x509 != NULL && compact) {
+		compact_cert = rhsm_cert_from_x509 (x509);
+		compact_failed = compact_cert == NULL;
+		X509_free (x509);
+		x509 = NULL;
+	}
+	END_OPENSSL;
 
-	if (x509 == NULL) {
+	if (compact_failed) {
+		return PyErr_NoMemory ();
+	}
+	if (x509 == NULL && compact_cert == NULL) {
 		Py_INCREF (Py_None);
 		return Py_None;
 	}
 
-	certificate_x509 *py_x509 =
-		(certificate_x509 *) _PyObject_New (&certificate_x509_type);
-	py_x509->x509 = x509;
-	return (PyObject *) py_x509;
+	return certificate_x509_new (state, x509, compact_cert);
 }
 
+/* Same as certificate_decode, for private keys */
 static PyObject *
-load_private_key (PyObject *self, PyObject *args, PyObject *keywords)
+private_key_decode (certificate_state *state, const char *file_name,
+		    const void *data, Py_ssize_t length, int is_der)
 {
-	const char *file_name = NULL;
-	const char *pem = NULL;
-
-	static char *keywordlist[] = { "file", "pem", NULL };
-
-	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|ss", keywordlist,
-					  &file_name, &pem)) {
-		return NULL;
-	}
-
-	BIO *bio;
-	if (pem != NULL) {
-		bio = BIO_new_mem_buf ((void *) pem, strlen (pem));
-	} else {
-		bio = BIO_new_file (file_name, "r");
+	EVP_PKEY *key = NULL;
+	BEGIN_OPENSSL;
+	BIO *bio = input_bio (file_name, data, length);
+	if (bio != NULL && is_der) {
+		key = d2i_PrivateKey_bio (bio, NULL);
+	} else if (bio != NULL) {
+		key = PEM_read_bio_PrivateKey (bio, NULL, NULL, NULL);
 	}
-
-	EVP_PKEY* key = PEM_read_bio_PrivateKey (bio, NULL, NULL, NULL);
 	BIO_free (bio);
+	END_OPENSSL;
 
 	if (key == NULL) {
 		Py_INCREF (Py_None);
 		return Py_None;
 	}
 
-	private_key *py_key =
-		(private_key *) _PyObject_New (&private_key_type);
+	PyTypeObject *type = state->private_key_type;
+	private_key *py_key = (private_key *) type->tp_alloc (type, 0);
+	if (py_key == NULL) {
+		EVP_PKEY_free (key);
+		return NULL;
+	}
 	py_key->key = key;
 	return (PyObject *) py_key;
 }
 
 static PyObject *
-get_extension (certificate_x509 *self, PyObject *args, PyObject *keywords)
+load_cert (PyObject *self, PyObject *args, PyObject *keywords)
 {
-	const char *oid = NULL;
-	const char *name = NULL;
+	const char *file_name = NULL;
+	Py_buffer pem = { NULL };
+	Py_buffer der = { NULL };
+	int compact = 0;
 
-	static char *keywordlist[] = { "oid", "name", NULL };
+	static char *keywordlist[] = { "file", "pem", "compact", "der", NULL };
 
-	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|ss", keywordlist,
-					  &oid, &name)) {
+	if (!PyArg_ParseTupleAndKeywords (args, keywords,
+					  "|zs*i" BINARY_FORMAT, keywordlist,
+					  &file_name, &pem, &compact, &der)) {
 		return NULL;
 	}
 
-	char *value = NULL;
-	size_t length;
-	ASN1_OBJECT *obj = NULL;
-	if (name != NULL) {
-		obj = get_object_by_name (name);
-	} else {
-		obj = get_object_by_oid (oid);
+	Py_buffer *input = der.buf != NULL ? &der : &pem;
+	PyObject *result = certificate_decode (get_state (self), file_name,
+					       input->buf, input->len,
+					       der.buf != NULL, compact);
+	input_release (&pem, &der);
+	return result;
+}
+
+static PyObject *
+load_private_key (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *file_name = NULL;
+	Py_buffer pem = { NULL };
+	Py_buffer der = { NULL };
+
+	static char *keywordlist[] = { "file", "pem", "der", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords,
+					  "|zs*" BINARY_FORMAT, keywordlist,
+					  &file_name, &pem, &der)) {
+		return NULL;
 	}
 
-	if (obj == NULL) {
-		Py_INCREF (Py_None);
-		return Py_None;
+	Py_buffer *input = der.buf != NULL ? &der : &pem;
+	PyObject *result = private_key_decode (get_state (self), file_name,
+					       input->buf, input->len,
+					       der.buf != NULL);
+	input_release (&pem, &der);
+	return result;
+}
+
+/*
+ * Bulk loading. Reading and PEM decoding a few thousand entitlement
+ * certificates one python call at a time is slow, so load_many and
+ * load_directory hand the whole batch to a small pool of native threads
+ * and only come back to the interpreter to wrap the results.
+ *
+ * OpenSSL before 1.1.0 needs locking callbacks to be used from several
+ * threads, which we do not install, so there the batch is loaded serially
+ * (still without holding the GIL).
+ */
+typedef struct {
+	char *path;
+	char *data;
+	size_t length;
+	X509 *x509;
+	rhsm_cert *compact;
+	int error;
+	unsigned long ssl_error;
+} load_job;
+
+typedef struct {
+	load_job *jobs;
+	size_t count;
+	size_t next;
+	int compact;
+	pthread_mutex_t lock;
+} load_queue;
+
+static void
+load_job_run (load_job *job, int compact)
+{
+	job->data = rhsm_read_file (job->path, &job->length, &job->error);
+	if (job->data == NULL) {
+		return;
 	}
 
-	length = get_extension_by_object (self->x509, obj, &value);
-	ASN1_OBJECT_free (obj);
-	if (value != NULL) {
-		PyObject *extension = PyBytes_FromStringAndSize (value,
-								  length);
-		free (value);
-		return extension;
-	} else {
-		Py_INCREF (Py_None);
-		return Py_None;
+	BIO *bio = BIO_new_mem_buf (job->data, job->length);
+	job->x509 = PEM_read_bio_X509 (bio, NULL, NULL, NULL);
+	BIO_free (bio);
+
+	if (job->x509 == NULL) {
+		job->ssl_error = ERR_peek_last_error ();
+		ERR_clear_error ();
+	} else if (compact) {
+		job->compact = rhsm_cert_from_x509 (job->x509);
+		if (job->compact == NULL) {
+			job->error = ENOMEM;
+		}
+		X509_free (job->x509);
+		job->x509 = NULL;
 	}
 }
 
-static PyObject *
-get_all_extensions (certificate_x509 *self, PyObject *args)
+static void *
+load_worker (void *arg)
 {
-	if (!PyArg_ParseTuple (args, "")) {
-		return NULL;
+	load_queue *queue = arg;
+	while (1) {
+		pthread_mutex_lock (&queue->lock);
+		size_t i = queue->next++;
+		pthread_mutex_unlock (&queue->lock);
+
+		if (i >= queue->count) {
+			break;
+		}
+		load_job_run (&queue->jobs[i], queue->compact);
 	}
+	return NULL;
+}
 
-	int i;
-	int ext_count = X509_get_ext_count (self->x509);
+static int
+load_thread_count (size_t jobs, int requested)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	return 1;
+#else
+	long threads = requested;
+	if (threads <= 0) {
+		threads = sysconf (_SC_NPROCESSORS_ONLN);
+		if (threads > MAX_LOAD_THREADS) {
+			threads = MAX_LOAD_THREADS;
+		}
+	}
+	if (threads > (long) jobs) {
+		threads = jobs;
+	}
+	return threads < 1 ? 1 : threads;
+#endif
+}
 
-	char oid[MAX_BUF];
-	PyObject *dict = PyDict_New ();
-	for (i = 0; i < ext_count; i++) {
-		X509_EXTENSION *ext = X509_get_ext (self->x509, i);
+/*
+ * Run every job on up to "threads" threads, the calling one included,
+ * compacting the certificates if asked to. Must be called without the GIL.
+ */
+static void
+load_jobs_run (load_job *jobs, size_t count, int threads, int compact)
+{
+	load_queue queue;
+	queue.jobs = jobs;
+	queue.count = count;
+	queue.next = 0;
+	queue.compact = compact;
+	pthread_mutex_init (&queue.lock, NULL);
 
-		OBJ_obj2txt (oid, MAX_BUF, X509_EXTENSION_get_object(ext), 1);
-		PyObject *key = PyString_FromString (oid);
+	int started = 0;
+	pthread_t *pool = malloc (sizeof (pthread_t) * threads);
+	while (pool != NULL && started < threads - 1) {
+		if (pthread_create (&pool[started], NULL, load_worker,
+				    &queue) != 0) {
+			/* Whatever is left gets done by this thread */
+			break;
+		}
+		started++;
+	}
 
-		char *value = NULL;
-		size_t length =
-			get_extension_by_object (self->x509, X509_EXTENSION_get_object(ext),
-						 &value);
+	load_worker (&queue);
 
-		PyObject *dict_value = PyBytes_FromStringAndSize (value,
-								   length);
-		free (value);
-		PyDict_SetItem (dict, key, dict_value);
+	int i;
+	for (i = 0; i < started; i++) {
+		pthread_join (pool[i], NULL);
+	}
+	free (pool);
+	pthread_mutex_destroy (&queue.lock);
+}
 
-		Py_DECREF (key);
-		Py_DECREF (dict_value);
+static void
+load_jobs_free (load_job *jobs, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		free (jobs[i].path);
+		free (jobs[i].data);
+		X509_free (jobs[i].x509);
+		rhsm_cert_free (jobs[i].compact);
 	}
+	free (jobs);
+}
 
-	return dict;
+/* Describe why a job has no certificate */
+static void
+load_job_error (load_job *job, char *message)
+{
+	if (job->error != 0) {
+		snprintf (message, MAX_BUF, "%s", strerror (job->error));
+	} else if (job->ssl_error != 0) {
+		ERR_error_string_n (job->ssl_error, message, MAX_BUF);
+	} else {
+		snprintf (message, MAX_BUF, "no certificate found");
+	}
 }
 
+/*
+ * Turn finished jobs into a (loaded, failed) tuple. Ownership of each
+ * X509 or compact certificate moves to its python wrapper.
+ */
 static PyObject *
-as_pem (certificate_x509 *self, PyObject *args)
+load_jobs_result (certificate_state *state, load_job *jobs, size_t count)
 {
-	if (!PyArg_ParseTuple (args, "")) {
-		return NULL;
+	PyObject *loaded = PyList_New (0);
+	PyObject *failed = PyList_New (0);
+	if (loaded == NULL || failed == NULL) {
+		goto error;
 	}
 
-	BIO *bio = BIO_new (BIO_s_mem ());
-	PEM_write_bio_X509 (bio, self->x509);
+	size_t i;
+	for (i = 0; i < count; i++) {
+		load_job *job = &jobs[i];
+		PyObject *item;
 
-	size_t size = BIO_ctrl_pending (bio);
-	char *buf = malloc (sizeof (char) * size);
-	BIO_read (bio, buf, size);
-	BIO_free (bio);
+		if (job->x509 != NULL || job->compact != NULL) {
+			PyObject *pem = PyString_FromStringAndSize (job->data,
+								    job->length);
+			if (pem == NULL) {
+				/* Not text, report it like any other bad file */
+				PyErr_Clear ();
+				item = Py_BuildValue ("(ss)", job->path,
+						      "certificate is not valid UTF-8");
+			} else {
+				PyObject *py_x509 =
+					certificate_x509_new (state, job->x509,
+							      job->compact);
+				job->x509 = NULL;
+				job->compact = NULL;
+				if (py_x509 == NULL) {
+					Py_DECREF (pem);
+					goto error;
+				}
+				item = Py_BuildValue ("(sNN)", job->path, py_x509,
+						      pem);
+				if (item == NULL) {
+					goto error;
+				}
+				if (PyList_Append (loaded, item) < 0) {
+					Py_DECREF (item);
+					goto error;
+				}
+				Py_DECREF (item);
+				continue;
+			}
+		} else {
+			char message[MAX_BUF];
+			load_job_error (job, message);
+			item = Py_BuildValue ("(ss)", job->path, message);
+		}
 
-	PyObject *pem = PyString_FromStringAndSize (buf, size);
-	free (buf);
-	return pem;
+		if (item == NULL) {
+			goto error;
+		}
+		if (PyList_Append (failed, item) < 0) {
+			Py_DECREF (item);
+			goto error;
+		}
+		Py_DECREF (item);
+	}
+
+	return Py_BuildValue ("(NN)", loaded, failed);
+
+error:
+	Py_XDECREF (loaded);
+	Py_XDECREF (failed);
+	return NULL;
 }
 
 static PyObject *
-as_text (certificate_x509 *self, PyObject *args)
+load_paths (certificate_state *state, load_job *jobs, size_t count,
+	    int threads, int compact)
 {
-	if (!PyArg_ParseTuple (args, "")) {
-		return NULL;
-	}
-
-	BIO *bio = BIO_new (BIO_s_mem ());
-	X509_print (bio, self->x509);
+	threads = load_thread_count (count, threads);
 
-	size_t size = BIO_ctrl_pending (bio);
-	char *buf = malloc (sizeof (char) * size);
-	BIO_read (bio, buf, size);
-	BIO_free (bio);
+	BEGIN_OPENSSL;
+	load_jobs_run (jobs, count, threads, compact);
+	END_OPENSSL;
 
-	PyObject *pem = PyString_FromStringAndSize (buf, size);
-	free (buf);
-	return pem;
+	PyObject *result = load_jobs_result (state, jobs, count);
+	load_jobs_free (jobs, count);
+	return result;
 }
 
 static PyObject *
-get_serial_number (certificate_x509 *self, PyObject *args)
+load_many (PyObject *self, PyObject *args, PyObject *keywords)
 {
-	PyObject *ret;
+	PyObject *paths = NULL;
+	int threads = 0;
+	int compact = 0;
 
-	if (!PyArg_ParseTuple (args, "")) {
+	static char *keywordlist[] = { "paths", "threads", "compact", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "O|ii", keywordlist,
+					  &paths, &threads, &compact)) {
 		return NULL;
 	}
 
-	ASN1_INTEGER *serial_asn = X509_get_serialNumber (self->x509);
+	PyObject *seq = PySequence_Fast (paths, "paths must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	size_t count = PySequence_Fast_GET_SIZE (seq);
+	load_job *jobs = calloc (count ? count : 1, sizeof (load_job));
+	if (jobs == NULL) {
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	/* Copy the paths so the list can't change under the workers */
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const char *path;
+		if (!PyArg_Parse (PySequence_Fast_GET_ITEM (seq, i), "s",
+				  &path)) {
+			load_jobs_free (jobs, count);
+			Py_DECREF (seq);
+			return NULL;
+		}
+		jobs[i].path = strdup (path);
+		if (jobs[i].path == NULL) {
+			load_jobs_free (jobs, count);
+			Py_DECREF (seq);
+			return PyErr_NoMemory ();
+		}
+	}
+	Py_DECREF (seq);
+
+	return load_paths (get_state (self), jobs, count, threads, compact);
+}
+
+/*
+ * One job per file in dir_name ending in suffix but not exclude, sorted by
+ * path. Returns NULL with errno set on failure.
+ */
+static load_job *
+directory_jobs (const char *dir_name, const char *suffix, const char *exclude,
+		size_t *count)
+{
+	char **paths = rhsm_dir_list (dir_name, suffix, exclude, count);
+	if (paths == NULL) {
+		return NULL;
+	}
+
+	load_job *jobs = calloc (*count + 1, sizeof (load_job));
+	if (jobs == NULL) {
+		rhsm_dir_list_free (paths, *count);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* The jobs take over the paths */
+	size_t i;
+	for (i = 0; i < *count; i++) {
+		jobs[i].path = paths[i];
+	}
+	free (paths);
+	return jobs;
+}
+
+static PyObject *
+load_directory (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *dir_name = NULL;
+	const char *suffix = ".pem";
+	const char *exclude = NULL;
+	int threads = 0;
+	int compact = 0;
+
+	static char *keywordlist[] = { "dir", "suffix", "exclude", "threads",
+		"compact", NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "s|szii", keywordlist,
+					  &dir_name, &suffix, &exclude,
+					  &threads, &compact)) {
+		return NULL;
+	}
+
+	size_t count;
+	load_job *jobs = directory_jobs (dir_name, suffix, exclude, &count);
+	if (jobs == NULL) {
+		return PyErr_SetFromErrnoWithFilename (PyExc_OSError,
+						       (char *) dir_name);
+	}
+
+	return load_paths (get_state (self), jobs, count, threads, compact);
+}
+
+/*
+ * Validity states reported by scan_validity. They don't overlap: an
+ * expiring certificate is not also listed as valid.
+ */
+enum {
+	SCAN_VALID,
+	SCAN_EXPIRING,
+	SCAN_EXPIRED,
+	SCAN_FUTURE,
+	SCAN_FAILED,
+	SCAN_STATES
+};
+
+static const char *scan_state_names[SCAN_STATES] = {
+	"valid", "expiring", "expired", "future", "failed"
+};
+
+static PyObject *
+scan_validity (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *dir_name = NULL;
+	PyObject *on_date_arg = Py_None;
+	long long warning_window = 0;
+	const char *suffix = ".pem";
+	const char *exclude = NULL;
+	int threads = 0;
+
+	static char *keywordlist[] = { "dir", "on_date", "warning_window",
+		"suffix", "exclude", "threads", NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "s|OLszi",
+					  keywordlist, &dir_name, &on_date_arg,
+					  &warning_window, &suffix, &exclude,
+					  &threads)) {
+		return NULL;
+	}
+
+	long long on_date;
+	if (on_date_arg == Py_None) {
+		on_date = (long long) time (NULL);
+	} else {
+		on_date = PyLong_AsLongLong (on_date_arg);
+		if (on_date == -1 && PyErr_Occurred ()) {
+			return NULL;
+		}
+	}
+
+	size_t count;
+	load_job *jobs = directory_jobs (dir_name, suffix, exclude, &count);
+	if (jobs == NULL) {
+		return PyErr_SetFromErrnoWithFilename (PyExc_OSError,
+						       (char *) dir_name);
+	}
+	int *states = calloc (count + 1, sizeof (int));
+	if (states == NULL) {
+		load_jobs_free (jobs, count);
+		return PyErr_NoMemory ();
+	}
+
+	threads = load_thread_count (count, threads);
+	size_t i;
+
+	BEGIN_OPENSSL;
+	load_jobs_run (jobs, count, threads, 0);
+
+	for (i = 0; i < count; i++) {
+		long long not_before;
+		long long not_after;
+
+		if (jobs[i].x509 == NULL ||
+		    rhsm_x509_validity (jobs[i].x509, &not_before, &not_after) < 0) {
+			states[i] = SCAN_FAILED;
+		} else if (not_after < on_date) {
+			states[i] = SCAN_EXPIRED;
+		} else if (not_before > on_date) {
+			states[i] = SCAN_FUTURE;
+		} else if (not_after - warning_window < on_date) {
+			states[i] = SCAN_EXPIRING;
+		} else {
+			states[i] = SCAN_VALID;
+		}
+	}
+	END_OPENSSL;
+
+	PyObject *result = PyDict_New ();
+	PyObject *lists[SCAN_STATES];
+	int state;
+	for (state = 0; state < SCAN_STATES; state++) {
+		lists[state] = PyList_New (0);
+		if (result != NULL && (lists[state] == NULL ||
+		    PyDict_SetItemString (result, scan_state_names[state],
+					  lists[state]) < 0)) {
+			Py_CLEAR (result);
+		}
+		Py_XDECREF (lists[state]);
+	}
+
+	for (i = 0; result != NULL && i < count; i++) {
+		PyObject *item;
+		if (states[i] == SCAN_FAILED) {
+			char message[MAX_BUF];
+			if (jobs[i].x509 != NULL) {
+				snprintf (message, MAX_BUF, "invalid validity dates");
+			} else {
+				load_job_error (&jobs[i], message);
+			}
+			item = Py_BuildValue ("(ss)", jobs[i].path, message);
+		} else {
+			item = PyString_FromString (jobs[i].path);
+		}
+		if (item == NULL ||
+		    PyList_Append (lists[states[i]], item) < 0) {
+			Py_CLEAR (result);
+		}
+		Py_XDECREF (item);
+	}
+
+	free (states);
+	load_jobs_free (jobs, count);
+	return result;
+}
+
+/* Same as get_extension_by_object, from a compact certificate's table */
+static size_t
+compact_extension_by_object (rhsm_cert *compact, ASN1_OBJECT *obj,
+			     char **output)
+{
+	char oid[MAX_BUF];
+	OBJ_obj2txt (oid, MAX_BUF, obj, 1);
+
+	const rhsm_ext *entry = rhsm_cert_find_extension (compact, oid);
+	if (entry == NULL) {
+		return 0;
+	}
+	*output = malloc (entry->length + 1);
+	if (*output == NULL) {
+		return 0;
+	}
+	memcpy (*output, entry->value, entry->length);
+	(*output)[entry->length] = '\0';
+	return entry->length;
+}
+
+static PyObject *
+get_extension_by_oid_or_name (certificate_x509 *self, const char *oid,
+			      const char *name)
+{
+	char *value = NULL;
+	size_t length = 0;
+	ASN1_OBJECT *obj = NULL;
+
+	BEGIN_OPENSSL;
+	if (name != NULL) {
+		obj = get_object_by_name (name);
+	} else {
+		obj = get_object_by_oid (oid);
+	}
+
+	if (obj != NULL) {
+		if (self->compact != NULL) {
+			length = compact_extension_by_object (self->compact,
+							      obj, &value);
+		} else {
+			length = get_extension_by_object (self->x509, obj,
+							  &value);
+		}
+		ASN1_OBJECT_free (obj);
+	}
+	END_OPENSSL;
+
+	if (value != NULL) {
+		PyObject *extension = PyBytes_FromStringAndSize (value,
+								  length);
+		free (value);
+		return extension;
+	} else {
+		Py_INCREF (Py_None);
+		return Py_None;
+	}
+}
+
+#ifdef USE_FASTCALL
+/*
+ * get_extension is called for every extension of every certificate the
+ * tools look at, so it takes its arguments without an args tuple and
+ * kwargs dict being built for each call.
+ */
+static PyObject *
+get_extension (certificate_x509 *self, PyObject *const *args,
+	       Py_ssize_t nargs, PyObject *kwnames)
+{
+	static const char *keywordlist[] = { "oid", "name" };
+	const char *values[2] = { NULL, NULL };
+
+	if (nargs > 2) {
+		PyErr_Format (PyExc_TypeError,
+			      "get_extension() takes at most 2 arguments "
+			      "(%zd given)", nargs);
+		return NULL;
+	}
+
+	Py_ssize_t count = nargs;
+	if (kwnames != NULL) {
+		count += PyTuple_GET_SIZE (kwnames);
+	}
+
+	Py_ssize_t i;
+	for (i = 0; i < count; i++) {
+		int slot = i;
+		if (i >= nargs) {
+			PyObject *key = PyTuple_GET_ITEM (kwnames, i - nargs);
+			for (slot = 0; slot < 2; slot++) {
+				if (PyUnicode_CompareWithASCIIString
+				    (key, keywordlist[slot]) == 0) {
+					break;
+				}
+			}
+			if (slot == 2) {
+				PyErr_Format (PyExc_TypeError,
+					      "'%U' is an invalid keyword "
+					      "argument for get_extension()", key);
+				return NULL;
+			}
+			if (values[slot] != NULL) {
+				PyErr_Format (PyExc_TypeError,
+					      "argument for get_extension() "
+					      "given by name ('%s') and position",
+					      keywordlist[slot]);
+				return NULL;
+			}
+		}
+
+		if (!PyUnicode_Check (args[i])) {
+			PyErr_Format (PyExc_TypeError,
+				      "get_extension() argument '%s' must be "
+				      "str, not %.50s", keywordlist[slot],
+				      Py_TYPE (args[i])->tp_name);
+			return NULL;
+		}
+		Py_ssize_t length;
+		values[slot] = PyUnicode_AsUTF8AndSize (args[i], &length);
+		if (values[slot] == NULL) {
+			return NULL;
+		}
+		if (strlen (values[slot]) != (size_t) length) {
+			PyErr_SetString (PyExc_ValueError,
+					 "embedded null character");
+			return NULL;
+		}
+	}
+
+	return get_extension_by_oid_or_name (self, values[0], values[1]);
+}
+#else
+static PyObject *
+get_extension (certificate_x509 *self, PyObject *args, PyObject *keywords)
+{
+	const char *oid = NULL;
+	const char *name = NULL;
+
+	static char *keywordlist[] = { "oid", "name", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|ss", keywordlist,
+					  &oid, &name)) {
+		return NULL;
+	}
+
+	return get_extension_by_oid_or_name (self, oid, name);
+}
+#endif
+
+static int
+certificate_x509_ext_table (certificate_x509 *self)
+{
+	int built;
+	BEGIN_OBJECT_LOCK (self);
+	built = self->ext_table != NULL;
+	END_OBJECT_LOCK;
+	if (built) {
+		return 0;
+	}
+
+	rhsm_ext *table = NULL;
+	int count;
+
+	BEGIN_OPENSSL;
+	count = rhsm_ext_table_build (self->x509, &table);
+	END_OPENSSL;
+
+	if (count < 0) {
+		PyErr_NoMemory ();
+		return -1;
+	}
+
+	BEGIN_OBJECT_LOCK (self);
+	built = self->ext_table != NULL;
+	if (!built) {
+		self->ext_table = table;
+		self->ext_count = count;
+	}
+	END_OBJECT_LOCK;
+	if (built) {
+		/* Another thread built it while we were off the GIL */
+		rhsm_ext_table_free (table, count);
+	}
+	return 0;
+}
+
+typedef struct {
+	const char *start;
+	size_t length;
+} oid_part;
+
+#define MAX_OID_PARTS 128
+
+/* Split a dotted oid, returns the number of parts or -1 if too long */
+static int
+split_oid (const char *oid, oid_part *parts)
+{
+	int count = 0;
+	const char *start = oid;
+	const char *p;
+	for (p = oid;; p++) {
+		if (*p == '.' || *p == '\0') {
+			if (count == MAX_OID_PARTS) {
+				return -1;
+			}
+			parts[count].start = start;
+			parts[count].length = p - start;
+			count++;
+			if (*p == '\0') {
+				return count;
+			}
+			start = p + 1;
+		}
+	}
+}
+
+static int
+oid_part_match (oid_part *part, oid_part *pattern)
+{
+	if (pattern->length == 1 && pattern->start[0] == '*') {
+		return 1;
+	}
+	return part->length == pattern->length &&
+		memcmp (part->start, pattern->start, part->length) == 0;
+}
+
+/*
+ * Same rules as rhsm.certificate.OID.match: '*' matches any one part, a
+ * leading '.' matches the end of the oid and a trailing '.' its start.
+ */
+static int
+oid_match (oid_part *oid, int oid_count, oid_part *pattern, int pattern_count)
+{
+	int offset = 0;
+
+	if (pattern[0].length == 0) {
+		pattern++;
+		pattern_count--;
+		offset = oid_count - pattern_count;
+		if (offset < 0) {
+			return 0;
+		}
+	} else if (pattern[pattern_count - 1].length == 0) {
+		pattern_count--;
+		if (oid_count < pattern_count) {
+			return 0;
+		}
+	} else if (oid_count != pattern_count) {
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < pattern_count; i++) {
+		if (!oid_part_match (&oid[offset + i], &pattern[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static PyObject *
+get_all_extensions (certificate_x509 *self, PyObject *args)
+{
+	if (certificate_x509_ext_table (self) < 0) {
+		return NULL;
+	}
+
+	PyObject *dict = PyDict_New ();
+	int i;
+	for (i = 0; dict != NULL && i < self->ext_count; i++) {
+		rhsm_ext *entry = &self->ext_table[i];
+		PyObject *key = PyString_FromString (entry->oid);
+		PyObject *value = PyBytes_FromStringAndSize (entry->value,
+							     entry->length);
+		if (key == NULL || value == NULL ||
+		    PyDict_SetItem (dict, key, value) < 0) {
+			Py_CLEAR (dict);
+		}
+		Py_XDECREF (key);
+		Py_XDECREF (value);
+	}
+	return dict;
+}
+
+static PyObject *
+get_extensions (certificate_x509 *self, PyObject *args, PyObject *keywords)
+{
+	const char *prefix = NULL;
+
+	static char *keywordlist[] = { "prefix", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|z", keywordlist,
+					  &prefix)) {
+		return NULL;
+	}
+
+	oid_part pattern[MAX_OID_PARTS];
+	int pattern_count = 0;
+	if (prefix != NULL) {
+		pattern_count = split_oid (prefix, pattern);
+		if (pattern_count > 1 &&
+		    pattern[pattern_count - 1].length == 0) {
+			pattern_count--;
+		}
+		if (pattern_count < 0 || pattern[0].length == 0) {
+			PyErr_SetString (PyExc_ValueError, "invalid oid prefix");
+			return NULL;
+		}
+	}
+
+	if (certificate_x509_ext_table (self) < 0) {
+		return NULL;
+	}
+
+	/*
+	 * Without wildcards the matches are one contiguous run of the sorted
+	 * table, found by binary search on "prefix."
+	 */
+	int literal = prefix != NULL && strchr (prefix, '*') == NULL;
+	size_t literal_length = literal ? strlen (prefix) : 0;
+	int first = 0;
+	if (literal) {
+		int low = 0;
+		int high = self->ext_count;
+		while (low < high) {
+			int mid = (low + high) / 2;
+			if (strcmp (self->ext_table[mid].oid, prefix) <= 0) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		first = low;
+	}
+
+	PyObject *dict = PyDict_New ();
+	int i;
+	for (i = first; dict != NULL && i < self->ext_count; i++) {
+		rhsm_ext *entry = &self->ext_table[i];
+		oid_part parts[MAX_OID_PARTS];
+		int count = split_oid (entry->oid, parts);
+
+		if (literal &&
+		    strncmp (entry->oid, prefix, literal_length) != 0) {
+			break;
+		}
+		if (count <= pattern_count) {
+			continue;
+		}
+
+		int j;
+		for (j = 0; j < pattern_count; j++) {
+			if (!oid_part_match (&parts[j], &pattern[j])) {
+				break;
+			}
+		}
+		if (j < pattern_count) {
+			continue;
+		}
+
+		PyObject *key = PyString_FromString (parts[pattern_count].start);
+		PyObject *value = PyBytes_FromStringAndSize (entry->value,
+							     entry->length);
+		if (key == NULL || value == NULL ||
+		    PyDict_SetItem (dict, key, value) < 0) {
+			Py_CLEAR (dict);
+		}
+		Py_XDECREF (key);
+		Py_XDECREF (value);
+	}
+	return dict;
+}
+
+static PyObject *
+find_extensions (certificate_x509 *self, PyObject *args, PyObject *keywords)
+{
+	const char *oid = NULL;
+	int limit = 0;
+
+	static char *keywordlist[] = { "oid", "limit", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "s|i", keywordlist,
+					  &oid, &limit)) {
+		return NULL;
+	}
+
+	oid_part pattern[MAX_OID_PARTS];
+	int pattern_count = split_oid (oid, pattern);
+	if (pattern_count < 0) {
+		PyErr_SetString (PyExc_ValueError, "invalid oid pattern");
+		return NULL;
+	}
+
+	if (certificate_x509_ext_table (self) < 0) {
+		return NULL;
+	}
+
+	PyObject *list = PyList_New (0);
+	int i;
+	for (i = 0; list != NULL && i < self->ext_count; i++) {
+		rhsm_ext *entry = &self->ext_table[i];
+		oid_part parts[MAX_OID_PARTS];
+		int count = split_oid (entry->oid, parts);
+
+		if (count < 0 || !oid_match (parts, count, pattern,
+					     pattern_count)) {
+			continue;
+		}
+
+		PyObject *key = PyString_FromString (entry->oid);
+		PyObject *value = PyBytes_FromStringAndSize (entry->value,
+							     entry->length);
+		PyObject *item = NULL;
+		if (key != NULL && value != NULL) {
+			item = PyTuple_Pack (2, key, value);
+		}
+		if (item == NULL || PyList_Append (list, item) < 0) {
+			Py_CLEAR (list);
+		}
+		Py_XDECREF (key);
+		Py_XDECREF (value);
+		Py_XDECREF (item);
+
+		if (limit > 0 && PyList_GET_SIZE (list) == limit) {
+			break;
+		}
+	}
+	return list;
+}
+
+/*
+ * Red Hat v1 certificates keep everything in separate extensions under
+ * REDHAT_OID_NAMESPACE:
+ *   1.<product id>.<field>		products
+ *   2.<type>.<content id>		content type (yum, file, ...)
+ *   2.<type>.<content id>.<field>	content
+ *   4.<field>				order
+ * The extension table is sorted, so each product and content set is one
+ * contiguous run and listing them in table order matches the python
+ * Extensions.find() order.
+ */
+#define REDHAT_OID_NAMESPACE "1.3.6.1.4.1.2312.9."
+
+/* Set fields[field] = value, creating fields on first use */
+static int
+decode_set_field (PyObject **fields, oid_part *field, rhsm_ext *entry)
+{
+	if (*fields == NULL) {
+		*fields = PyDict_New ();
+		if (*fields == NULL) {
+			return -1;
+		}
+	}
+
+	PyObject *key = PyString_FromStringAndSize (field->start,
+						    field->length);
+	PyObject *value = PyBytes_FromStringAndSize (entry->value,
+						     entry->length);
+	int result = -1;
+	if (key != NULL && value != NULL) {
+		result = PyDict_SetItem (*fields, key, value);
+	}
+	Py_XDECREF (key);
+	Py_XDECREF (value);
+	return result;
+}
+
+/* Append (first, fields) to list if fields has a name (field "1") */
+static int
+decode_flush (PyObject *list, PyObject *first, PyObject **fields)
+{
+	int result = 0;
+	if (*fields != NULL && PyDict_GetItemString (*fields, "1") != NULL) {
+		PyObject *item = PyTuple_Pack (2, first, *fields);
+		if (item == NULL || PyList_Append (list, item) < 0) {
+			result = -1;
+		}
+		Py_XDECREF (item);
+	}
+	Py_CLEAR (*fields);
+	return result;
+}
+
+static int
+oid_part_equal (oid_part *a, oid_part *b)
+{
+	return a->length == b->length &&
+		memcmp (a->start, b->start, a->length) == 0;
+}
+
+static PyObject *
+decode_redhat_v1 (certificate_x509 *self, PyObject *args)
+{
+	if (certificate_x509_ext_table (self) < 0) {
+		return NULL;
+	}
+
+	PyObject *products = PyList_New (0);
+	PyObject *content = PyList_New (0);
+	PyObject *order = PyDict_New ();
+	PyObject *product_id = NULL;
+	PyObject *product_fields = NULL;
+	PyObject *content_type = NULL;
+	PyObject *content_fields = NULL;
+	oid_part product_key = { NULL, 0 };
+	oid_part content_key[2] = { { NULL, 0 }, { NULL, 0 } };
+	size_t prefix_length = strlen (REDHAT_OID_NAMESPACE);
+
+	if (products == NULL || content == NULL || order == NULL) {
+		goto error;
+	}
+
+	int i;
+	for (i = 0; i < self->ext_count; i++) {
+		rhsm_ext *entry = &self->ext_table[i];
+		if (strncmp (entry->oid, REDHAT_OID_NAMESPACE,
+			     prefix_length) != 0) {
+			continue;
+		}
+
+		oid_part parts[MAX_OID_PARTS];
+		int count = split_oid (entry->oid + prefix_length, parts);
+		if (count < 2 || parts[0].length != 1) {
+			continue;
+		}
+
+		switch (parts[0].start[0]) {
+			case '1':
+				if (count != 3) {
+					break;
+				}
+				if (product_id == NULL ||
+				    !oid_part_equal (&parts[1], &product_key)) {
+					if (product_id != NULL &&
+					    decode_flush (products, product_id,
+							  &product_fields) < 0) {
+						goto error;
+					}
+					Py_XDECREF (product_id);
+					product_id = PyString_FromStringAndSize
+						(parts[1].start, parts[1].length);
+					if (product_id == NULL) {
+						goto error;
+					}
+					product_key = parts[1];
+				}
+				if (decode_set_field (&product_fields, &parts[2],
+						      entry) < 0) {
+					goto error;
+				}
+				break;
+			case '2':
+				if (count != 3 && count != 4) {
+					break;
+				}
+				if (content_type == NULL ||
+				    !oid_part_equal (&parts[1], &content_key[0]) ||
+				    !oid_part_equal (&parts[2], &content_key[1])) {
+					if (content_type != NULL &&
+					    decode_flush (content, content_type,
+							  &content_fields) < 0) {
+						goto error;
+					}
+					Py_XDECREF (content_type);
+					Py_INCREF (Py_None);
+					content_type = Py_None;
+					content_key[0] = parts[1];
+					content_key[1] = parts[2];
+				}
+				if (count == 3) {
+					Py_DECREF (content_type);
+					content_type = PyBytes_FromStringAndSize
+						(entry->value, entry->length);
+					if (content_type == NULL) {
+						goto error;
+					}
+				} else if (decode_set_field (&content_fields,
+							     &parts[3],
+							     entry) < 0) {
+					goto error;
+				}
+				break;
+			case '4':
+				if (count == 2 &&
+				    decode_set_field (&order, &parts[1],
+						      entry) < 0) {
+					goto error;
+				}
+				break;
+		}
+	}
+
+	if (product_id != NULL &&
+	    decode_flush (products, product_id, &product_fields) < 0) {
+		goto error;
+	}
+	if (content_type != NULL &&
+	    decode_flush (content, content_type, &content_fields) < 0) {
+		goto error;
+	}
+	Py_XDECREF (product_id);
+	Py_XDECREF (content_type);
+
+	return Py_BuildValue ("{sNsNsN}", "products", products,
+			      "order", order, "content", content);
+
+error:
+	Py_XDECREF (products);
+	Py_XDECREF (content);
+	Py_XDECREF (order);
+	Py_XDECREF (product_id);
+	Py_XDECREF (product_fields);
+	Py_XDECREF (content_type);
+	Py_XDECREF (content_fields);
+	return NULL;
+}
+
+static PyObject *
+as_pem (certificate_x509 *self, PyObject *args)
+{
+	size_t size;
+	char *buf;
+
+	BEGIN_OPENSSL;
+	BIO *bio = BIO_new (BIO_s_mem ());
+	if (self->compact != NULL) {
+		PEM_write_bio (bio, PEM_STRING_X509, "", self->compact->der,
+			       self->compact->der_length);
+	} else {
+		PEM_write_bio_X509 (bio, self->x509);
+	}
+
+	size = BIO_ctrl_pending (bio);
+	buf = malloc (sizeof (char) * size);
+	BIO_read (bio, buf, size);
+	BIO_free (bio);
+	END_OPENSSL;
+
+	PyObject *pem = PyString_FromStringAndSize (buf, size);
+	free (buf);
+	return pem;
+}
+
+static int
+certificate_x509_getbuffer (certificate_x509 *self, Py_buffer *view,
+			    int flags)
+{
+	if (self->compact != NULL) {
+		return PyBuffer_FillInfo (view, (PyObject *) self,
+					  self->compact->der,
+					  self->compact->der_length, 1, flags);
+	}
+
+	/* The x509 never changes, so its encoding is kept for later views */
+	int result = 0;
+	BEGIN_OBJECT_LOCK (self);
+	if (self->der == NULL) {
+		self->der_length = i2d_X509 (self->x509, &self->der);
+		if (self->der_length < 0) {
+			self->der = NULL;
+			self->der_length = 0;
+			PyErr_SetString (PyExc_ValueError,
+					 "unable to encode certificate");
+			view->obj = NULL;
+			result = -1;
+		}
+	}
+	if (result == 0) {
+		result = PyBuffer_FillInfo (view, (PyObject *) self, self->der,
+					    self->der_length, 1, flags);
+	}
+	END_OBJECT_LOCK;
+	return result;
+}
+
+static PyObject *
+as_der (certificate_x509 *self, PyObject *args)
+{
+	return PyMemoryView_FromObject ((PyObject *) self);
+}
+
+static PyObject *
+as_text (certificate_x509 *self, PyObject *args)
+{
+	size_t size;
+	char *buf;
+
+	BEGIN_OPENSSL;
+	BIO *bio = BIO_new (BIO_s_mem ());
+	if (self->compact != NULL) {
+		X509 *x509 = rhsm_cert_decode (self->compact);
+		X509_print (bio, x509);
+		X509_free (x509);
+	} else {
+		X509_print (bio, self->x509);
+	}
+
+	size = BIO_ctrl_pending (bio);
+	buf = malloc (sizeof (char) * size);
+	BIO_read (bio, buf, size);
+	BIO_free (bio);
+	END_OPENSSL;
+
+	PyObject *pem = PyString_FromStringAndSize (buf, size);
+	free (buf);
+	return pem;
+}
+
+static PyObject *
+get_serial_number (certificate_x509 *self, PyObject *args)
+{
+	PyObject *ret;
+
+	if (self->compact != NULL) {
+		return PyLong_FromString (self->compact->serial, NULL, 16);
+	}
+
+	ASN1_INTEGER *serial_asn = X509_get_serialNumber (self->x509);
 	BIGNUM *bn = ASN1_INTEGER_to_BN (serial_asn, NULL);
 
-	char *hex = BN_bn2hex (bn);
+	char *hex = BN_bn2hex (bn);
+
+	BN_free (bn);
+	ret = PyLong_FromString (hex, NULL, 16);
+	OPENSSL_free (hex);
+	return ret;
+}
+
+/* The dict get_subject and get_issuer return, for a compact certificate */
+static PyObject *
+name_pairs_to_dict (char **pairs, int count)
+{
+	PyObject *dict = PyDict_New ();
+	int i;
+	for (i = 0; dict != NULL && i < count; i++) {
+		PyObject *key = PyString_FromString (pairs[2 * i]);
+		PyObject *value = PyString_FromString (pairs[2 * i + 1]);
+		if (key == NULL || value == NULL ||
+		    PyDict_SetItem (dict, key, value) < 0) {
+			Py_CLEAR (dict);
+		}
+		Py_XDECREF (key);
+		Py_XDECREF (value);
+	}
+	return dict;
+}
+
+static PyObject *
+get_subject (certificate_x509 *self, PyObject *args)
+{
+	if (self->compact != NULL) {
+		return name_pairs_to_dict (self->compact->subject,
+					   self->compact->subject_count);
+	}
+
+	X509_NAME *name = X509_get_subject_name (self->x509);
+	int entries = X509_NAME_entry_count (name);
+	int i;
+
+	PyObject *dict = PyDict_New ();
+	for (i = 0; i < entries; i++) {
+		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
+		ASN1_OBJECT *obj = X509_NAME_ENTRY_get_object (entry);
+		ASN1_STRING *data = X509_NAME_ENTRY_get_data (entry);
+
+		PyObject *key =
+			PyString_FromString (OBJ_nid2sn (OBJ_obj2nid (obj)));
+		PyObject *value = PyString_FromString ((const char *)
+						       ASN1_STRING_get0_data (data));
+		PyDict_SetItem (dict, key, value);
+
+		Py_DECREF (key);
+		Py_DECREF (value);
+	}
+
+	return dict;
+}
+
+static PyObject *
+get_issuer (certificate_x509 *self, PyObject *args)
+{
+	if (self->compact != NULL) {
+		return name_pairs_to_dict (self->compact->issuer,
+					   self->compact->issuer_count);
+	}
+
+	X509_NAME *name = X509_get_issuer_name (self->x509);
+	int entries = X509_NAME_entry_count (name);
+	int i;
+
+	PyObject *dict = PyDict_New ();
+	for (i = 0; i < entries; i++) {
+		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
+		ASN1_OBJECT *obj = X509_NAME_ENTRY_get_object (entry);
+		ASN1_STRING *data = X509_NAME_ENTRY_get_data (entry);
+
+		PyObject *key =
+			PyString_FromString (OBJ_nid2sn (OBJ_obj2nid (obj)));
+		PyObject *value = PyString_FromString ((const char *)
+						       ASN1_STRING_get0_data (data));
+		PyDict_SetItem (dict, key, value);
+
+		Py_DECREF (key);
+		Py_DECREF (value);
+	}
+
+	return dict;
+}
+
+static PyObject *
+time_to_string (ASN1_UTCTIME *time)
+{
+	char *buf;
+
+	BEGIN_OPENSSL;
+	buf = rhsm_time_text (time);
+	END_OPENSSL;
+
+	if (buf == NULL) {
+		return PyErr_NoMemory ();
+	}
+	PyObject *time_str = PyString_FromString (buf);
+	free (buf);
+	return time_str;
+}
+
+static PyObject *
+get_not_before (certificate_x509 *self, PyObject *args)
+{
+	if (self->compact != NULL) {
+		return PyString_FromString (self->compact->not_before_text);
+	}
+	ASN1_UTCTIME *time = X509_get_notBefore (self->x509);
+	return time_to_string (time);
+}
+
+static PyObject *
+get_not_after (certificate_x509 *self, PyObject *args)
+{
+	if (self->compact != NULL) {
+		return PyString_FromString (self->compact->not_after_text);
+	}
+	ASN1_UTCTIME *time = X509_get_notAfter (self->x509);
+	return time_to_string (time);
+}
+
+static PyObject *
+get_validity (certificate_x509 *self, PyObject *args)
+{
+	long long not_before;
+	long long not_after;
+	if (self->compact != NULL) {
+		not_before = self->compact->not_before;
+		not_after = self->compact->not_after;
+		if (!self->compact->validity_ok) {
+			PyErr_SetString (PyExc_ValueError,
+					 "certificate has invalid validity dates");
+			return NULL;
+		}
+	} else if (rhsm_x509_validity (self->x509, &not_before, &not_after) < 0) {
+		PyErr_SetString (PyExc_ValueError,
+				 "certificate has invalid validity dates");
+		return NULL;
+	}
+	return Py_BuildValue ("(LL)", not_before, not_after);
+}
+
+/*
+ * v3 entitlement content path tree.
+ *
+ * The payload of the 1.3.6.1.4.1.2312.9.7 extension is a zlib compressed,
+ * NUL separated word list, directly followed by a bit stream describing the
+ * path nodes (see rhsm/pathtree.py for the python version of the decoder):
+ *
+ *   - a node count: one byte if < 128, otherwise 128 + the number of
+ *     big-endian bytes that follow and hold the count
+ *   - for each node, in order, pairs of (word code, node code) naming the
+ *     children of that node, terminated by the code of the empty word
+ *
+ * Word codes come from a Huffman tree built over the word list with weights
+ * 1..n in list order, node codes from a Huffman tree over nodes 1..count-1
+ * (the root never needs a code) built the same way.
+ *
+ * Instead of dicts of lists we keep one flat array of edges, sorted by word
+ * within each node, so matching is a binary search per path segment.
+ */
+#define LISTING "listing"
+
+typedef struct {
+	const char *word;
+	size_t length;
+	int child;
+} path_edge;
+
+typedef struct {
+	int first_edge;
+	int edge_count;
+	int first_var;
+	int var_count;
+} path_node;
+
+typedef struct {
+	PyObject_HEAD;
+	char *words;
+	path_node *nodes;
+	int node_count;
+	path_edge *edges;
+	int edge_count;
+} path_tree;
+
+typedef struct {
+	const char *word;
+	size_t length;
+} path_word;
+
+typedef struct {
+	unsigned long long weight;
+	int order;
+	int left;
+	int right;
+} huffman_node;
+
+typedef struct {
+	huffman_node *nodes;
+	int leaves;
+	int root;
+} huffman_tree;
+
+typedef struct {
+	const unsigned char *data;
+	size_t length;
+	size_t bit;
+} bit_reader;
+
+static int
+huffman_less (huffman_node *nodes, int a, int b)
+{
+	if (nodes[a].weight != nodes[b].weight) {
+		return nodes[a].weight < nodes[b].weight;
+	}
+	return nodes[a].order < nodes[b].order;
+}
+
+static void
+huffman_heap_push (huffman_node *nodes, int *heap, int *size, int node)
+{
+	int i = (*size)++;
+	heap[i] = node;
+	while (i > 0 && huffman_less (nodes, heap[i], heap[(i - 1) / 2])) {
+		int parent = (i - 1) / 2;
+		int tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static int
+huffman_heap_pop (huffman_node *nodes, int *heap, int *size)
+{
+	int top = heap[0];
+	heap[0] = heap[--(*size)];
+	int i = 0;
+	while (1) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = 2 * i + 2;
+		if (left < *size && huffman_less (nodes, heap[left], heap[smallest])) {
+			smallest = left;
+		}
+		if (right < *size && huffman_less (nodes, heap[right], heap[smallest])) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			break;
+		}
+		int tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+	return top;
+}
+
+/*
+ * Build a Huffman tree over "leaves" symbols weighted 1..leaves. Equal
+ * weights are broken by insertion order, exactly like HuffmanNode.build_tree,
+ * so both sides agree on the codes. Leaf i is node i.
+ */
+static int
+huffman_build (huffman_tree *tree, int leaves)
+{
+	tree->leaves = leaves;
+	tree->nodes = malloc (sizeof (huffman_node) * (2 * leaves));
+	int *heap = malloc (sizeof (int) * (leaves + 1));
+	if (tree->nodes == NULL || heap == NULL) {
+		free (tree->nodes);
+		free (heap);
+		tree->nodes = NULL;
+		return -1;
+	}
+
+	int size = 0;
+	int i;
+	for (i = 0; i < leaves; i++) {
+		tree->nodes[i].weight = i + 1;
+		tree->nodes[i].order = i;
+		tree->nodes[i].left = -1;
+		tree->nodes[i].right = -1;
+		huffman_heap_push (tree->nodes, heap, &size, i);
+	}
+
+	int next = leaves;
+	while (size > 1) {
+		int left = huffman_heap_pop (tree->nodes, heap, &size);
+		int right = huffman_heap_pop (tree->nodes, heap, &size);
+		tree->nodes[next].weight = tree->nodes[left].weight +
+			tree->nodes[right].weight;
+		tree->nodes[next].order = next;
+		tree->nodes[next].left = left;
+		tree->nodes[next].right = right;
+		huffman_heap_push (tree->nodes, heap, &size, next);
+		next++;
+	}
+	tree->root = heap[0];
+	free (heap);
+	return 0;
+}
+
+/* Returns the next symbol, or -1 once the stream runs out */
+static int
+huffman_decode (huffman_tree *tree, bit_reader *bits)
+{
+	int node = tree->root;
+	while (node >= tree->leaves) {
+		if (bits->bit >= bits->length * 8) {
+			return -1;
+		}
+		int bit = (bits->data[bits->bit / 8] >> (7 - bits->bit % 8)) & 1;
+		bits->bit++;
+		node = bit ? tree->nodes[node].right : tree->nodes[node].left;
+	}
+	return node;
+}
+
+static int
+read_byte (bit_reader *bits)
+{
+	if (bits->bit + 8 > bits->length * 8) {
+		return -1;
+	}
+	int byte = bits->data[bits->bit / 8];
+	bits->bit += 8;
+	return byte;
+}
+
+/*
+ * Inflate the word list. The stream is followed by the node bit stream, so
+ * we also hand back where the compressed data ended.
+ */
+static char *
+inflate_words (const unsigned char *data, size_t length, size_t *out_length,
+	       size_t *consumed)
+{
+	z_stream stream;
+	memset (&stream, 0, sizeof (stream));
+	if (inflateInit (&stream) != Z_OK) {
+		return NULL;
+	}
+
+	size_t allocated = length * 4 + 256;
+	char *out = malloc (allocated);
+	stream.next_in = (unsigned char *) data;
+	stream.avail_in = length;
+
+	int ret = Z_OK;
+	while (out != NULL) {
+		stream.next_out = (unsigned char *) out + stream.total_out;
+		stream.avail_out = allocated - stream.total_out;
+		ret = inflate (&stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END || (ret != Z_OK && ret != Z_BUF_ERROR)) {
+			break;
+		}
+		if (stream.avail_out == 0) {
+			char *grown = realloc (out, allocated * 2);
+			if (grown == NULL) {
+				free (out);
+				out = NULL;
+				break;
+			}
+			out = grown;
+			allocated *= 2;
+		} else if (stream.avail_in == 0) {
+			/* Truncated */
+			break;
+		}
+	}
+
+	if (out != NULL && ret != Z_STREAM_END) {
+		free (out);
+		out = NULL;
+	}
+	if (out != NULL) {
+		*out_length = stream.total_out;
+		*consumed = length - stream.avail_in;
+	}
+	inflateEnd (&stream);
+	return out;
+}
+
+static int
+compare_words (const char *a, size_t a_len, const char *b, size_t b_len)
+{
+	int ret = memcmp (a, b, a_len < b_len ? a_len : b_len);
+	if (ret == 0 && a_len != b_len) {
+		ret = a_len < b_len ? -1 : 1;
+	}
+	return ret;
+}
+
+static int
+compare_edges (const void *a, const void *b)
+{
+	const path_edge *edge_a = a;
+	const path_edge *edge_b = b;
+	int ret = compare_words (edge_a->word, edge_a->length, edge_b->word,
+				 edge_b->length);
+	if (ret == 0) {
+		ret = edge_a->child - edge_b->child;
+	}
+	return ret;
+}
+
+/*
+ * Decode "data" into the tree. Returns NULL on success or a message
+ * describing what was wrong with the data. Runs without the GIL.
+ */
+static const char *
+path_tree_decode (path_tree *tree, const unsigned char *data, size_t length)
+{
+	size_t words_length;
+	size_t consumed;
+	path_word *words = NULL;
+	huffman_tree word_tree = { NULL, 0, 0 };
+	huffman_tree node_tree = { NULL, 0, 0 };
+	const char *error = NULL;
+
+	tree->words = inflate_words (data, length, &words_length, &consumed);
+	if (tree->words == NULL) {
+		return "unable to decompress path tree word list";
+	}
+
+	int word_count = 1;
+	size_t i;
+	for (i = 0; i < words_length; i++) {
+		if (tree->words[i] == '\0') {
+			word_count++;
+		}
+	}
+	words = malloc (sizeof (path_word) * word_count);
+	if (words == NULL) {
+		return "out of memory";
+	}
+	int w = 0;
+	const char *start = tree->words;
+	for (i = 0; i <= words_length; i++) {
+		if (i == words_length || tree->words[i] == '\0') {
+			words[w].word = start;
+			words[w].length = tree->words + i - start;
+			start = tree->words + i + 1;
+			w++;
+		}
+	}
+
+	bit_reader bits = { data + consumed, length - consumed, 0 };
+	int first = read_byte (&bits);
+	long node_count = first;
+	if (first >= 128) {
+		int count_bytes = first - 128;
+		node_count = 0;
+		while (count_bytes-- > 0) {
+			int byte = read_byte (&bits);
+			if (byte < 0 || node_count > INT_MAX >> 8) {
+				node_count = -1;
+				break;
+			}
+			node_count = (node_count << 8) | byte;
+		}
+	}
+	if (node_count < 2) {
+		error = "invalid path tree node count";
+		goto out;
+	}
+
+	tree->node_count = node_count;
+	tree->nodes = calloc (node_count, sizeof (path_node));
+	if (tree->nodes == NULL ||
+	    huffman_build (&word_tree, word_count) < 0 ||
+	    huffman_build (&node_tree, node_count - 1) < 0) {
+		error = "out of memory";
+		goto out;
+	}
+
+	int allocated = node_count;
+	tree->edges = malloc (sizeof (path_edge) * allocated);
+	if (tree->edges == NULL) {
+		error = "out of memory";
+		goto out;
+	}
+
+	int node;
+	for (node = 0; node < node_count; node++) {
+		path_node *current = &tree->nodes[node];
+		current->first_edge = tree->edge_count;
+		while (1) {
+			int word = huffman_decode (&word_tree, &bits);
+			if (word < 0 || words[word].length == 0) {
+				break;
+			}
+			int child = huffman_decode (&node_tree, &bits);
+			if (child < 0) {
+				error = "truncated path tree";
+				goto out;
+			}
+			if (tree->edge_count == allocated) {
+				path_edge *grown = realloc (tree->edges,
+							    sizeof (path_edge) *
+							    allocated * 2);
+				if (grown == NULL) {
+					error = "out of memory";
+					goto out;
+				}
+				tree->edges = grown;
+				allocated *= 2;
+			}
+			path_edge *edge = &tree->edges[tree->edge_count++];
+			edge->word = words[word].word;
+			edge->length = words[word].length;
+			edge->child = child + 1;
+		}
+		current->edge_count = tree->edge_count - current->first_edge;
+
+		path_edge *edges = tree->edges + current->first_edge;
+		qsort (edges, current->edge_count, sizeof (path_edge),
+		       compare_edges);
+
+		/* Variables sort together, remember where they are */
+		int e;
+		current->first_var = current->first_edge;
+		for (e = 0; e < current->edge_count; e++) {
+			if (edges[e].word[0] == '$') {
+				if (current->var_count == 0) {
+					current->first_var =
+						current->first_edge + e;
+				}
+				current->var_count++;
+			}
+		}
+	}
+
+out:
+	free (words);
+	free (word_tree.nodes);
+	free (node_tree.nodes);
+	return error;
+}
+
+static int
+path_tree_match_node (path_tree *tree, int node, path_word *words, int count)
+{
+	path_node *current = &tree->nodes[node];
+	if (current->edge_count == 0) {
+		/* End of a path in the tree, everything below it is allowed */
+		return 1;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	if (count == 1 && words[0].length == strlen (LISTING) &&
+	    memcmp (words[0].word, LISTING, words[0].length) == 0) {
+		return 1;
+	}
+
+	/* Exact matches; the same word may lead to several children */
+	path_edge *edges = tree->edges + current->first_edge;
+	int low = 0;
+	int high = current->edge_count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (compare_words (edges[mid].word, edges[mid].length,
+				   words[0].word, words[0].length) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	for (; low < current->edge_count &&
+	     compare_words (edges[low].word, edges[low].length, words[0].word,
+			    words[0].length) == 0; low++) {
+		if (path_tree_match_node (tree, edges[low].child, words + 1,
+					  count - 1)) {
+			return 1;
+		}
+	}
+
+	/* Any segment matches a variable such as $releasever */
+	int i;
+	for (i = 0; i < current->var_count; i++) {
+		path_edge *edge = &tree->edges[current->first_var + i];
+		if (path_tree_match_node (tree, edge->child, words + 1,
+					  count - 1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Same as path.strip('/').split('/') */
+static path_word *
+split_path (const char *path, size_t length, int *count)
+{
+	const char *start = path;
+	const char *end = path + length;
+	while (start < end && *start == '/') {
+		start++;
+	}
+	while (end > start && *(end - 1) == '/') {
+		end--;
+	}
+
+	*count = 1;
+	const char *p;
+	for (p = start; p < end; p++) {
+		if (*p == '/') {
+			(*count)++;
+		}
+	}
+	path_word *words = malloc (sizeof (path_word) * *count);
+	if (words == NULL) {
+		return NULL;
+	}
+	int w = 0;
+	const char *word = start;
+	for (p = start; p <= end; p++) {
+		if (p == end || *p == '/') {
+			words[w].word = word;
+			words[w].length = p - word;
+			word = p + 1;
+			w++;
+		}
+	}
+	return words;
+}
+
+static PyObject *
+path_tree_match_path (path_tree *self, PyObject *args)
+{
+	const char *path;
+	Py_ssize_t length;
+
+	if (!PyArg_ParseTuple (args, "s#", &path, &length)) {
+		return NULL;
+	}
+
+	if (length == 0 || path[0] != '/') {
+		PyErr_SetString (PyExc_ValueError, "path must start with \"/\"");
+		return NULL;
+	}
+
+	int count;
+	path_word *words = split_path (path, length, &count);
+	if (words == NULL) {
+		return PyErr_NoMemory ();
+	}
+
+	int match = path_tree_match_node (self, 0, words, count);
+	free (words);
+	return PyBool_FromLong (match);
+}
+
+static void
+path_tree_dealloc (path_tree *self)
+{
+	free (self->words);
+	free (self->nodes);
+	free (self->edges);
+	object_free ((PyObject *) self);
+}
+
+/* Same as certificate_x509_converter, for PathTree arguments */
+static int
+path_tree_converter (PyObject *object, void *tree)
+{
+	if (Py_TYPE (object)->tp_dealloc != (destructor) path_tree_dealloc) {
+		PyErr_Format (PyExc_TypeError,
+			      "expected a _certificate.PathTree, not %.50s",
+			      Py_TYPE (object)->tp_name);
+		return 0;
+	}
+	*(path_tree **) tree = (path_tree *) object;
+	return 1;
+}
+
+static PyObject *
+path_tree_new (PyTypeObject *type, PyObject *args, PyObject *keywords)
+{
+	const char *data;
+	Py_ssize_t length;
+
+	static char *keywordlist[] = { "data", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "s#", keywordlist,
+					  &data, &length)) {
+		return NULL;
+	}
+
+	path_tree *self = (path_tree *) type->tp_alloc (type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	const char *error;
+	Py_BEGIN_ALLOW_THREADS;
+	error = path_tree_decode (self, (const unsigned char *) data, length);
+	Py_END_ALLOW_THREADS;
+
+	if (error != NULL) {
+		PyErr_SetString (PyExc_ValueError, error);
+		Py_DECREF (self);
+		return NULL;
+	}
+	return (PyObject *) self;
+}
+
+static PyMethodDef path_tree_methods[] = {
+	{"match_path", (PyCFunction) path_tree_match_path, METH_VARARGS,
+	 "True if the absolute path is allowed by a path in the tree"},
+	{NULL}
+};
+
+static PyType_Slot path_tree_slots[] = {
+	{Py_tp_dealloc, (void *) path_tree_dealloc},
+	{Py_tp_doc, (void *) "v3 entitlement content path tree"},
+	{Py_tp_methods, path_tree_methods},
+	{Py_tp_new, (void *) path_tree_new},
+	{0, NULL}
+};
+
+static PyType_Spec path_tree_spec = {
+	"_certificate.PathTree",
+	sizeof (path_tree),
+	0,
+	TYPE_FLAGS,
+	path_tree_slots
+};
+
+/*
+ * Content path index.
+ *
+ * Checking a repo url against every entitlement one PathTree at a time is
+ * O(certs * urls) tree walks. PathIndex merges the trees of many certs into
+ * a single trie whose nodes remember which certs reach them ("through")
+ * and which certs have a complete path ending there ("ends"), so one walk
+ * finds every cert granting access to a path. Matching follows the same
+ * rules as PathTree.match_path.
+ */
+#define PATH_INDEX_MAX_DEPTH 256
+
+typedef struct {
+	char *word;
+	size_t length;
+	int child;
+} index_edge;
+
+typedef struct {
+	int *ids;
+	int count;
+	int allocated;
+} id_list;
+
+typedef struct {
+	index_edge *edges;
+	int edge_count;
+	int edge_allocated;
+	id_list ends;
+	id_list through;
+} index_node;
+
+typedef struct {
+	PyObject_HEAD;
+	index_node *nodes;
+	int node_count;
+	int node_allocated;
+	PyObject *keys;
+} path_index;
+
+static int
+id_list_add (id_list *list, int id)
+{
+	/* Ids are added one cert at a time, so duplicates are always last */
+	if (list->count > 0 && list->ids[list->count - 1] == id) {
+		return 0;
+	}
+	if (list->count == list->allocated) {
+		int allocated = list->allocated ? list->allocated * 2 : 4;
+		int *grown = realloc (list->ids, sizeof (int) * allocated);
+		if (grown == NULL) {
+			return -1;
+		}
+		list->ids = grown;
+		list->allocated = allocated;
+	}
+	list->ids[list->count++] = id;
+	return 0;
+}
+
+static int
+path_index_new_node (path_index *self)
+{
+	if (self->node_count == self->node_allocated) {
+		int allocated = self->node_allocated ? self->node_allocated * 2 : 64;
+		index_node *grown = realloc (self->nodes,
+					     sizeof (index_node) * allocated);
+		if (grown == NULL) {
+			return -1;
+		}
+		self->nodes = grown;
+		self->node_allocated = allocated;
+	}
+	memset (&self->nodes[self->node_count], 0, sizeof (index_node));
+	return self->node_count++;
+}
+
+/* Index of the first edge of "node" whose word is >= word */
+static int
+path_index_lower_bound (index_node *node, const char *word, size_t length)
+{
+	int low = 0;
+	int high = node->edge_count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (compare_words (node->edges[mid].word, node->edges[mid].length,
+				   word, length) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static int
+path_index_child (path_index *self, int node, const char *word, size_t length)
+{
+	index_node *current = &self->nodes[node];
+	int pos = path_index_lower_bound (current, word, length);
+	if (pos < current->edge_count &&
+	    compare_words (current->edges[pos].word, current->edges[pos].length,
+			   word, length) == 0) {
+		return current->edges[pos].child;
+	}
+
+	int child = path_index_new_node (self);
+	if (child < 0) {
+		return -1;
+	}
+	/* The node array may have moved */
+	current = &self->nodes[node];
+
+	if (current->edge_count == current->edge_allocated) {
+		int allocated = current->edge_allocated ?
+			current->edge_allocated * 2 : 2;
+		index_edge *grown = realloc (current->edges,
+					     sizeof (index_edge) * allocated);
+		if (grown == NULL) {
+			return -1;
+		}
+		current->edges = grown;
+		current->edge_allocated = allocated;
+	}
+
+	char *copy = malloc (length + 1);
+	if (copy == NULL) {
+		return -1;
+	}
+	memcpy (copy, word, length);
+	copy[length] = '\0';
+
+	memmove (&current->edges[pos + 1], &current->edges[pos],
+		 sizeof (index_edge) * (current->edge_count - pos));
+	current->edges[pos].word = copy;
+	current->edges[pos].length = length;
+	current->edges[pos].child = child;
+	current->edge_count++;
+	return child;
+}
+
+static const char *
+path_index_insert (path_index *self, int node, path_tree *tree, int tree_node,
+		   int id, int depth)
+{
+	if (depth > PATH_INDEX_MAX_DEPTH) {
+		return "path tree is too deep";
+	}
+	if (id_list_add (&self->nodes[node].through, id) < 0) {
+		return "out of memory";
+	}
+
+	path_node *current = &tree->nodes[tree_node];
+	if (current->edge_count == 0) {
+		if (id_list_add (&self->nodes[node].ends, id) < 0) {
+			return "out of memory";
+		}
+		return NULL;
+	}
+
+	int i;
+	for (i = 0; i < current->edge_count; i++) {
+		path_edge *edge = &tree->edges[current->first_edge + i];
+		int child = path_index_child (self, node, edge->word,
+					      edge->length);
+		if (child < 0) {
+			return "out of memory";
+		}
+		const char *error = path_index_insert (self, child, tree,
+						       edge->child, id,
+						       depth + 1);
+		if (error != NULL) {
+			return error;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take back a partial insert of id. Ids are added one cert at a time, so
+ * where it got to, id is the last in the lists. The nodes it created stay,
+ * without ids they match nothing.
+ */
+static void
+path_index_forget (path_index *self, int id)
+{
+	int i;
+	for (i = 0; i < self->node_count; i++) {
+		index_node *node = &self->nodes[i];
+		if (node->through.count > 0 &&
+		    node->through.ids[node->through.count - 1] == id) {
+			node->through.count--;
+		}
+		if (node->ends.count > 0 &&
+		    node->ends.ids[node->ends.count - 1] == id) {
+			node->ends.count--;
+		}
+	}
+}
+
+static void
+path_index_match_node (path_index *self, int node, path_word *words,
+		       int count, char *hits)
+{
+	index_node *current = &self->nodes[node];
+	int i;
+
+	for (i = 0; i < current->ends.count; i++) {
+		hits[current->ends.ids[i]] = 1;
+	}
+	if (count == 0) {
+		return;
+	}
+
+	if (count == 1 && words[0].length == strlen (LISTING) &&
+	    memcmp (words[0].word, LISTING, words[0].length) == 0) {
+		for (i = 0; i < current->through.count; i++) {
+			hits[current->through.ids[i]] = 1;
+		}
+		return;
+	}
+
+	int pos = path_index_lower_bound (current, words[0].word,
+					  words[0].length);
+	if (pos < current->edge_count &&
+	    compare_words (current->edges[pos].word, current->edges[pos].length,
+			   words[0].word, words[0].length) == 0) {
+		path_index_match_node (self, current->edges[pos].child,
+				       words + 1, count - 1, hits);
+	}
+
+	/* Variables all start with '$', so they sit together */
+	for (pos = path_index_lower_bound (current, "$", 1);
+	     pos < current->edge_count && current->edges[pos].word[0] == '$';
+	     pos++) {
+		path_index_match_node (self, current->edges[pos].child,
+				       words + 1, count - 1, hits);
+	}
+}
+
+static PyObject *
+path_index_add (path_index *self, PyObject *args)
+{
+	PyObject *key;
+	path_tree *tree;
+
+	if (!PyArg_ParseTuple (args, "OO&", &key, path_tree_converter,
+			       &tree)) {
+		return NULL;
+	}
+
+	const char *error;
+	int appended = 0;
+	BEGIN_OBJECT_LOCK (self);
+	int id = PyList_GET_SIZE (self->keys);
+	error = path_index_insert (self, 0, tree, 0, id, 0);
+	if (error == NULL) {
+		appended = PyList_Append (self->keys, key);
+	}
+	if (error != NULL || appended < 0) {
+		/* The next add reuses the id */
+		path_index_forget (self, id);
+	}
+	END_OBJECT_LOCK;
+
+	if (error != NULL) {
+		PyErr_SetString (PyExc_ValueError, error);
+		return NULL;
+	}
+	if (appended < 0) {
+		return NULL;
+	}
+
+	Py_INCREF (Py_None);
+	return Py_None;
+}
+
+static PyObject *
+path_index_match (path_index *self, PyObject *args)
+{
+	const char *path;
+	Py_ssize_t length;
+
+	if (!PyArg_ParseTuple (args, "s#", &path, &length)) {
+		return NULL;
+	}
+
+	if (length == 0 || path[0] != '/') {
+		PyErr_SetString (PyExc_ValueError, "path must start with \"/\"");
+		return NULL;
+	}
+
+	int count;
+	path_word *words = split_path (path, length, &count);
+	if (words == NULL) {
+		return PyErr_NoMemory ();
+	}
+
+	PyObject *result = NULL;
+	char *hits;
+	BEGIN_OBJECT_LOCK (self);
+	Py_ssize_t keys = PyList_GET_SIZE (self->keys);
+	hits = calloc (keys + 1, 1);
+	if (hits != NULL) {
+		path_index_match_node (self, 0, words, count, hits);
+		result = PyList_New (0);
+	} else {
+		PyErr_NoMemory ();
+	}
+
+	Py_ssize_t i;
+	for (i = 0; result != NULL && i < keys; i++) {
+		if (hits[i] && PyList_Append (result,
+					      PyList_GET_ITEM (self->keys, i)) < 0) {
+			Py_DECREF (result);
+			result = NULL;
+		}
+	}
+	END_OBJECT_LOCK;
+	free (hits);
+	free (words);
+	return result;
+}
+
+static Py_ssize_t
+path_index_length (path_index *self)
+{
+	Py_ssize_t length;
+	BEGIN_OBJECT_LOCK (self);
+	length = PyList_GET_SIZE (self->keys);
+	END_OBJECT_LOCK;
+	return length;
+}
+
+static void
+path_index_dealloc (path_index *self)
+{
+	int i, j;
+	for (i = 0; i < self->node_count; i++) {
+		index_node *node = &self->nodes[i];
+		for (j = 0; j < node->edge_count; j++) {
+			free (node->edges[j].word);
+		}
+		free (node->edges);
+		free (node->ends.ids);
+		free (node->through.ids);
+	}
+	free (self->nodes);
+	Py_XDECREF (self->keys);
+	object_free ((PyObject *) self);
+}
+
+static PyObject *
+path_index_new (PyTypeObject *type, PyObject *args, PyObject *keywords)
+{
+	static char *keywordlist[] = { NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "", keywordlist)) {
+		return NULL;
+	}
+
+	path_index *self = (path_index *) type->tp_alloc (type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->keys = PyList_New (0);
+	if (self->keys == NULL || path_index_new_node (self) < 0) {
+		Py_DECREF (self);
+		return PyErr_NoMemory ();
+	}
+	return (PyObject *) self;
+}
+
+static PyMethodDef path_index_methods[] = {
+	{"add", (PyCFunction) path_index_add, METH_VARARGS,
+	 "add(key, path_tree): merge a certificate's PathTree into the index"},
+	{"match", (PyCFunction) path_index_match, METH_VARARGS,
+	 "return the keys of every tree allowing the absolute path"},
+	{NULL}
+};
+
+static PyType_Slot path_index_slots[] = {
+	{Py_tp_dealloc, (void *) path_index_dealloc},
+	{Py_tp_doc, (void *) "merged content path index of many PathTrees"},
+	{Py_tp_methods, path_index_methods},
+	{Py_tp_new, (void *) path_index_new},
+	{Py_sq_length, (void *) path_index_length},
+	{0, NULL}
+};
+
+static PyType_Spec path_index_spec = {
+	"_certificate.PathIndex",
+	sizeof (path_index),
+	0,
+	TYPE_FLAGS,
+	path_index_slots
+};
+
+/*
+ * v3 entitlement payloads.
+ *
+ * A v3 entitlement certificate carries its products, content and order as
+ * zlib compressed JSON in an "ENTITLEMENT DATA" PEM section. The section is
+ * found, base64 decoded, inflated and parsed into a flat array of json
+ * values without the GIL; only turning that array into python objects
+ * needs the interpreter.
+ */
+#define ENTITLEMENT_BEGIN "-----BEGIN ENTITLEMENT DATA-----"
+#define ENTITLEMENT_END "-----END ENTITLEMENT DATA-----"
+#define JSON_MAX_DEPTH 512
+
+typedef enum {
+	JSON_NULL,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_INTEGER,
+	JSON_FLOAT,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT,
+} json_type;
+
+/*
+ * Values are stored in document order, so the members of an array or
+ * object follow it directly (objects alternate key and value).
+ */
+typedef struct {
+	json_type type;
+	char *start;		/* text of strings and numbers */
+	size_t length;
+	int count;		/* members of arrays and objects */
+} json_value;
+
+typedef struct {
+	char *p;
+	char *end;
+	json_value *values;
+	int count;
+	int allocated;
+	const char *error;
+} json_parser;
+
+static const signed char base64_values[256] = {
+	['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6,
+	['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+	['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17,
+	['R'] = 18, ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22,
+	['W'] = 23, ['X'] = 24, ['Y'] = 25, ['Z'] = 26,
+	['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30, ['e'] = 31,
+	['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+	['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41,
+	['p'] = 42, ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46,
+	['u'] = 47, ['v'] = 48, ['w'] = 49, ['x'] = 50, ['y'] = 51,
+	['z'] = 52, ['0'] = 53, ['1'] = 54, ['2'] = 55, ['3'] = 56,
+	['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60, ['8'] = 61,
+	['9'] = 62, ['+'] = 63, ['/'] = 64,
+};
+
+/*
+ * Decode base64 skipping anything outside the alphabet (line breaks), the
+ * same as base64.b64decode. Returns the decoded length, or -1.
+ */
+static ssize_t
+base64_decode (const char *data, size_t length, unsigned char *output)
+{
+	unsigned int bits = 0;
+	int bit_count = 0;
+	ssize_t out = 0;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		unsigned char c = data[i];
+		if (c == '=') {
+			break;
+		}
+		int value = base64_values[c] - 1;
+		if (value < 0) {
+			continue;
+		}
+		bits = (bits << 6) | value;
+		bit_count += 6;
+		if (bit_count >= 8) {
+			bit_count -= 8;
+			output[out++] = (bits >> bit_count) & 0xff;
+		}
+	}
+	/* A single dangling character can't encode a byte */
+	if (bit_count == 6) {
+		return -1;
+	}
+	return out;
+}
+
+static int
+json_add (json_parser *parser, json_type type, char *start, size_t length)
+{
+	if (parser->count == parser->allocated) {
+		int allocated = parser->allocated ? parser->allocated * 2 : 256;
+		json_value *grown = realloc (parser->values,
+					     sizeof (json_value) * allocated);
+		if (grown == NULL) {
+			parser->error = "out of memory";
+			return -1;
+		}
+		parser->values = grown;
+		parser->allocated = allocated;
+	}
+
+	json_value *value = &parser->values[parser->count];
+	value->type = type;
+	value->start = start;
+	value->length = length;
+	value->count = 0;
+	return parser->count++;
+}
+
+static void
+json_skip_space (json_parser *parser)
+{
+	while (parser->p < parser->end &&
+	       (*parser->p == ' ' || *parser->p == '\t' ||
+		*parser->p == '\n' || *parser->p == '\r')) {
+		parser->p++;
+	}
+}
+
+static int
+json_hex (const char *p, unsigned int *value)
+{
+	int i;
+	*value = 0;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+		*value <<= 4;
+		if (c >= '0' && c <= '9') {
+			*value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			*value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			*value |= c - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Unescape a string in place. Escapes are never shorter than the utf-8
+ * they decode to, so the output can't overtake the input.
+ */
+static int
+json_parse_string (json_parser *parser)
+{
+	char *out = ++parser->p;
+	char *start = out;
+
+	while (parser->p < parser->end && *parser->p != '"') {
+		unsigned char c = *parser->p;
+		if (c < 0x20) {
+			parser->error = "control character in string";
+			return -1;
+		}
+		if (c != '\\') {
+			*out++ = *parser->p++;
+			continue;
+		}
+		if (parser->end - parser->p < 2) {
+			break;
+		}
+		parser->p++;
+		switch (*parser->p++) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				{
+					unsigned int code;
+					if (parser->end - parser->p < 4 ||
+					    json_hex (parser->p, &code) < 0) {
+						parser->error = "invalid \\u escape";
+						return -1;
+					}
+					parser->p += 4;
+					unsigned int low;
+					if (code >= 0xd800 && code < 0xdc00 &&
+					    parser->end - parser->p >= 6 &&
+					    parser->p[0] == '\\' &&
+					    parser->p[1] == 'u' &&
+					    json_hex (parser->p + 2, &low) == 0 &&
+					    low >= 0xdc00 && low < 0xe000) {
+						code = 0x10000 + ((code - 0xd800) << 10) +
+							(low - 0xdc00);
+						parser->p += 6;
+					}
+					if (code < 0x80) {
+						*out++ = code;
+					} else if (code < 0x800) {
+						*out++ = 0xc0 | (code >> 6);
+						*out++ = 0x80 | (code & 0x3f);
+					} else if (code < 0x10000) {
+						*out++ = 0xe0 | (code >> 12);
+						*out++ = 0x80 | ((code >> 6) & 0x3f);
+						*out++ = 0x80 | (code & 0x3f);
+					} else {
+						*out++ = 0xf0 | (code >> 18);
+						*out++ = 0x80 | ((code >> 12) & 0x3f);
+						*out++ = 0x80 | ((code >> 6) & 0x3f);
+						*out++ = 0x80 | (code & 0x3f);
+					}
+					break;
+				}
+			default:
+				parser->error = "invalid escape";
+				return -1;
+		}
+	}
+
+	if (parser->p == parser->end) {
+		parser->error = "unterminated string";
+		return -1;
+	}
+	parser->p++;
+	return json_add (parser, JSON_STRING, start, out - start);
+}
+
+static int
+json_parse_number (json_parser *parser)
+{
+	char *start = parser->p;
+	json_type type = JSON_INTEGER;
+
+	if (parser->p < parser->end && *parser->p == '-') {
+		parser->p++;
+	}
+	const char *digits = parser->p;
+	while (parser->p < parser->end) {
+		char c = *parser->p;
+		if (c == '.' || c == 'e' || c == 'E' ||
+		    ((c == '+' || c == '-') && type == JSON_FLOAT)) {
+			type = JSON_FLOAT;
+		} else if (c < '0' || c > '9') {
+			break;
+		}
+		parser->p++;
+	}
+	if (parser->p == digits) {
+		parser->error = "invalid value";
+		return -1;
+	}
+	return json_add (parser, type, start, parser->p - start);
+}
+
+static int
+json_parse_literal (json_parser *parser, const char *literal, json_type type)
+{
+	size_t length = strlen (literal);
+	if ((size_t) (parser->end - parser->p) < length ||
+	    memcmp (parser->p, literal, length) != 0) {
+		parser->error = "invalid value";
+		return -1;
+	}
+	parser->p += length;
+	return json_add (parser, type, NULL, 0);
+}
+
+static int json_parse_value (json_parser *parser, int depth);
+
+/* Arrays and objects: members separated by ',' up to the closing char */
+static int
+json_parse_container (json_parser *parser, json_type type, int depth)
+{
+	char close = type == JSON_ARRAY ? ']' : '}';
+	int index = json_add (parser, type, NULL, 0);
+	if (index < 0) {
+		return -1;
+	}
+	parser->p++;
+
+	json_skip_space (parser);
+	if (parser->p < parser->end && *parser->p == close) {
+		parser->p++;
+		return index;
+	}
+
+	int count = 0;
+	while (1) {
+		json_skip_space (parser);
+		if (type == JSON_OBJECT) {
+			if (parser->p == parser->end || *parser->p != '"') {
+				parser->error = "expected string key";
+				return -1;
+			}
+			if (json_parse_string (parser) < 0) {
+				return -1;
+			}
+			json_skip_space (parser);
+			if (parser->p == parser->end || *parser->p != ':') {
+				parser->error = "expected ':'";
+				return -1;
+			}
+			parser->p++;
+		}
+		if (json_parse_value (parser, depth + 1) < 0) {
+			return -1;
+		}
+		count++;
+
+		json_skip_space (parser);
+		if (parser->p < parser->end && *parser->p == ',') {
+			parser->p++;
+		} else if (parser->p < parser->end && *parser->p == close) {
+			parser->p++;
+			break;
+		} else {
+			parser->error = type == JSON_ARRAY ?
+				"expected ',' or ']'" : "expected ',' or '}'";
+			return -1;
+		}
+	}
+
+	parser->values[index].count = count;
+	return index;
+}
+
+static int
+json_parse_value (json_parser *parser, int depth)
+{
+	if (depth > JSON_MAX_DEPTH) {
+		parser->error = "nested too deeply";
+		return -1;
+	}
+
+	json_skip_space (parser);
+	if (parser->p == parser->end) {
+		parser->error = "unexpected end of data";
+		return -1;
+	}
+
+	switch (*parser->p) {
+		case '{':
+			return json_parse_container (parser, JSON_OBJECT, depth);
+		case '[':
+			return json_parse_container (parser, JSON_ARRAY, depth);
+		case '"':
+			return json_parse_string (parser);
+		case 't':
+			return json_parse_literal (parser, "true", JSON_TRUE);
+		case 'f':
+			return json_parse_literal (parser, "false", JSON_FALSE);
+		case 'n':
+			return json_parse_literal (parser, "null", JSON_NULL);
+		default:
+			return json_parse_number (parser);
+	}
+}
+
+/* Build the python object for values[*index], advancing past it */
+static PyObject *
+json_build (json_value *values, int *index)
+{
+	json_value *value = &values[(*index)++];
+	PyObject *result = NULL;
+	int i;
+
+	switch (value->type) {
+		case JSON_NULL:
+			Py_INCREF (Py_None);
+			return Py_None;
+		case JSON_TRUE:
+			Py_INCREF (Py_True);
+			return Py_True;
+		case JSON_FALSE:
+			Py_INCREF (Py_False);
+			return Py_False;
+		case JSON_STRING:
+			return PyUnicode_DecodeUTF8 (value->start, value->length,
+						     NULL);
+		case JSON_INTEGER:
+		case JSON_FLOAT:
+			{
+				char number[MAX_BUF];
+				if (value->length >= MAX_BUF) {
+					PyErr_SetString (PyExc_ValueError,
+							 "number too long");
+					return NULL;
+				}
+				memcpy (number, value->start, value->length);
+				number[value->length] = '\0';
+				if (value->type == JSON_INTEGER) {
+#if PY_MAJOR_VERSION >= 3
+					return PyLong_FromString (number, NULL, 10);
+#else
+					return PyInt_FromString (number, NULL, 10);
+#endif
+				}
+				double d = PyOS_string_to_double (number, NULL, NULL);
+				if (d == -1.0 && PyErr_Occurred ()) {
+					return NULL;
+				}
+				return PyFloat_FromDouble (d);
+			}
+		case JSON_ARRAY:
+			result = PyList_New (value->count);
+			for (i = 0; result != NULL && i < value->count; i++) {
+				PyObject *item = json_build (values, index);
+				if (item == NULL) {
+					Py_CLEAR (result);
+					break;
+				}
+				PyList_SET_ITEM (result, i, item);
+			}
+			return result;
+		case JSON_OBJECT:
+			result = PyDict_New ();
+			for (i = 0; result != NULL && i < value->count; i++) {
+				PyObject *key = json_build (values, index);
+				PyObject *item = key ? json_build (values, index) : NULL;
+				if (item == NULL ||
+				    PyDict_SetItem (result, key, item) < 0) {
+					Py_CLEAR (result);
+				}
+				Py_XDECREF (key);
+				Py_XDECREF (item);
+			}
+			return result;
+	}
+	return NULL;
+}
+
+/*
+ * Find, decode, inflate and parse the entitlement data in pem. Returns
+ * NULL with *error set on failure, or NULL with no error if the pem has
+ * no entitlement data.
+ */
+static json_value *
+entitlement_parse (const char *pem, size_t length, char **text,
+		   const char **error)
+{
+	*error = NULL;
+	*text = NULL;
+
+	const char *begin = memmem (pem, length, ENTITLEMENT_BEGIN,
+				    strlen (ENTITLEMENT_BEGIN));
+	if (begin == NULL) {
+		return NULL;
+	}
+	begin += strlen (ENTITLEMENT_BEGIN);
+	const char *end = memmem (begin, length - (begin - pem),
+				  ENTITLEMENT_END, strlen (ENTITLEMENT_END));
+	if (end == NULL) {
+		*error = "unterminated entitlement data";
+		return NULL;
+	}
+
+	unsigned char *compressed = malloc ((end - begin) * 3 / 4 + 1);
+	if (compressed == NULL) {
+		*error = "out of memory";
+		return NULL;
+	}
+	ssize_t compressed_length = base64_decode (begin, end - begin,
+						   compressed);
+	if (compressed_length < 0) {
+		free (compressed);
+		*error = "invalid base64 in entitlement data";
+		return NULL;
+	}
+	if (compressed_length == 0) {
+		/* An empty section is the same as none */
+		free (compressed);
+		return NULL;
+	}
+
+	size_t text_length;
+	size_t consumed;
+	*text = inflate_words (compressed, compressed_length, &text_length,
+			       &consumed);
+	free (compressed);
+	if (*text == NULL) {
+		*error = "could not decompress entitlement data";
+		return NULL;
+	}
+
+	json_parser parser = { *text, *text + text_length, NULL, 0, 0, NULL };
+	if (json_parse_value (&parser, 0) >= 0) {
+		json_skip_space (&parser);
+		if (parser.p != parser.end) {
+			parser.error = "extra data after payload";
+		}
+	}
+	if (parser.error != NULL) {
+		*error = parser.error;
+		free (parser.values);
+		free (*text);
+		*text = NULL;
+		return NULL;
+	}
+	return parser.values;
+}
+
+static PyObject *
+load_entitlement (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *file_name = NULL;
+	const char *pem = NULL;
+	Py_ssize_t pem_length = 0;
+
+	static char *keywordlist[] = { "file", "pem", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|ss#", keywordlist,
+					  &file_name, &pem, &pem_length)) {
+		return NULL;
+	}
+	if (file_name == NULL && pem == NULL) {
+		PyErr_SetString (PyExc_TypeError, "file or pem is required");
+		return NULL;
+	}
+
+	char *data = NULL;
+	size_t length = pem_length;
+	int read_error = 0;
+	char *text = NULL;
+	const char *error = NULL;
+	json_value *values = NULL;
+
+	Py_BEGIN_ALLOW_THREADS;
+	if (pem == NULL) {
+		data = rhsm_read_file (file_name, &length, &read_error);
+		pem = data;
+	}
+	if (pem != NULL) {
+		values = entitlement_parse (pem, length, &text, &error);
+	}
+	Py_END_ALLOW_THREADS;
+
+	free (data);
+	if (read_error != 0) {
+		errno = read_error;
+		return PyErr_SetFromErrnoWithFilename (PyExc_IOError,
+						       file_name);
+	}
+	if (error != NULL) {
+		PyErr_SetString (PyExc_ValueError, error);
+		return NULL;
+	}
+	if (values == NULL) {
+		Py_INCREF (Py_None);
+		return Py_None;
+	}
+
+	int index = 0;
+	PyObject *payload = json_build (values, &index);
+	free (values);
+	free (text);
+	return payload;
+}
+
+/*
+ * PEM bundles.
+ *
+ * Entitlement certificates carry several PEM sections (CERTIFICATE,
+ * ENTITLEMENT DATA, RSA SIGNATURE) and CA bundles many certificates.
+ * iter_pem walks every section of a file or buffer in one pass, reading a
+ * mapping of the file in place, and turns each into the object its label
+ * calls for:
+ *
+ *   CERTIFICATE                 X509 (or None if it doesn't decode)
+ *   *PRIVATE KEY                PrivateKey (or None)
+ *   ENTITLEMENT DATA            the decoded payload, as load_entitlement
+ *   anything else               the decoded bytes (or None)
+ */
+#define PEM_BEGIN "-----BEGIN "
+#define PEM_DASHES "-----"
+
+typedef struct {
+	PyObject_HEAD;
+	char *map;		/* mapping of the file, or NULL */
+	size_t map_length;
+	Py_buffer buffer;	/* the caller's data, if buffer.buf is set */
+	const char *data;
+	size_t length;
+	size_t offset;
+	int compact;
+	PyObject *module;	/* for the types of the objects made */
+} pem_reader;
+
+static void
+pem_reader_dealloc (pem_reader *self)
+{
+	rhsm_unmap_file (self->map, self->map_length);
+	if (self->buffer.buf != NULL) {
+		PyBuffer_Release (&self->buffer);
+	}
+	Py_XDECREF (self->module);
+	object_free ((PyObject *) self);
+}
+
+/*
+ * Find the next section from *offset on: its label and the span from its
+ * BEGIN line through its END line. Returns 0 when there are no more
+ * sections and -1 if a section is not terminated.
+ */
+static int
+pem_next_section (const char *data, size_t length, size_t *offset,
+		  char *label, const char **section, size_t *section_length)
+{
+	const char *end = data + length;
+	const char *p = data + *offset;
+
+	while (p < end) {
+		const char *begin = memmem (p, end - p, PEM_BEGIN,
+					    strlen (PEM_BEGIN));
+		if (begin == NULL) {
+			break;
+		}
+		const char *name = begin + strlen (PEM_BEGIN);
+		const char *name_end = memmem (name, end - name, PEM_DASHES,
+					       strlen (PEM_DASHES));
+		const char *eol = memchr (name, '\n', end - name);
+		p = name;
+		if (name_end == NULL || name_end == name ||
+		    (eol != NULL && name_end > eol) ||
+		    name_end - name >= MAX_BUF - 16) {
+			/* Not a BEGIN line after all */
+			continue;
+		}
+
+		char end_line[MAX_BUF];
+		int name_length = name_end - name;
+		snprintf (end_line, MAX_BUF, "-----END %.*s-----", name_length,
+			  name);
+		const char *stop = memmem (name_end, end - name_end, end_line,
+					   strlen (end_line));
+		if (stop == NULL) {
+			*offset = length;
+			return -1;
+		}
+		stop += strlen (end_line);
+
+		memcpy (label, name, name_length);
+		label[name_length] = '\0';
+		*section = begin;
+		*section_length = stop - begin;
+		*offset = stop - data;
+		return 1;
+	}
+
+	*offset = length;
+	return 0;
+}
+
+/* The base64 body of any other section, decoded by OpenSSL */
+static PyObject *
+pem_section_bytes (const char *section, size_t length)
+{
+	char *name = NULL;
+	char *header = NULL;
+	unsigned char *body = NULL;
+	long body_length = 0;
+	int ok;
+
+	BEGIN_OPENSSL;
+	BIO *bio = BIO_new_mem_buf ((void *) section, length);
+	ok = bio != NULL &&
+		PEM_read_bio (bio, &name, &header, &body, &body_length);
+	BIO_free (bio);
+	if (!ok) {
+		ERR_clear_error ();
+	}
+	END_OPENSSL;
+
+	if (!ok) {
+		Py_INCREF (Py_None);
+		return Py_None;
+	}
+
+	PyObject *result = PyBytes_FromStringAndSize ((const char *) body,
+						      body_length);
+	OPENSSL_free (name);
+	OPENSSL_free (header);
+	OPENSSL_free (body);
+	return result;
+}
+
+static PyObject *
+pem_section_entitlement (const char *section, size_t length)
+{
+	char *text = NULL;
+	const char *error = NULL;
+	json_value *values;
+
+	Py_BEGIN_ALLOW_THREADS;
+	values = entitlement_parse (section, length, &text, &error);
+	Py_END_ALLOW_THREADS;
+
+	if (error != NULL) {
+		PyErr_SetString (PyExc_ValueError, error);
+		return NULL;
+	}
+	if (values == NULL) {
+		/* an empty section, as load_entitlement */
+		Py_INCREF (Py_None);
+		return Py_None;
+	}
+
+	int index = 0;
+	PyObject *payload = json_build (values, &index);
+	free (values);
+	free (text);
+	return payload;
+}
+
+static PyObject *
+pem_reader_next (pem_reader *self)
+{
+	char label[MAX_BUF];
+	const char *section;
+	size_t section_length;
+
+	int found;
+	BEGIN_OBJECT_LOCK (self);
+	found = pem_next_section (self->data, self->length, &self->offset,
+				  label, &section, &section_length);
+	END_OBJECT_LOCK;
+	if (found < 0) {
+		PyErr_SetString (PyExc_ValueError, "unterminated PEM section");
+		return NULL;
+	}
+	if (found == 0) {
+		return NULL;
+	}
+
+	PyObject *value;
+	certificate_state *state = get_state (self->module);
+	size_t label_length = strlen (label);
+	if (strcmp (label, "CERTIFICATE") == 0) {
+		value = certificate_decode (state, NULL, section,
+					    section_length, 0, self->compact);
+	} else if (label_length >= strlen ("PRIVATE KEY") &&
+		   strcmp (label + label_length - strlen ("PRIVATE KEY"),
+			   "PRIVATE KEY") == 0) {
+		value = private_key_decode (state, NULL, section,
+					    section_length, 0);
+	} else if (strcmp (label, "ENTITLEMENT DATA") == 0) {
+		value = pem_section_entitlement (section, section_length);
+	} else {
+		value = pem_section_bytes (section, section_length);
+	}
+	if (value == NULL) {
+		return NULL;
+	}
+
+	PyObject *name = PyString_FromString (label);
+	if (name == NULL) {
+		Py_DECREF (value);
+		return NULL;
+	}
+	return Py_BuildValue ("(NN)", name, value);
+}
+
+/* The data and its length never change, no lock needed */
+static PyObject *
+pem_reader_text (pem_reader *self, PyObject *ignored)
+{
+	return PyString_FromStringAndSize (self->data, self->length);
+}
+
+static PyMethodDef pem_reader_methods[] = {
+	{"text", (PyCFunction) pem_reader_text, METH_NOARGS,
+	 "the whole PEM the sections are read from, as a string"},
+	{NULL}
+};
+
+static PyType_Slot pem_reader_slots[] = {
+	{Py_tp_dealloc, (void *) pem_reader_dealloc},
+	{Py_tp_doc, (void *) "iterator over the (label, object) sections of a PEM file"},
+	{Py_tp_methods, pem_reader_methods},
+	{Py_tp_iter, (void *) PyObject_SelfIter},
+	{Py_tp_iternext, (void *) pem_reader_next},
+	{0, NULL}
+};
+
+/* Readers only come from iter_pem */
+static PyType_Spec pem_reader_spec = {
+	"_certificate.PemReader",
+	sizeof (pem_reader),
+	0,
+	TYPE_FLAGS | NO_NEW_FLAGS,
+	pem_reader_slots
+};
+
+static PyObject *
+iter_pem (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *file_name = NULL;
+	Py_buffer data = { NULL };
+	int compact = 0;
+
+	static char *keywordlist[] = { "file", "data", "compact", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "|zs*i", keywordlist,
+					  &file_name, &data, &compact)) {
+		return NULL;
+	}
+	if (file_name == NULL && data.buf == NULL) {
+		PyErr_SetString (PyExc_TypeError, "file or data is required");
+		return NULL;
+	}
+
+	PyTypeObject *type = get_state (self)->pem_reader_type;
+	pem_reader *reader = (pem_reader *) type->tp_alloc (type, 0);
+	if (reader == NULL) {
+		if (data.buf != NULL) {
+			PyBuffer_Release (&data);
+		}
+		return NULL;
+	}
+	reader->buffer = data;
+	reader->compact = compact;
+	/* On python 2 module functions get no module */
+	Py_XINCREF (self);
+	reader->module = self;
+
+	if (data.buf != NULL) {
+		reader->data = data.buf;
+		reader->length = data.len;
+		return (PyObject *) reader;
+	}
+
+	int error = 0;
+	Py_BEGIN_ALLOW_THREADS;
+	reader->map = rhsm_map_file (file_name, &reader->map_length, &error);
+	Py_END_ALLOW_THREADS;
+	if (reader->map == NULL) {
+		Py_DECREF (reader);
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename (PyExc_IOError,
+						       (char *) file_name);
+	}
+	reader->data = reader->map;
+	reader->length = reader->map_length;
+	return (PyObject *) reader;
+}
+
+/*
+ * Chain verification.
+ *
+ * A Verifier loads the CA directory into an X509_STORE once and then
+ * checks any number of certificates against it without the GIL, giving
+ * the X509_V_ error code of each (0 when it verifies).
+ */
+typedef struct {
+	PyObject_HEAD;
+	X509_STORE *store;
+	int count;
+} verifier;
+
+static void
+verifier_dealloc (verifier *self)
+{
+	X509_STORE_free (self->store);
+	object_free ((PyObject *) self);
+}
 
-	BN_free (bn);
-	ret = PyLong_FromString (hex, NULL, 16);
-	OPENSSL_free (hex);
-	return ret;
+static Py_ssize_t
+verifier_length (verifier *self)
+{
+	return self->count;
+}
+
+/* The epoch seconds of an "at" argument, -1 (now) for None */
+static int
+verify_time (PyObject *at_arg, long long *at)
+{
+	*at = -1;
+	if (at_arg == NULL || at_arg == Py_None) {
+		return 0;
+	}
+	*at = PyLong_AsLongLong (at_arg);
+	if (*at == -1 && PyErr_Occurred ()) {
+		return -1;
+	}
+	if (*at < 0) {
+		PyErr_SetString (PyExc_ValueError, "at must not be negative");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The X509 behind a certificate object, decoding compact ones. *owned is
+ * set when the caller has to free it. Safe without the GIL.
+ */
+static X509 *
+verify_x509 (certificate_x509 *cert, int *owned)
+{
+	*owned = cert->compact != NULL;
+	if (cert->compact != NULL) {
+		return rhsm_cert_decode (cert->compact);
+	}
+	return cert->x509;
 }
 
 static PyObject *
-get_subject (certificate_x509 *self, PyObject *args)
+verifier_verify (verifier *self, PyObject *args, PyObject *keywords)
 {
-	if (!PyArg_ParseTuple (args, "")) {
+	certificate_x509 *cert = NULL;
+	PyObject *at_arg = NULL;
+
+	static char *keywordlist[] = { "cert", "at", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "O&|O", keywordlist,
+					  certificate_x509_converter, &cert,
+					  &at_arg)) {
 		return NULL;
 	}
 
-	X509_NAME *name = X509_get_subject_name (self->x509);
-	int entries = X509_NAME_entry_count (name);
-	int i;
+	long long at;
+	if (verify_time (at_arg, &at) < 0) {
+		return NULL;
+	}
 
-	PyObject *dict = PyDict_New ();
-	for (i = 0; i < entries; i++) {
-		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
-		ASN1_OBJECT *obj = X509_NAME_ENTRY_get_object (entry);
-		ASN1_STRING *data = X509_NAME_ENTRY_get_data (entry);
+	int result;
+	BEGIN_OPENSSL;
+	int owned;
+	X509 *x509 = verify_x509 (cert, &owned);
+	result = x509 != NULL ? rhsm_verify (self->store, x509, at) :
+		X509_V_ERR_UNSPECIFIED;
+	if (owned) {
+		X509_free (x509);
+	}
+	END_OPENSSL;
 
-		PyObject *key =
-			PyString_FromString (OBJ_nid2sn (OBJ_obj2nid (obj)));
-		PyObject *value = PyString_FromString ((const char *)
-						       ASN1_STRING_get0_data (data));
-		PyDict_SetItem (dict, key, value);
+	return PyLong_FromLong (result);
+}
 
-		Py_DECREF (key);
-		Py_DECREF (value);
+static PyObject *
+verifier_verify_many (verifier *self, PyObject *args, PyObject *keywords)
+{
+	PyObject *certs = NULL;
+	PyObject *at_arg = NULL;
+
+	static char *keywordlist[] = { "certs", "at", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "O|O", keywordlist,
+					  &certs, &at_arg)) {
+		return NULL;
 	}
 
-	return dict;
+	long long at;
+	if (verify_time (at_arg, &at) < 0) {
+		return NULL;
+	}
+
+	/*
+	 * A tuple of our own keeps the certificate objects alive, and in
+	 * place, while other threads run: a list of the caller could change
+	 * under us
+	 */
+	PyObject *seq = PySequence_Tuple (certs);
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	Py_ssize_t count = PyTuple_GET_SIZE (seq);
+	Py_ssize_t i;
+	for (i = 0; i < count; i++) {
+		if (!certificate_x509_check (PyTuple_GET_ITEM (seq, i))) {
+			Py_DECREF (seq);
+			PyErr_SetString (PyExc_TypeError,
+					 "certs must be X509 objects");
+			return NULL;
+		}
+	}
+
+	int *results = malloc (sizeof (int) * (count + 1));
+	if (results == NULL) {
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	BEGIN_OPENSSL;
+	for (i = 0; i < count; i++) {
+		int owned;
+		X509 *x509 = verify_x509 ((certificate_x509 *)
+					  PyTuple_GET_ITEM (seq, i), &owned);
+		results[i] = x509 != NULL ? rhsm_verify (self->store, x509, at) :
+			X509_V_ERR_UNSPECIFIED;
+		if (owned) {
+			X509_free (x509);
+		}
+	}
+	END_OPENSSL;
+	Py_DECREF (seq);
+
+	PyObject *list = PyList_New (count);
+	for (i = 0; list != NULL && i < count; i++) {
+		PyObject *code = PyLong_FromLong (results[i]);
+		if (code == NULL) {
+			Py_CLEAR (list);
+			break;
+		}
+		PyList_SET_ITEM (list, i, code);
+	}
+	free (results);
+	return list;
 }
 
 static PyObject *
-get_issuer (certificate_x509 *self, PyObject *args)
+verifier_new (PyTypeObject *type, PyObject *args, PyObject *keywords)
 {
-	if (!PyArg_ParseTuple (args, "")) {
+	const char *ca_dir = NULL;
+	const char *suffix = ".pem";
+
+	static char *keywordlist[] = { "ca_dir", "suffix", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "s|s", keywordlist,
+					  &ca_dir, &suffix)) {
 		return NULL;
 	}
 
-	X509_NAME *name = X509_get_issuer_name (self->x509);
-	int entries = X509_NAME_entry_count (name);
-	int i;
+	X509_STORE *store;
+	int count = 0;
+	int error;
+	Py_BEGIN_ALLOW_THREADS;
+	store = rhsm_store_from_dir (ca_dir, suffix, &count);
+	error = errno;
+	Py_END_ALLOW_THREADS;
 
-	PyObject *dict = PyDict_New ();
-	for (i = 0; i < entries; i++) {
-		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
-		ASN1_OBJECT *obj = X509_NAME_ENTRY_get_object (entry);
-		ASN1_STRING *data = X509_NAME_ENTRY_get_data (entry);
+	if (store == NULL) {
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename (PyExc_OSError,
+						       (char *) ca_dir);
+	}
 
-		PyObject *key =
-			PyString_FromString (OBJ_nid2sn (OBJ_obj2nid (obj)));
-		PyObject *value = PyString_FromString ((const char *)
-						       ASN1_STRING_get0_data (data));
-		PyDict_SetItem (dict, key, value);
+	verifier *self = (verifier *) type->tp_alloc (type, 0);
+	if (self == NULL) {
+		X509_STORE_free (store);
+		return NULL;
+	}
+	self->store = store;
+	self->count = count;
+	return (PyObject *) self;
+}
 
-		Py_DECREF (key);
-		Py_DECREF (value);
+static PyMethodDef verifier_methods[] = {
+	{"verify", (PyCFunction) verifier_verify,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "verify(cert, at=None): the X509_V_ error code of the certificate's chain, 0 if it verifies (at is epoch seconds, default now)"},
+	{"verify_many", (PyCFunction) verifier_verify_many,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "verify_many(certs, at=None): a list of the verify() codes of every certificate"},
+	{NULL}
+};
+
+static PyType_Slot verifier_slots[] = {
+	{Py_tp_dealloc, (void *) verifier_dealloc},
+	{Py_tp_doc, (void *) "Verifier(ca_dir, suffix='.pem'): certificate chain verification against the CA certificates of a directory"},
+	{Py_tp_methods, verifier_methods},
+	{Py_tp_new, (void *) verifier_new},
+	{Py_sq_length, (void *) verifier_length},
+	{0, NULL}
+};
+
+static PyType_Spec verifier_spec = {
+	"_certificate.Verifier",
+	sizeof (verifier),
+	0,
+	TYPE_FLAGS,
+	verifier_slots
+};
+
+static PyObject *
+verify_error_string (PyObject *self, PyObject *args)
+{
+	long code;
+
+	if (!PyArg_ParseTuple (args, "l", &code)) {
+		return NULL;
 	}
 
-	return dict;
+	return PyString_FromString (X509_verify_cert_error_string (code));
 }
 
+/*
+ * Entitlement key pairing: for many (certificate, key) paths at once,
+ * check without the GIL that each key can be read and belongs to its
+ * certificate. Each pair gets one of the KEY_ constants.
+ */
 static PyObject *
-time_to_string (ASN1_UTCTIME *time)
+check_key_pairs (PyObject *self, PyObject *args)
 {
-	BIO *bio = BIO_new (BIO_s_mem ());
-	ASN1_UTCTIME_print (bio, time);
+	PyObject *pairs = NULL;
 
-	size_t size = BIO_ctrl_pending (bio);
-	char *buf = malloc (sizeof (char) * size);
-	BIO_read (bio, buf, size);
-	BIO_free (bio);
+	if (!PyArg_ParseTuple (args, "O", &pairs)) {
+		return NULL;
+	}
 
-	PyObject *time_str = PyString_FromStringAndSize (buf, size);
-	free (buf);
-	return time_str;
+	PyObject *seq = PySequence_Fast (pairs, "pairs must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE (seq);
+	char **paths = calloc (2 * count + 1, sizeof (char *));
+	int *states = malloc (sizeof (int) * (count + 1));
+	if (paths == NULL || states == NULL) {
+		free (paths);
+		free (states);
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	/* Copy the paths, as for load_many */
+	Py_ssize_t i;
+	int ok = 1;
+	for (i = 0; ok && i < count; i++) {
+		const char *cert_path;
+		const char *key_path;
+		ok = PyArg_ParseTuple (PySequence_Fast_GET_ITEM (seq, i),
+				       "ss;pairs must be (cert, key) paths",
+				       &cert_path, &key_path);
+		if (ok) {
+			paths[2 * i] = strdup (cert_path);
+			paths[2 * i + 1] = strdup (key_path);
+			if (paths[2 * i] == NULL || paths[2 * i + 1] == NULL) {
+				PyErr_NoMemory ();
+				ok = 0;
+			}
+		}
+	}
+	Py_DECREF (seq);
+
+	if (ok) {
+		BEGIN_OPENSSL;
+		for (i = 0; i < count; i++) {
+			states[i] = rhsm_key_pair_check (paths[2 * i],
+							 paths[2 * i + 1]);
+		}
+		END_OPENSSL;
+	}
+
+	PyObject *list = ok ? PyList_New (count) : NULL;
+	for (i = 0; list != NULL && i < count; i++) {
+		PyObject *state = PyLong_FromLong (states[i]);
+		if (state == NULL) {
+			Py_CLEAR (list);
+			break;
+		}
+		PyList_SET_ITEM (list, i, state);
+	}
+
+	for (i = 0; i < 2 * count; i++) {
+		free (paths[i]);
+	}
+	free (paths);
+	free (states);
+	return list;
 }
 
+/*
+ * Group commit of entitlement certificates and keys: write every (name,
+ * data, mode) into directory through rhsm_write_files, without the GIL.
+ */
 static PyObject *
-get_not_before (certificate_x509 *self, PyObject *args)
+write_files (PyObject *self, PyObject *args)
 {
-	ASN1_UTCTIME *time = X509_get_notBefore (self->x509);
-	return time_to_string (time);
+	const char *dir_name;
+	PyObject *entries = NULL;
+
+	if (!PyArg_ParseTuple (args, "sO", &dir_name, &entries)) {
+		return NULL;
+	}
+
+	PyObject *seq = PySequence_Fast (entries, "files must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE (seq);
+	rhsm_file *files = calloc (count + 1, sizeof (rhsm_file));
+	Py_buffer *buffers = calloc (count + 1, sizeof (Py_buffer));
+	if (files == NULL || buffers == NULL) {
+		free (files);
+		free (buffers);
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	/*
+	 * Copy the names, as for load_many; the buffers keep the data
+	 * alive and in place
+	 */
+	Py_ssize_t i;
+	int ok = 1;
+	for (i = 0; ok && i < count; i++) {
+		const char *name;
+		int mode;
+		ok = PyArg_ParseTuple (PySequence_Fast_GET_ITEM (seq, i),
+				       "ss*i;files must be (name, data, mode)",
+				       &name, &buffers[i], &mode);
+		if (ok) {
+			files[i].name = strdup (name);
+			files[i].data = buffers[i].buf;
+			files[i].length = buffers[i].len;
+			files[i].mode = mode;
+			if (files[i].name == NULL) {
+				PyErr_NoMemory ();
+				ok = 0;
+			}
+		}
+	}
+	Py_DECREF (seq);
+
+	int result = 0;
+	int error = 0;
+	if (ok) {
+		Py_BEGIN_ALLOW_THREADS;
+		result = rhsm_write_files (dir_name, files, count);
+		error = errno;
+		Py_END_ALLOW_THREADS;
+	}
+
+	for (i = 0; i < count; i++) {
+		free ((char *) files[i].name);
+		if (buffers[i].buf != NULL) {
+			PyBuffer_Release (&buffers[i]);
+		}
+	}
+	free (files);
+	free (buffers);
+
+	if (!ok) {
+		return NULL;
+	}
+	if (result < 0) {
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename (PyExc_OSError,
+						       (char *) dir_name);
+	}
+	Py_INCREF (Py_None);
+	return Py_None;
 }
 
+typedef struct {
+	char *path;
+	int found;		/* stat worked */
+	rhsm_index_key key;
+	json_value *values;	/* parsed metadata, NULL if stale */
+} index_lookup_job;
+
 static PyObject *
-get_not_after (certificate_x509 *self, PyObject *args)
+index_lookup (PyObject *self, PyObject *args, PyObject *keywords)
 {
-	ASN1_UTCTIME *time = X509_get_notAfter (self->x509);
-	return time_to_string (time);
+	const char *index_path;
+	PyObject *paths;
+
+	static char *keywordlist[] = { "index", "paths", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "sO", keywordlist,
+					  &index_path, &paths)) {
+		return NULL;
+	}
+
+	PyObject *seq = PySequence_Fast (paths, "paths must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	Py_ssize_t count = PySequence_Fast_GET_SIZE (seq);
+	index_lookup_job *jobs = calloc (count + 1, sizeof (index_lookup_job));
+	if (jobs == NULL) {
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	Py_ssize_t i;
+	for (i = 0; i < count; i++) {
+		const char *path;
+		if (!PyArg_Parse (PySequence_Fast_GET_ITEM (seq, i), "s",
+				  &path) || (jobs[i].path = strdup (path)) == NULL) {
+			for (; i >= 0; i--) {
+				free (jobs[i].path);
+			}
+			free (jobs);
+			Py_DECREF (seq);
+			return PyErr_Occurred () ? NULL : PyErr_NoMemory ();
+		}
+	}
+	Py_DECREF (seq);
+
+	rhsm_index index;
+	Py_BEGIN_ALLOW_THREADS;
+	rhsm_index_open (index_path, &index);
+	for (i = 0; i < count; i++) {
+		index_lookup_job *job = &jobs[i];
+		if (rhsm_index_key_stat (job->path, &job->key) < 0) {
+			continue;
+		}
+		job->found = 1;
+
+		rhsm_index_record *record = rhsm_index_find (&index, job->path);
+		if (record == NULL || !rhsm_index_key_matches (record, &job->key)) {
+			continue;
+		}
+		char *data = index.map + record->data_offset;
+		json_parser parser = { data, data + record->data_length, NULL,
+			0, 0, NULL };
+		if (json_parse_value (&parser, 0) >= 0) {
+			json_skip_space (&parser);
+		}
+		if (parser.error == NULL && parser.p == parser.end) {
+			job->values = parser.values;
+		} else {
+			free (parser.values);
+		}
+	}
+	Py_END_ALLOW_THREADS;
+
+	PyObject *found = PyDict_New ();
+	for (i = 0; i < count; i++) {
+		index_lookup_job *job = &jobs[i];
+		if (found != NULL && job->found) {
+			PyObject *metadata;
+			if (job->values != NULL) {
+				int value = 0;
+				metadata = json_build (job->values, &value);
+			} else {
+				Py_INCREF (Py_None);
+				metadata = Py_None;
+			}
+			PyObject *item = NULL;
+			if (metadata != NULL) {
+				item = Py_BuildValue ("((LLLL)N)",
+						      (long long) job->key.inode,
+						      (long long) job->key.mtime,
+						      (long long) job->key.mtime_nsec,
+						      (long long) job->key.size,
+						      metadata);
+			}
+			if (item == NULL ||
+			    PyDict_SetItemString (found, job->path, item) < 0) {
+				Py_CLEAR (found);
+			}
+			Py_XDECREF (item);
+		}
+		free (job->values);
+		free (job->path);
+	}
+	free (jobs);
+
+	uint32_t entries = index.count;
+	rhsm_index_close (&index);
+
+	if (found == NULL) {
+		return NULL;
+	}
+	return Py_BuildValue ("(NI)", found, entries);
+}
+
+static PyObject *
+index_update (PyObject *self, PyObject *args, PyObject *keywords)
+{
+	const char *index_path;
+	PyObject *entries_arg;
+
+	static char *keywordlist[] = { "index", "entries", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords (args, keywords, "sO", keywordlist,
+					  &index_path, &entries_arg)) {
+		return NULL;
+	}
+
+	PyObject *seq = PySequence_Fast (entries_arg,
+					 "entries must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+
+	/* The data buffers belong to seq, which we hold until the end */
+	Py_ssize_t count = PySequence_Fast_GET_SIZE (seq);
+	rhsm_index_entry *entries = calloc (count + 1, sizeof (rhsm_index_entry));
+	if (entries == NULL) {
+		Py_DECREF (seq);
+		return PyErr_NoMemory ();
+	}
+
+	Py_ssize_t i;
+	int ok = 1;
+	for (i = 0; ok && i < count; i++) {
+		const char *path;
+		long long inode, mtime, mtime_nsec, size;
+		Py_ssize_t length = 0;
+
+		ok = PyArg_ParseTuple (PySequence_Fast_GET_ITEM (seq, i),
+				       "s(LLLL)z#", &path, &inode, &mtime,
+				       &mtime_nsec, &size, &entries[i].data,
+				       &length);
+		if (ok) {
+			entries[i].path = strdup (path);
+			entries[i].key.inode = inode;
+			entries[i].key.mtime = mtime;
+			entries[i].key.mtime_nsec = mtime_nsec;
+			entries[i].key.size = size;
+			entries[i].length = length;
+			if (entries[i].path == NULL) {
+				PyErr_NoMemory ();
+				ok = 0;
+			}
+		}
+	}
+
+	int result = -1;
+	int error = 0;
+	if (ok) {
+		Py_BEGIN_ALLOW_THREADS;
+		rhsm_index index;
+		rhsm_index_open (index_path, &index);
+
+		/* Entries without data keep their blob from the old index */
+		size_t kept = 0;
+		for (i = 0; i < count; i++) {
+			rhsm_index_entry *entry = &entries[i];
+			if (entry->data == NULL) {
+				rhsm_index_record *record = rhsm_index_find (&index,
+								   entry->path);
+				if (record == NULL ||
+				    !rhsm_index_key_matches (record, &entry->key)) {
+					free (entry->path);
+					continue;
+				}
+				entry->data = index.map + record->data_offset;
+				entry->length = record->data_length;
+			}
+			entries[kept++] = *entry;
+		}
+
+		result = rhsm_index_write (index_path, entries, kept);
+		error = errno;
+		rhsm_index_close (&index);
+
+		for (i = 0; i < (Py_ssize_t) kept; i++) {
+			free (entries[i].path);
+		}
+		Py_END_ALLOW_THREADS;
+	} else {
+		for (i = 0; i < count; i++) {
+			free (entries[i].path);
+		}
+	}
+	free (entries);
+	Py_DECREF (seq);
+
+	if (!ok) {
+		return NULL;
+	}
+	if (result < 0) {
+		errno = error;
+		return PyErr_SetFromErrnoWithFilename (PyExc_OSError,
+						       (char *) index_path);
+	}
+	Py_INCREF (Py_None);
+	return Py_None;
 }
 
 static PyMethodDef cert_methods[] = {
 	{"load", (PyCFunction) load_cert, METH_VARARGS | METH_KEYWORDS,
-	 "load a certificate from a file"},
+	 "load a certificate from a file, or from a pem or der buffer, "
+	 "compact=True keeps only what the X509 methods need and frees the "
+	 "OpenSSL certificate"},
 	{"load_private_key", (PyCFunction) load_private_key, METH_VARARGS | METH_KEYWORDS,
-	 "load a private key from a file"},
+	 "load a private key from a file, or from a pem or der buffer"},
+	{"check_key_pairs", (PyCFunction) check_key_pairs, METH_VARARGS,
+	 "check_key_pairs([(cert_path, key_path), ...]): a list of the KEY_ state of every pair"},
+	{"write_files", (PyCFunction) write_files, METH_VARARGS,
+	 "write_files(directory, [(name, data, mode), ...]): write the files "
+	 "into directory as one batch, renaming them in once they are all "
+	 "written and synced"},
+	{"verify_error_string", (PyCFunction) verify_error_string, METH_VARARGS,
+	 "describe an error code returned by Verifier"},
+	{"iter_pem", (PyCFunction) iter_pem, METH_VARARGS | METH_KEYWORDS,
+	 "iterate over the (label, object) sections of a PEM file or buffer in "
+	 "one pass"},
+	{"load_many", (PyCFunction) load_many, METH_VARARGS | METH_KEYWORDS,
+	 "load certificates from a list of files in parallel, returning "
+	 "([(path, x509, pem)], [(path, error)])"},
+	{"load_directory", (PyCFunction) load_directory,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "load every certificate in a directory in parallel, returning "
+	 "([(path, x509, pem)], [(path, error)])"},
+	{"scan_validity", (PyCFunction) scan_validity,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "sort the certificates in a directory into valid, expiring, expired "
+	 "and future paths, plus failed (path, error) pairs"},
+	{"load_entitlement", (PyCFunction) load_entitlement,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "decode the entitlement data payload of a v3 certificate file or pem, "
+	 "None if it has none"},
+	{"index_lookup", (PyCFunction) index_lookup,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "look paths up in a metadata index file, returning "
+	 "({path: (key, metadata or None)}, entry count)"},
+	{"index_update", (PyCFunction) index_update,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "atomically rewrite a metadata index from (path, key, data) entries, "
+	 "keeping the old data for entries whose data is None"},
 	{NULL}
 };
 
+/* Create a type as module.name, also keeping a reference in *slot */
+static int
+add_type (PyObject *module, const char *name, PyType_Spec *spec,
+	  PyTypeObject **slot)
+{
+	PyObject *type = PyType_FromSpec (spec);
+	if (type == NULL) {
+		return -1;
+	}
+	if (slot != NULL) {
+		Py_INCREF (type);
+		*slot = (PyTypeObject *) type;
+	}
+	/* PyModule_AddObject only steals the reference on success */
+	if (PyModule_AddObject (module, name, type) < 0) {
+		Py_DECREF (type);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+certificate_exec (PyObject *module)
+{
+	certificate_state *state = get_state (module);
+
+	if (add_type (module, "X509", &certificate_x509_spec,
+		      &state->x509_type) < 0 ||
+	    add_type (module, "PrivateKey", &private_key_spec,
+		      &state->private_key_type) < 0 ||
+	    add_type (module, "PathTree", &path_tree_spec, NULL) < 0 ||
+	    add_type (module, "PathIndex", &path_index_spec, NULL) < 0 ||
+	    add_type (module, "PemReader", &pem_reader_spec,
+		      &state->pem_reader_type) < 0 ||
+	    add_type (module, "Verifier", &verifier_spec, NULL) < 0) {
+		return -1;
+	}
+#if PY_MAJOR_VERSION >= 3 && !defined(Py_TPFLAGS_DISALLOW_INSTANTIATION)
+	/* Heap types would otherwise inherit object's tp_new */
+	state->pem_reader_type->tp_new = NULL;
+#endif
+
+	if (PyModule_AddIntConstant (module, "KEY_OK", RHSM_KEY_OK) < 0 ||
+	    PyModule_AddIntConstant (module, "KEY_MISSING",
+				     RHSM_KEY_MISSING) < 0 ||
+	    PyModule_AddIntConstant (module, "KEY_INVALID",
+				     RHSM_KEY_INVALID) < 0 ||
+	    PyModule_AddIntConstant (module, "KEY_MISMATCH",
+				     RHSM_KEY_MISMATCH) < 0 ||
+	    PyModule_AddIntConstant (module, "KEY_CERT_INVALID",
+				     RHSM_KEY_CERT_INVALID) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
 #if PY_MAJOR_VERSION >= 3
+static int
+certificate_traverse (PyObject *module, visitproc visit, void *arg)
+{
+	certificate_state *state = get_state (module);
+	Py_VISIT (state->x509_type);
+	Py_VISIT (state->private_key_type);
+	Py_VISIT (state->pem_reader_type);
+	return 0;
+}
+
+static int
+certificate_clear (PyObject *module)
+{
+	certificate_state *state = get_state (module);
+	Py_CLEAR (state->x509_type);
+	Py_CLEAR (state->private_key_type);
+	Py_CLEAR (state->pem_reader_type);
+	return 0;
+}
+
+static void
+certificate_free (void *module)
+{
+	certificate_clear ((PyObject *) module);
+}
+
+/*
+ * All state is per module instance and every object locks what it
+ * changes after creation, so the module can be imported by several
+ * interpreters each with their own GIL, and without a GIL at all.
+ * OpenSSL before 1.1.0 is only safe to use from one thread at a time,
+ * which there the GIL takes care of.
+ */
+static PyModuleDef_Slot certificate_slots[] = {
+	{Py_mod_exec, (void *) certificate_exec},
+#ifdef Py_mod_multiple_interpreters
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if defined(Py_mod_gil) && OPENSSL_VERSION_NUMBER >= 0x10100000L
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, NULL}
+};
+
 static struct PyModuleDef moduledef = {
 	PyModuleDef_HEAD_INIT,
 	"_certificate",
 	NULL,
-	0,
+	sizeof (certificate_state),
 	cert_methods,
-	NULL,
-	NULL,
-	NULL,
-	NULL
+	certificate_slots,
+	certificate_traverse,
+	certificate_clear,
+	certificate_free
 };
 
 PyMODINIT_FUNC
 PyInit__certificate (void)
+{
+	return PyModuleDef_Init (&moduledef);
+}
 #else
 PyMODINIT_FUNC
 init_certificate (void)
-#endif
 {
-	PyObject *module;
-	#if PY_MAJOR_VERSION >= 3
-	module = PyModule_Create (&moduledef);
-	#else
-	module = Py_InitModule ("_certificate", cert_methods);
-	#endif
-
-	certificate_x509_type.tp_new = PyType_GenericNew;
-	if (PyType_Ready (&certificate_x509_type) < 0) {
-		return;
-	}
-
-	Py_INCREF (&certificate_x509_type);
-	PyModule_AddObject (module, "X509",
-			    (PyObject *) & certificate_x509_type);
-
-    private_key_type.tp_new = PyType_GenericNew;
-	if (PyType_Ready (&private_key_type) < 0) {
-		return;
+	PyObject *module = Py_InitModule ("_certificate", cert_methods);
+	if (module != NULL) {
+		certificate_exec (module);
 	}
-
-	Py_INCREF (&private_key_type);
-	PyModule_AddObject (module, "PrivateKey",
-			    (PyObject *) & private_key_type);
-	#if PY_MAJOR_VERSION >= 3
-	return module;
-	#endif
 }
+#endif
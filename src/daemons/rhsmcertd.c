@@ -18,6 +18,8 @@
 
 #include <linux/version.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -27,27 +29,53 @@
 #include <time.h>
 #include <wait.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <libintl.h>
 #include <locale.h>
 
+#include "rhsmcert.h"
+
 #define LOGFILE "/var/log/rhsm/rhsmcertd.log"
 #define LOCKFILE "/var/lock/subsys/rhsmcertd"
 #define UPDATEFILE "/var/run/rhsm/update"
 #define NEXT_CERT_UPDATE_FILE "/var/run/rhsm/next_cert_check_update"
 #define NEXT_AUTO_ATTACH_UPDATE_FILE "/var/run/rhsm/next_auto_attach_update"
+#define STATE_FILE "/var/lib/rhsm/rhsmcertd.state"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
 #define WORKER LIBEXECDIR"/rhsmcertd-worker"
 #define WORKER_NAME WORKER
 #define INITIAL_DELAY_SECONDS 120
 #define INITIAL_DELAY_OFFSET_MAX 600
 #define DEFAULT_CERT_INTERVAL_SECONDS 14400    /* 4 hours */
 #define DEFAULT_HEAL_INTERVAL_SECONDS 86400    /* 24 hours */
+#define DEFAULT_WORKER_TIMEOUT_SECONDS 3600    /* 1 hour */
+#define KILL_GRACE_SECONDS 30
+#define RETRY_BASE_SECONDS 60
+/* Worker exit codes, see rhsmcertd_worker.py */
+#define EXIT_NO_RETRY 99    /* not registered, or disabled */
+/* "rate limited", plus the minutes to wait */
+#define EXIT_RATE_LIMITED 100
+#define EXIT_RATE_LIMITED_MAX 199
 #define RAND_MAX_MINUTES RAND_MAX / 60
 #define DEFAULT_SPLAY_ENABLED true
+#define DEFAULT_SPLAY_MODE SPLAY_RANDOM
+#define DEFAULT_PERSISTENT_WORKER false
+#define DEFAULT_EXPIRY_SCHEDULING false
+#define DEFAULT_EXPIRY_MARGIN_SECONDS 3600    /* 1 hour */
 #define BUF_MAX 256
-#define RHSM_CONFIG_FILE "/etc/rhsm/rhsm.conf"
+#define RHSM_CONFIG_DIR "/etc/rhsm"
+#define RHSM_CONFIG_NAME "rhsm.conf"
+#define RHSM_CONFIG_FILE RHSM_CONFIG_DIR "/" RHSM_CONFIG_NAME
+#define ENTITLEMENT_CERT_DIR "/etc/pki/entitlement"
+#define CONSUMER_CERT_DIR "/etc/pki/consumer"
+#define CONSUMER_CERT CONSUMER_CERT_DIR "/cert.pem"
+#define PRODUCT_CERT_DIR "/etc/pki/product"
+#define TRIGGER_DEBOUNCE_SECONDS 10
+#define TRIGGER_QUIET_SECONDS 10
 
 #define _(STRING) gettext(STRING)
 #define N_(x) x
@@ -72,15 +100,48 @@ static gboolean show_debug = FALSE;
 static gboolean run_now = FALSE;
 static gint arg_cert_interval_minutes = -1;
 static gint arg_heal_interval_minutes = -1;
+static gint arg_worker_timeout_minutes = -1;
 static gboolean arg_no_splay = FALSE;
+static gchar *arg_splay_mode = NULL;
+static gboolean arg_persistent_worker = FALSE;
+static bool persistent_worker = false;
+static gboolean arg_expiry_scheduling = FALSE;
+static bool expiry_scheduling = false;
+static int expiry_margin_seconds = DEFAULT_EXPIRY_MARGIN_SECONDS;
 static int fd_lock = -1;
 
+typedef enum {
+    SPLAY_RANDOM,
+    SPLAY_UUID,
+} SplayMode;
+
 struct CertCheckData {
+    const char *name;           /* group in STATE_FILE */
     int interval_seconds;
     bool heal;
     char *next_update_file;
+    int timeout_seconds;        /* 0 lets the worker run forever */
+    GPid pid;                   /* the running worker, 0 when idle */
+    guint kill_source;          /* timer that signals a hung worker */
+    int kill_signal;
+    bool timed_out;             /* the worker was signalled, the run failed */
+    bool triggered;             /* run at the next expiry check regardless */
+    int failures;               /* failed runs in a row */
+    guint retry_source;
+    guint timer_source;         /* the next regular run */
+    guint log_source;
+    time_t last_run;
+    time_t next_due;
+    long long next_due_boottime;
 };
 
+/* The jobs, for save_state () */
+static struct CertCheckData *jobs[2];
+static const char *log_path = LOGFILE;
+static const char *state_file = STATE_FILE;
+static char boot_id[64];
+static time_t last_run_done;
+
 static GOptionEntry entries[] = {
     /* marked deprecated as of 02-19-2013, needs to be removed...? */
     {"cert-interval", 0, 0, G_OPTION_ARG_INT, &arg_heal_interval_minutes,
@@ -96,6 +157,15 @@ static GOptionEntry entries[] = {
     {"auto-attach-interval", 'i', 0, G_OPTION_ARG_INT, &arg_heal_interval_minutes,
      N_("interval to run auto-attach (in minutes)"),
      "MINUTES"},
+    {"worker-timeout", 't', 0, G_OPTION_ARG_INT, &arg_worker_timeout_minutes,
+     N_("stop a worker that runs longer than this (in minutes, 0 to never stop it)"),
+     "MINUTES"},
+    {"persistent-worker", 'p', 0, G_OPTION_ARG_NONE, &arg_persistent_worker,
+     N_("run the checks in one long-lived worker"),
+     NULL},
+    {"expiry-scheduling", 'e', 0, G_OPTION_ARG_NONE, &arg_expiry_scheduling,
+     N_("only run the cert check when a certificate is about to expire"),
+     NULL},
     {"now", 'n', 0, G_OPTION_ARG_NONE, &run_now,
      N_("run the initial checks immediately, with no delay"),
      NULL},
@@ -104,13 +174,21 @@ static GOptionEntry entries[] = {
     {"no-splay", 's', 0, G_OPTION_ARG_NONE, &arg_no_splay,
      N_("do not add an offset to the initial checks."),
      NULL},
+    {"splay-mode", 'm', 0, G_OPTION_ARG_STRING, &arg_splay_mode,
+     N_("how to pick the offset of the initial checks: random or uuid"),
+     "MODE"},
     {NULL}
 };
 
 typedef struct _Config {
     int heal_interval_seconds;
     int cert_interval_seconds;
+    int worker_timeout_seconds;
     bool splay;
+    SplayMode splay_mode;
+    bool persistent_worker;
+    bool expiry_scheduling;
+    int expiry_margin_seconds;
 } Config;
 
 const char *
@@ -142,7 +220,7 @@ r_log (const char *level, const char *message, ...)
 {
     bool use_stdout = false;
     va_list argp;
-    FILE *log_file = fopen (LOGFILE, "a");
+    FILE *log_file = fopen (log_path, "a");
     if (!log_file) {
         // redirect message to stdout
         log_file = stdout;
@@ -187,11 +265,246 @@ log_update (int delay, char *path_to_file)
     return TRUE;
 }
 
+static const char *
+job_action (struct CertCheckData *cert_data)
+{
+    return cert_data->heal ? "Auto-attach" : "Cert Check";
+}
+
+/* Seconds since boot, suspend included; it doesn't jump like time () */
+static long long
+boottime ()
+{
+    struct timespec ts;
+    if (clock_gettime (CLOCK_BOOTTIME, &ts) == -1) {
+        return 0;
+    }
+    return ts.tv_sec;
+}
+
+static void
+read_boot_id ()
+{
+    FILE *file = fopen (BOOT_ID_FILE, "r");
+    if (file == NULL || fgets (boot_id, sizeof (boot_id), file) == NULL) {
+        debug ("Unable to read %s", BOOT_ID_FILE);
+        boot_id[0] = '\0';
+    } else {
+        g_strchomp (boot_id);
+    }
+    if (file != NULL) {
+        fclose (file);
+    }
+}
+
+/*
+ * Save when each job last ran and is due next, so that a restarted
+ * rhsmcertd can pick up the schedule where this one left it. Within one
+ * boot the due time is also kept as CLOCK_BOOTTIME, which survives the
+ * wall clock being set.
+ */
+static void
+save_state ()
+{
+    GKeyFile *state = g_key_file_new ();
+    GError *err = NULL;
+    gsize length;
+    size_t i;
+
+    g_key_file_set_string (state, "rhsmcertd", "boot_id", boot_id);
+    for (i = 0; i < G_N_ELEMENTS (jobs); i++) {
+        struct CertCheckData *cert_data = jobs[i];
+        if (cert_data == NULL || cert_data->next_due == 0) {
+            continue;
+        }
+        g_key_file_set_int64 (state, cert_data->name, "last_run",
+                              cert_data->last_run);
+        g_key_file_set_int64 (state, cert_data->name, "next_due",
+                              cert_data->next_due);
+        g_key_file_set_int64 (state, cert_data->name, "next_due_boottime",
+                              cert_data->next_due_boottime);
+    }
+
+    gchar *data = g_key_file_to_data (state, &length, NULL);
+    if (!g_file_set_contents (state_file, data, length, &err)) {
+        warn ("Unable to save the schedule: %s", err->message);
+        g_error_free (err);
+    }
+    g_free (data);
+    g_key_file_free (state);
+}
+
+/* The state saved by the previous rhsmcertd, NULL if there is none */
+static GKeyFile *
+load_state ()
+{
+    GKeyFile *state = g_key_file_new ();
+    GError *err = NULL;
+
+    if (!g_key_file_load_from_file (state, state_file, G_KEY_FILE_NONE,
+                                    &err)) {
+        debug ("No schedule saved in %s: %s", state_file, err->message);
+        g_error_free (err);
+        g_key_file_free (state);
+        return NULL;
+    }
+    return state;
+}
+
+/* Record when the job runs next, for the rhsm tools and the next rhsmcertd */
+static void
+job_scheduled (struct CertCheckData *cert_data, int delay)
+{
+    cert_data->next_due = time (NULL) + delay;
+    cert_data->next_due_boottime = boottime () + delay;
+    log_update (delay, cert_data->next_update_file);
+    save_state ();
+}
+
 static gboolean
 log_update_from_cert_data(gpointer data)
 {
     struct CertCheckData *cert_data = data;
-    return log_update(cert_data->interval_seconds, cert_data->next_update_file);
+    job_scheduled (cert_data, cert_data->interval_seconds);
+    return TRUE;
+}
+
+/*
+ * How long until the job is due by the saved state, in *due_in, negative
+ * when it is overdue. Returns false if the state has nothing on the job.
+ */
+static bool
+saved_due_in (GKeyFile *state, struct CertCheckData *cert_data,
+              long long *due_in)
+{
+    GError *err = NULL;
+    gint64 next_due = g_key_file_get_int64 (state, cert_data->name,
+                                            "next_due", &err);
+    if (err != NULL) {
+        g_error_free (err);
+        return false;
+    }
+
+    gchar *saved_boot_id = g_key_file_get_string (state, "rhsmcertd",
+                                                  "boot_id", NULL);
+    gint64 next_due_boottime = g_key_file_get_int64 (state, cert_data->name,
+                                                     "next_due_boottime",
+                                                     &err);
+    if (err == NULL && saved_boot_id != NULL && boot_id[0] != '\0' &&
+        strcmp (saved_boot_id, boot_id) == 0) {
+        *due_in = next_due_boottime - boottime ();
+    } else {
+        *due_in = next_due - time (NULL);
+    }
+    if (err != NULL) {
+        g_error_free (err);
+    }
+    g_free (saved_boot_id);
+
+    // The clock went back, or the interval got shorter
+    if (*due_in > cert_data->interval_seconds) {
+        *due_in = cert_data->interval_seconds;
+    }
+    return true;
+}
+
+/*
+ * Pick up the schedule of the previous rhsmcertd. A job that is overdue,
+ * by however much, runs once: after the initial delay, plus its splay
+ * scaled down to INITIAL_DELAY_OFFSET_MAX so a fleet coming back from an
+ * outage does not catch up all at once. There is no catch up if the job
+ * last ran, e.g. as a retry, less than an interval ago; it runs again one
+ * interval after that.
+ */
+static void
+resume_schedule (GKeyFile *state, struct CertCheckData *cert_data,
+                 int splay_offset, int *delay)
+{
+    long long due_in;
+    if (!saved_due_in (state, cert_data, &due_in)) {
+        return;
+    }
+
+    gint64 last_run = g_key_file_get_int64 (state, cert_data->name,
+                                            "last_run", NULL);
+    long long since_run = (long long) time (NULL) - last_run;
+    bool ran = last_run > 0 && since_run >= 0;
+    if (ran) {
+        cert_data->last_run = (time_t) last_run;
+    }
+
+    if (due_in > INITIAL_DELAY_SECONDS) {
+        *delay = (int) due_in;
+        cert_data->triggered = false;
+        info ("(%s) Resuming the previous schedule, next run in %d seconds.",
+              job_action (cert_data), *delay);
+    } else if (ran &&
+               since_run + INITIAL_DELAY_SECONDS < cert_data->interval_seconds) {
+        *delay = (int) (cert_data->interval_seconds - since_run);
+        cert_data->triggered = false;
+        info ("(%s) Last ran %lld seconds ago, next run in %d seconds.",
+              job_action (cert_data), since_run, *delay);
+    } else {
+        int catch_up = 0;
+        if (cert_data->interval_seconds > 0) {
+            catch_up = (int) ((long long) splay_offset *
+                              INITIAL_DELAY_OFFSET_MAX /
+                              cert_data->interval_seconds);
+        }
+        *delay = INITIAL_DELAY_SECONDS + catch_up;
+        info ("(%s) Run is %lld seconds overdue, catching up in %d seconds.",
+              job_action (cert_data), due_in < 0 ? -due_in : 0, *delay);
+    }
+}
+
+/* Log when the first entitlement certificate runs out */
+static void
+log_entitlement_expiry ()
+{
+    long long not_after;
+    int count = rhsm_dir_earliest_expiry (ENTITLEMENT_CERT_DIR, ".pem",
+                                          "-key.pem", &not_after);
+    if (count < 0) {
+        debug ("Unable to read %s: %s", ENTITLEMENT_CERT_DIR,
+               strerror (errno));
+    } else if (count == 0) {
+        debug ("No entitlement certificates found in %s",
+               ENTITLEMENT_CERT_DIR);
+    } else {
+        char buf[BUF_MAX];
+        time_t expiry = (time_t) not_after;
+        strftime (buf, BUF_MAX, "%FT%T%z", localtime (&expiry));
+        info ("Earliest of %d entitlement certificates expires at %s",
+              count, buf);
+    }
+}
+
+/*
+ * The earliest notAfter of the entitlement and identity certificates.
+ * Returns false if there are none to go by.
+ */
+static bool
+earliest_expiry (long long *not_after)
+{
+    const char *dirs[][2] = {
+        {ENTITLEMENT_CERT_DIR, "-key.pem"},
+        {CONSUMER_CERT_DIR, "key.pem"},
+    };
+    bool found = false;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (dirs); i++) {
+        long long dir_not_after;
+        int count = rhsm_dir_earliest_expiry (dirs[i][0], ".pem", dirs[i][1],
+                                              &dir_not_after);
+        if (count < 0) {
+            debug ("Unable to read %s: %s", dirs[i][0], strerror (errno));
+        } else if (count > 0 && (!found || dir_not_after < *not_after)) {
+            *not_after = dir_not_after;
+            found = true;
+        }
+    }
+    return found;
 }
 
 long long gen_random(long long max) {
@@ -211,6 +524,80 @@ long long gen_random(long long max) {
     return random_num % true_max;
 }
 
+/*
+ * FNV-1a of "uuid:job". test/bench/splay_sim.py has a copy, keep them
+ * in step.
+ */
+static uint64_t
+splay_hash (const char *uuid, const char *job)
+{
+    const char *parts[] = { uuid, ":", job };
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    const char *p;
+
+    for (i = 0; i < G_N_ELEMENTS (parts); i++) {
+        for (p = parts[i]; *p; p++) {
+            hash ^= (unsigned char) *p;
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * The splay of a job in uuid mode: the seconds to wait, on top of
+ * INITIAL_DELAY_SECONDS, until the slot of this consumer. The slot is a
+ * fixed second within each interval counted from the epoch, so a host
+ * keeps its schedule across restarts and a fleet is spread evenly over
+ * the interval however its hosts were restarted.
+ */
+static int
+uuid_splay (const char *uuid, const char *job, int interval, time_t now)
+{
+    if (interval <= 0) {
+        return 0;
+    }
+    long long slot = (long long) (splay_hash (uuid, job) % (uint64_t) interval);
+    long long start = (long long) now + INITIAL_DELAY_SECONDS;
+    return (int) (((slot - start) % interval + interval) % interval);
+}
+
+/* The consumer uuid, the CN of the identity certificate; free () it */
+static char *
+consumer_uuid ()
+{
+    int err = 0;
+    char *uuid = NULL;
+    int i;
+
+    rhsm_cert *cert = rhsm_cert_load (CONSUMER_CERT, &err);
+    if (cert == NULL) {
+        debug ("Unable to read %s: %s", CONSUMER_CERT, strerror (err));
+        return NULL;
+    }
+    for (i = 0; i < cert->subject_count && uuid == NULL; i++) {
+        if (strcmp (cert->subject[2 * i], "CN") == 0) {
+            uuid = strdup (cert->subject[2 * i + 1]);
+        }
+    }
+    rhsm_cert_free (cert);
+    return uuid;
+}
+
+static bool
+parse_splay_mode (const char *value, SplayMode *mode)
+{
+    if (strcmp (value, "random") == 0) {
+        *mode = SPLAY_RANDOM;
+    } else if (strcmp (value, "uuid") == 0) {
+        *mode = SPLAY_UUID;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 /* Handle program signals */
 void
 signal_handler(int signo) {
@@ -245,56 +632,450 @@ get_lock ()
     return ret;
 }
 
+/*
+ * The worker runs longer than its timeout: ask it to stop, and if it is
+ * still around after a grace period, kill it. The worker is the leader of
+ * its own process group, so anything it started goes with it.
+ */
+static gboolean
+worker_timeout (gpointer data)
+{
+    struct CertCheckData *cert_data = data;
+
+    warn ("(%s) Worker %d still running after %d seconds, sending %s.",
+          job_action (cert_data), (int) cert_data->pid,
+          cert_data->timeout_seconds, strsignal (cert_data->kill_signal));
+    // The worker may well exit 0 on SIGTERM, that is no success
+    cert_data->timed_out = true;
+    if (kill (-cert_data->pid, cert_data->kill_signal) == -1 && errno != ESRCH) {
+        warn ("(%s) Unable to signal worker %d: %s", job_action (cert_data),
+              (int) cert_data->pid, strerror (errno));
+    }
+
+    if (cert_data->kill_signal == SIGTERM) {
+        cert_data->kill_signal = SIGKILL;
+        cert_data->kill_source = g_timeout_add_seconds (KILL_GRACE_SECONDS,
+                                                        worker_timeout,
+                                                        cert_data);
+    } else {
+        cert_data->kill_source = 0;
+    }
+    return FALSE;
+}
+
+static void
+start_timeout (struct CertCheckData *cert_data)
+{
+    cert_data->timed_out = false;
+    if (cert_data->timeout_seconds > 0) {
+        cert_data->kill_signal = SIGTERM;
+        cert_data->kill_source =
+            g_timeout_add_seconds (cert_data->timeout_seconds,
+                                   worker_timeout, cert_data);
+    }
+}
+
+static gboolean cert_check (gpointer data);
+
+static gboolean
+retry_check (gpointer data)
+{
+    struct CertCheckData *cert_data = data;
+    cert_data->retry_source = 0;
+    cert_check (cert_data);
+    return FALSE;
+}
+
+/*
+ * Retry a failed run with exponential backoff and full jitter: after a
+ * random delay of up to RETRY_BASE_SECONDS, doubled with every failure in
+ * a row and capped at the interval, so that hosts that failed together
+ * do not come back together. When the server asked to wait, the jitter
+ * goes on top of that.
+ */
+static long long
+retry_delay (struct CertCheckData *cert_data, int wait_seconds)
+{
+    int backoff = cert_data->interval_seconds;
+    if (cert_data->failures <= 16 &&
+        (RETRY_BASE_SECONDS << (cert_data->failures - 1)) < backoff) {
+        backoff = RETRY_BASE_SECONDS << (cert_data->failures - 1);
+    }
+    long long delay = wait_seconds + g_random_int_range (1, backoff + 1);
+    if (delay > cert_data->interval_seconds) {
+        delay = cert_data->interval_seconds;
+    }
+    return delay;
+}
+
+/* There is no retry if the regular run comes first */
+static void
+schedule_retry (struct CertCheckData *cert_data, int wait_seconds)
+{
+    long long delay = retry_delay (cert_data, wait_seconds);
+
+    if (cert_data->next_due != 0 && time (NULL) + delay >= cert_data->next_due) {
+        info ("(%s) Retry will occur on next run.", job_action (cert_data));
+        return;
+    }
+    info ("(%s) Failed %d times in a row, retrying in %lld seconds.",
+          job_action (cert_data), cert_data->failures, delay);
+    cert_data->retry_source = g_timeout_add_seconds ((guint) delay,
+                                                     retry_check, cert_data);
+}
+
+/* Log how a run went, code is the exit code unless signo is set */
+static void
+job_done (struct CertCheckData *cert_data, int code, int signo)
+{
+    int wait_seconds = 0;
+    bool timed_out = cert_data->timed_out;
+
+    if (cert_data->kill_source != 0) {
+        g_source_remove (cert_data->kill_source);
+        cert_data->kill_source = 0;
+    }
+    cert_data->pid = 0;
+    cert_data->timed_out = false;
+    last_run_done = time (NULL);
+
+    if (signo != 0) {
+        warn ("(%s) Update killed by signal %d.", job_action (cert_data),
+              signo);
+    } else if (timed_out) {
+        warn ("(%s) Update timed out (%d).", job_action (cert_data), code);
+    } else if (code == 0) {
+        info ("(%s) Certificates updated.", job_action (cert_data));
+        cert_data->failures = 0;
+        return;
+    } else if (code == EXIT_NO_RETRY) {
+        // A retry would not fare any better, wait for the next run
+        info ("(%s) Update skipped, retry will occur on next run.",
+              job_action (cert_data));
+        cert_data->failures = 0;
+        return;
+    } else if (code >= EXIT_RATE_LIMITED && code <= EXIT_RATE_LIMITED_MAX) {
+        wait_seconds = (code - EXIT_RATE_LIMITED) * 60;
+        warn ("(%s) Rate limited by the server, asked to wait %d seconds.",
+              job_action (cert_data), wait_seconds);
+    } else {
+        warn ("(%s) Update failed (%d).", job_action (cert_data), code);
+    }
+    cert_data->failures++;
+    schedule_retry (cert_data, wait_seconds);
+}
+
+static void
+worker_exited (GPid pid, gint status, gpointer data)
+{
+    struct CertCheckData *cert_data = data;
+
+    if (WIFSIGNALED (status)) {
+        job_done (cert_data, 0, WTERMSIG (status));
+    } else {
+        job_done (cert_data, WEXITSTATUS (status), 0);
+    }
+    g_spawn_close_pid (pid);
+}
+
+/*
+ * With --persistent-worker the checks run in one long-lived worker that
+ * keeps its imports and configuration between runs. It reads a command
+ * per line from a socketpair and answers each with a line holding the
+ * exit code of the run, followed by " exit" when it is about to go away
+ * (after some number of runs, or when it grew too much). Only one run is
+ * sent at a time; runs of the other check wait in the pending queue.
+ */
+static struct {
+    GPid pid;                   /* 0 when there is no worker */
+    int fd;                     /* our end of the socketpair, -1 if closed */
+    guint io_source;
+    struct CertCheckData *job;  /* the run the worker is busy with */
+    GQueue pending;
+    char reply[BUF_MAX];
+    size_t reply_length;
+} worker = { 0, -1, 0, NULL, G_QUEUE_INIT, "", 0 };
+
+static void worker_dispatch ();
+
+static void
+worker_close ()
+{
+    if (worker.io_source != 0) {
+        g_source_remove (worker.io_source);
+        worker.io_source = 0;
+    }
+    if (worker.fd != -1) {
+        close (worker.fd);
+        worker.fd = -1;
+    }
+    worker.reply_length = 0;
+}
+
+static gboolean
+worker_readable (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    ssize_t count = read (worker.fd, worker.reply + worker.reply_length,
+                          sizeof (worker.reply) - worker.reply_length - 1);
+    if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return TRUE;
+    }
+    if (count <= 0) {
+        // worker_gone () takes care of the run it had
+        worker.io_source = 0;
+        worker_close ();
+        return FALSE;
+    }
+    worker.reply_length += count;
+    worker.reply[worker.reply_length] = '\0';
+    if (strchr (worker.reply, '\n') == NULL &&
+        worker.reply_length < sizeof (worker.reply) - 1) {
+        return TRUE;
+    }
+
+    int code;
+    char word[16];
+    int fields = sscanf (worker.reply, "%d %15s", &code, word);
+    if (fields < 1 || worker.job == NULL) {
+        warn ("Unexpected reply from worker %d, stopping it.",
+              (int) worker.pid);
+        kill (-worker.pid, SIGTERM);
+        worker.io_source = 0;
+        worker_close ();
+        return FALSE;
+    }
+
+    struct CertCheckData *cert_data = worker.job;
+    worker.job = NULL;
+    worker.reply_length = 0;
+    job_done (cert_data, code, 0);
+
+    if (fields == 2 && strcmp (word, "exit") == 0) {
+        // Let it go, worker_gone () starts a new one if there is work
+        debug ("Worker %d is retiring", (int) worker.pid);
+        worker.io_source = 0;
+        worker_close ();
+        return FALSE;
+    }
+    worker_dispatch ();
+    return TRUE;
+}
+
+static void
+worker_gone (GPid pid, gint status, gpointer data)
+{
+    worker_close ();
+    g_spawn_close_pid (pid);
+    worker.pid = 0;
+
+    struct CertCheckData *cert_data = worker.job;
+    if (cert_data != NULL) {
+        worker.job = NULL;
+        if (WIFSIGNALED (status)) {
+            job_done (cert_data, 0, WTERMSIG (status));
+        } else {
+            // It did not answer, so even a clean exit is a failed run
+            int code = WEXITSTATUS (status);
+            job_done (cert_data, code != 0 ? code : 255, 0);
+        }
+    } else {
+        debug ("Worker %d exited", (int) pid);
+    }
+    worker_dispatch ();
+}
+
+static bool
+worker_start ()
+{
+    int fds[2];
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        error ("Unable to create a socket for the worker: %s",
+               strerror (errno));
+        return false;
+    }
+
+    pid_t pid = fork ();
+    if (pid < 0) {
+        error ("fork failed: %s", strerror (errno));
+        close (fds[0]);
+        close (fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // dup () leaves out FD_CLOEXEC, so this end survives the exec
+        char arg[32];
+        snprintf (arg, sizeof (arg), "--serve=%d", dup (fds[1]));
+        setpgid (0, 0);
+        execl (WORKER, WORKER_NAME, arg, NULL);
+        _exit (errno);
+    }
+    close (fds[1]);
+
+    debug ("Started persistent worker %d", (int) pid);
+    worker.pid = pid;
+    worker.fd = fds[0];
+    worker.reply_length = 0;
+    GIOChannel *channel = g_io_channel_unix_new (worker.fd);
+    worker.io_source = g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                       worker_readable, NULL);
+    g_io_channel_unref (channel);
+    g_child_watch_add (pid, worker_gone, NULL);
+    return true;
+}
+
+/* Send the next pending run to the worker, if it is free */
+static void
+worker_dispatch ()
+{
+    while (worker.job == NULL && !g_queue_is_empty (&worker.pending)) {
+        if (worker.pid != 0 && worker.fd == -1) {
+            // retiring, worker_gone () comes back here
+            return;
+        }
+
+        struct CertCheckData *cert_data = g_queue_pop_head (&worker.pending);
+        if (worker.pid == 0 && !worker_start ()) {
+            error ("(%s) Unable to start the worker, retry will occur on next run.",
+                   job_action (cert_data));
+            continue;
+        }
+
+        const char *command = cert_data->heal ? "auto-attach\n" : "cert-check\n";
+        worker.job = cert_data;
+        cert_data->pid = worker.pid;
+        cert_data->last_run = time (NULL);
+        save_state ();
+        start_timeout (cert_data);
+        debug ("(%s) Sent to worker %d", job_action (cert_data),
+               (int) worker.pid);
+        if (send (worker.fd, command, strlen (command), MSG_NOSIGNAL) == -1) {
+            // worker_gone () reports the run as failed
+            warn ("(%s) Unable to reach worker %d: %s", job_action (cert_data),
+                  (int) worker.pid, strerror (errno));
+            kill (-worker.pid, SIGKILL);
+        }
+    }
+}
+
+/*
+ * Start the worker and return to the main loop; worker_exited () reports
+ * how it went. A run that comes due while the previous one of the same
+ * job is still going is folded into it.
+ */
 static gboolean
-cert_check (gboolean heal)
+cert_check (gpointer data)
 {
-    int status = 0;
+    struct CertCheckData *cert_data = data;
+
+    if (cert_data->pid != 0) {
+        info ("(%s) Worker %d is still running, skipping this run.",
+              job_action (cert_data), (int) cert_data->pid);
+        return TRUE;
+    }
+
+    // This run takes the place of a pending retry
+    if (cert_data->retry_source != 0) {
+        g_source_remove (cert_data->retry_source);
+        cert_data->retry_source = 0;
+    }
+
+    if (persistent_worker) {
+        if (g_queue_find (&worker.pending, cert_data) != NULL) {
+            info ("(%s) Already waiting for the worker, skipping this run.",
+                  job_action (cert_data));
+        } else {
+            g_queue_push_tail (&worker.pending, cert_data);
+            worker_dispatch ();
+        }
+        return TRUE;
+    }
 
-    int pid = fork ();
+    pid_t pid = fork ();
     if (pid < 0) {
-        error ("fork failed");
-        exit (EXIT_FAILURE);
+        error ("(%s) fork failed: %s, retry will occur on next run.",
+               job_action (cert_data), strerror (errno));
+        return TRUE;
     }
     if (pid == 0) {
-        if (heal) {
+        setpgid (0, 0);
+        if (cert_data->heal) {
             execl (WORKER, WORKER_NAME, "--autoheal", NULL);
         } else {
             execl (WORKER, WORKER_NAME, NULL);
         }
         _exit (errno);
     }
-    waitpid (pid, &status, 0);
-    status = WEXITSTATUS (status);
 
-    char *action = "Cert Check";
-    if (heal) {
-        action = "Auto-attach";
+    debug ("(%s) Started worker %d", job_action (cert_data), (int) pid);
+    cert_data->pid = pid;
+    cert_data->last_run = time (NULL);
+    save_state ();
+    g_child_watch_add (pid, worker_exited, cert_data);
+    start_timeout (cert_data);
+    //returning FALSE will unregister the timer, always return TRUE
+    return TRUE;
+}
+
+/*
+ * With expiryScheduling the cert check looks at the certificates instead
+ * of starting the worker every interval. The worker only runs when one of
+ * them expires within the margin, or when the check was triggered. The
+ * next look is one interval later, or earlier if that is when the margin
+ * of a certificate starts. Auto-attach, which also updates the
+ * certificates, keeps running on its own interval.
+ */
+static gboolean
+expiry_check (gpointer data)
+{
+    struct CertCheckData *cert_data = data;
+    int delay = cert_data->interval_seconds;
+    bool due = cert_data->triggered;
+    long long not_after;
+
+    if (earliest_expiry (&not_after)) {
+        long long until = not_after - expiry_margin_seconds - time (NULL);
+        if (until <= 0) {
+            due = true;
+        } else if (until < delay) {
+            delay = (int) until;
+        }
     }
 
-    if (status == 0) {
-        info ("(%s) Certificates updated.", action);
+    if (due) {
+        cert_data->triggered = false;
+        cert_check (cert_data);
     } else {
-        warn ("(%s) Update failed (%d), retry will occur on next run.",
-              action, status);
+        info ("(%s) No certificate expires within %d minutes, skipping this run.",
+              job_action (cert_data), expiry_margin_seconds / 60);
     }
-    //returning FALSE will unregister the timer, always return TRUE
-    return TRUE;
+
+    debug ("(%s) Next expiry check in %d seconds", job_action (cert_data),
+           delay);
+    cert_data->timer_source = g_timeout_add_seconds (delay, expiry_check,
+                                                     cert_data);
+    job_scheduled (cert_data, delay);
+    return FALSE;
 }
 
 static gboolean
 initial_cert_check (gpointer data)
 {
     struct CertCheckData *cert_data = data;
-    cert_check (cert_data->heal);
+    if (expiry_scheduling && !cert_data->heal) {
+        // Runs the worker if triggered, which the first check after start
+        // up is unless it resumed an earlier schedule
+        return expiry_check (cert_data);
+    }
+    cert_check (cert_data);
     // Add the timeout to begin waiting on interval but offset by the initial
     // delay.
-    g_timeout_add (cert_data->interval_seconds * 1000,
-        (GSourceFunc) cert_check, (gpointer) cert_data->heal);
-    g_timeout_add (cert_data->interval_seconds * 1000,
+    cert_data->timer_source = g_timeout_add (cert_data->interval_seconds * 1000,
+        (GSourceFunc) cert_check, (gpointer) cert_data);
+    cert_data->log_source = g_timeout_add (cert_data->interval_seconds * 1000,
            (GSourceFunc) log_update_from_cert_data,
            (gpointer) cert_data);
     // Update timestamp
-    log_update(cert_data->interval_seconds, cert_data->next_update_file);
+    job_scheduled (cert_data, cert_data->interval_seconds);
     // Return false so that the timer does
     // not run this again.
     return false;
@@ -392,9 +1173,41 @@ key_file_init_config (Config * config, GKeyFile * key_file)
         config->heal_interval_seconds = heal_frequency * 60;
     }
 
+    // 0 is a valid timeout here, so check for the key first
+    if (g_key_file_has_key (key_file, "rhsmcertd", "workerTimeout", NULL)) {
+        int worker_timeout = get_int_from_config_file (key_file, "rhsmcertd",
+                                   "workerTimeout");
+        if (worker_timeout >= 0) {
+            config->worker_timeout_seconds = worker_timeout * 60;
+        }
+    }
+
     bool splay_enabled = get_bool_from_config_file (key_file, "rhsmcertd",
                             "splay", DEFAULT_SPLAY_ENABLED);
     config->splay = splay_enabled;
+
+    char *splay_mode = g_key_file_get_string (key_file, "rhsmcertd",
+                                              "splayMode", NULL);
+    if (splay_mode != NULL) {
+        g_strstrip (splay_mode);
+        if (!parse_splay_mode (splay_mode, &config->splay_mode)) {
+            warn ("Unknown splayMode %s, ignoring.", splay_mode);
+        }
+        g_free (splay_mode);
+    }
+
+    config->persistent_worker = get_bool_from_config_file (key_file,
+                                    "rhsmcertd", "persistentWorker",
+                                    DEFAULT_PERSISTENT_WORKER);
+
+    config->expiry_scheduling = get_bool_from_config_file (key_file,
+                                    "rhsmcertd", "expiryScheduling",
+                                    DEFAULT_EXPIRY_SCHEDULING);
+    int expiry_margin = get_int_from_config_file (key_file, "rhsmcertd",
+                               "expiryMargin");
+    if (expiry_margin > 0) {
+        config->expiry_margin_seconds = expiry_margin * 60;
+    }
 }
 
 void
@@ -423,14 +1236,37 @@ opt_parse_init_config (Config * config)
         config->heal_interval_seconds = arg_heal_interval_minutes * 60;
     }
 
+    if (arg_worker_timeout_minutes >= 0) {
+        config->worker_timeout_seconds = arg_worker_timeout_minutes * 60;
+    }
+
     if (arg_no_splay) {
         config->splay = FALSE;
     }
+
+    if (arg_splay_mode != NULL &&
+        !parse_splay_mode (arg_splay_mode, &config->splay_mode)) {
+        error ("Invalid splay mode: %s", arg_splay_mode);
+        print_argument_error (N_("Invalid splay mode: %s\n"), arg_splay_mode);
+        exit (EXIT_FAILURE);
+    }
+
+    if (arg_persistent_worker) {
+        config->persistent_worker = true;
+    }
+
+    if (arg_expiry_scheduling) {
+        config->expiry_scheduling = true;
+    }
     // Let the caller know if opt parser found arg values
     // for the intervals.
     return arg_cert_interval_minutes != -1
         || arg_heal_interval_minutes != -1
-        || arg_no_splay != FALSE;
+        || arg_worker_timeout_minutes != -1
+        || arg_no_splay != FALSE
+        || arg_splay_mode != NULL
+        || arg_persistent_worker != FALSE
+        || arg_expiry_scheduling != FALSE;
 }
 
 Config *
@@ -442,7 +1278,12 @@ get_config (int argc, char *argv[])
     // Set the default values
     config->cert_interval_seconds = DEFAULT_CERT_INTERVAL_SECONDS;
     config->heal_interval_seconds = DEFAULT_HEAL_INTERVAL_SECONDS;
+    config->worker_timeout_seconds = DEFAULT_WORKER_TIMEOUT_SECONDS;
     config->splay = DEFAULT_SPLAY_ENABLED;
+    config->splay_mode = DEFAULT_SPLAY_MODE;
+    config->persistent_worker = DEFAULT_PERSISTENT_WORKER;
+    config->expiry_scheduling = DEFAULT_EXPIRY_SCHEDULING;
+    config->expiry_margin_seconds = DEFAULT_EXPIRY_MARGIN_SECONDS;
 
     // Load configuration values from the configuration file
     // which, if defined, will overwrite the current defaults.
@@ -508,6 +1349,226 @@ parse_cli_args (int *argc, char *argv[])
     }
 }
 
+/*
+ * Live reconfiguration and event triggers. rhsm.conf is read again on
+ * SIGHUP or when it changes, and the timers are re-armed with the new
+ * intervals. A new identity certificate (registration) or product
+ * certificate triggers a cert check, and in expiryScheduling mode a
+ * change of the entitlement certificates makes it look at them again.
+ * Events are debounced, and ignored while a worker runs or just after,
+ * as the worker writes to the same directories.
+ */
+static int saved_argc;
+static char **saved_argv;
+
+static struct {
+    int fd;
+    int consumer;               /* watch descriptors */
+    int entitlement;
+    int product;
+    int config;
+    guint check_source;
+    guint reload_source;
+} watch = { -1, -1, -1, -1, -1, 0, 0 };
+
+/* Move the next regular run of a job to its (new) interval */
+static void
+rearm (struct CertCheckData *cert_data)
+{
+    long long delay = cert_data->next_due - time (NULL);
+    if (delay > cert_data->interval_seconds) {
+        delay = cert_data->interval_seconds;
+    }
+    if (delay < 1) {
+        delay = 1;
+    }
+
+    if (cert_data->timer_source != 0) {
+        g_source_remove (cert_data->timer_source);
+    }
+    if (cert_data->log_source != 0) {
+        g_source_remove (cert_data->log_source);
+        cert_data->log_source = 0;
+    }
+    cert_data->timer_source = g_timeout_add_seconds ((guint) delay,
+                                                     initial_cert_check,
+                                                     cert_data);
+    job_scheduled (cert_data, (int) delay);
+}
+
+static void
+reload_config ()
+{
+    size_t i;
+
+    info ("Reloading configuration from %s", RHSM_CONFIG_FILE);
+    Config *config = get_config (saved_argc, saved_argv);
+    jobs[0]->interval_seconds = config->cert_interval_seconds;
+    jobs[1]->interval_seconds = config->heal_interval_seconds;
+    for (i = 0; i < G_N_ELEMENTS (jobs); i++) {
+        jobs[i]->timeout_seconds = config->worker_timeout_seconds;
+    }
+    expiry_scheduling = config->expiry_scheduling;
+    expiry_margin_seconds = config->expiry_margin_seconds;
+    if (config->persistent_worker != persistent_worker) {
+        warn ("persistentWorker changes take effect when rhsmcertd restarts.");
+    }
+    free (config);
+
+    info ("Auto-attach interval: %.1f minutes [%d seconds]",
+          jobs[1]->interval_seconds / 60.0, jobs[1]->interval_seconds);
+    info ("Cert check interval: %.1f minutes [%d seconds]",
+          jobs[0]->interval_seconds / 60.0, jobs[0]->interval_seconds);
+    for (i = 0; i < G_N_ELEMENTS (jobs); i++) {
+        rearm (jobs[i]);
+    }
+}
+
+static gboolean
+reload_on_signal (gpointer data)
+{
+    reload_config ();
+    return TRUE;
+}
+
+static gboolean
+reload_after_change (gpointer data)
+{
+    watch.reload_source = 0;
+    reload_config ();
+    return FALSE;
+}
+
+static gboolean
+check_after_change (gpointer data)
+{
+    struct CertCheckData *cert_data = jobs[0];
+
+    watch.check_source = 0;
+    if (expiry_scheduling) {
+        // Look at the certificates now, this runs the worker if triggered
+        if (cert_data->timer_source != 0) {
+            g_source_remove (cert_data->timer_source);
+            cert_data->timer_source = 0;
+        }
+        expiry_check (cert_data);
+    } else if (cert_data->triggered) {
+        cert_data->triggered = false;
+        cert_check (cert_data);
+    }
+    return FALSE;
+}
+
+/* Start the timer again, so a burst of events ends in one call */
+static void
+debounce (guint *source, GSourceFunc func)
+{
+    if (*source != 0) {
+        g_source_remove (*source);
+    }
+    *source = g_timeout_add_seconds (TRIGGER_DEBOUNCE_SECONDS, func, NULL);
+}
+
+static bool
+worker_recently_ran ()
+{
+    size_t i;
+    for (i = 0; i < G_N_ELEMENTS (jobs); i++) {
+        if (jobs[i]->pid != 0) {
+            return true;
+        }
+    }
+    return time (NULL) - last_run_done < TRIGGER_QUIET_SECONDS;
+}
+
+static gboolean
+watch_readable (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    bool reload = false;
+    bool check = false;
+    bool look = false;
+    char *p;
+
+    ssize_t length = read (watch.fd, buf, sizeof (buf));
+    if (length < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return TRUE;
+    }
+    if (length <= 0) {
+        warn ("Unable to read file change events: %s, no longer watching.",
+              strerror (errno));
+        close (watch.fd);
+        watch.fd = -1;
+        return FALSE;
+    }
+
+    for (p = buf; p < buf + length;
+         p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len) {
+        struct inotify_event *event = (struct inotify_event *) p;
+        if (event->len == 0) {
+            continue;
+        }
+        if (event->wd == watch.config) {
+            reload = reload || strcmp (event->name, RHSM_CONFIG_NAME) == 0;
+        } else if (!g_str_has_suffix (event->name, ".pem")) {
+            continue;
+        } else if (event->wd == watch.entitlement) {
+            look = true;
+        } else if ((event->wd == watch.consumer || event->wd == watch.product) &&
+                   (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+            check = true;
+        }
+    }
+
+    if (reload) {
+        debug ("%s changed", RHSM_CONFIG_FILE);
+        debounce (&watch.reload_source, reload_after_change);
+    }
+    if ((check || look) && worker_recently_ran ()) {
+        debug ("Ignoring certificate changes made while a worker ran");
+    } else if (check || (look && expiry_scheduling)) {
+        if (check) {
+            info ("(%s) New identity or product certificate, checking soon.",
+                  job_action (jobs[0]));
+            jobs[0]->triggered = true;
+        }
+        debounce (&watch.check_source, check_after_change);
+    }
+    return TRUE;
+}
+
+static int
+watch_add (const char *path, uint32_t mask)
+{
+    int wd = inotify_add_watch (watch.fd, path, mask);
+    if (wd == -1) {
+        debug ("Unable to watch %s: %s", path, strerror (errno));
+    }
+    return wd;
+}
+
+static void
+watch_init ()
+{
+    watch.fd = inotify_init1 (IN_CLOEXEC);
+    if (watch.fd == -1) {
+        warn ("Unable to watch for certificate changes: %s", strerror (errno));
+        return;
+    }
+
+    uint32_t added = IN_CLOSE_WRITE | IN_MOVED_TO;
+    watch.consumer = watch_add (CONSUMER_CERT_DIR, added);
+    watch.product = watch_add (PRODUCT_CERT_DIR, added);
+    watch.entitlement = watch_add (ENTITLEMENT_CERT_DIR,
+                                   added | IN_DELETE | IN_MOVED_FROM);
+    watch.config = watch_add (RHSM_CONFIG_DIR, added);
+
+    GIOChannel *channel = g_io_channel_unix_new (watch.fd);
+    g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR, watch_readable,
+                    NULL);
+    g_io_channel_unref (channel);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -525,7 +1586,12 @@ main (int argc, char *argv[])
     // up its resources more reliably in case of error.
     int cert_interval_seconds = config->cert_interval_seconds;
     int heal_interval_seconds = config->heal_interval_seconds;
+    int worker_timeout_seconds = config->worker_timeout_seconds;
     bool splay_enabled = config->splay;
+    SplayMode splay_mode = config->splay_mode;
+    persistent_worker = config->persistent_worker;
+    expiry_scheduling = config->expiry_scheduling;
+    expiry_margin_seconds = config->expiry_margin_seconds;
     free (config);
 
     if (daemon (0, 0) == -1)
@@ -541,6 +1607,19 @@ main (int argc, char *argv[])
           heal_interval_seconds / 60.0, heal_interval_seconds);
     info ("Cert check interval: %.1f minutes [%d seconds]",
           cert_interval_seconds / 60.0, cert_interval_seconds);
+    if (worker_timeout_seconds > 0) {
+        info ("Worker timeout: %.1f minutes [%d seconds]",
+              worker_timeout_seconds / 60.0, worker_timeout_seconds);
+    } else {
+        info ("Worker timeout: disabled");
+    }
+    if (persistent_worker) {
+        info ("Checks run in a persistent worker");
+    }
+    if (expiry_scheduling) {
+        info ("Cert check runs when a certificate expires within %.1f minutes [%d seconds]",
+              expiry_margin_seconds / 60.0, expiry_margin_seconds);
+    }
 
     // note that we call the function directly first, before assigning a timer
     // to it. Otherwise, it would only get executed when the timer went off, and
@@ -551,12 +1630,29 @@ main (int argc, char *argv[])
     // checks are done.
     int auto_attach_initial_delay = 0;
     int cert_check_initial_delay = 0;
+    int auto_attach_offset = 0;
+    int cert_check_offset = 0;
     if (run_now) {
         info ("Initial checks will be run now!");
     } else {
-        int auto_attach_offset = 0;
-        int cert_check_offset = 0;
-        if (splay_enabled == true) {
+        char *uuid = NULL;
+        if (splay_enabled == true && splay_mode == SPLAY_UUID) {
+            uuid = consumer_uuid ();
+            if (uuid == NULL) {
+                warn ("No consumer identity in %s, using a random splay.",
+                      CONSUMER_CERT);
+            }
+        }
+
+        if (uuid != NULL) {
+            time_t now = time (NULL);
+            auto_attach_offset = uuid_splay (uuid, "auto-attach",
+                                             heal_interval_seconds, now);
+            cert_check_offset = uuid_splay (uuid, "cert-check",
+                                            cert_interval_seconds, now);
+            info ("Splay derived from consumer %s", uuid);
+            free (uuid);
+        } else if (splay_enabled == true) {
             unsigned long int seed;
 #ifndef FAKE_RANDOM
             // Grab a seed using the getrandom syscall
@@ -604,26 +1700,53 @@ main (int argc, char *argv[])
                 INITIAL_DELAY_SECONDS / 60.0, cert_check_offset, cert_check_initial_delay);
     }
 
-    struct CertCheckData cert_check_data;
+    log_entitlement_expiry ();
+
+    struct CertCheckData cert_check_data = { 0 };
+    cert_check_data.name = "cert-check";
     cert_check_data.interval_seconds = cert_interval_seconds;
     cert_check_data.heal = false;
     cert_check_data.next_update_file = NEXT_CERT_UPDATE_FILE;
+    cert_check_data.timeout_seconds = worker_timeout_seconds;
 
-    struct CertCheckData auto_attach_data;
+    struct CertCheckData auto_attach_data = { 0 };
+    auto_attach_data.name = "auto-attach";
     auto_attach_data.interval_seconds = heal_interval_seconds;
     auto_attach_data.heal = true;
     auto_attach_data.next_update_file = NEXT_AUTO_ATTACH_UPDATE_FILE;
+    auto_attach_data.timeout_seconds = worker_timeout_seconds;
+
+    // Unless an earlier schedule says otherwise, the first cert check
+    // runs the worker in expiryScheduling mode too
+    cert_check_data.triggered = true;
+    jobs[0] = &cert_check_data;
+    jobs[1] = &auto_attach_data;
+    read_boot_id ();
+
+    GKeyFile *state = run_now ? NULL : load_state ();
+    if (state != NULL) {
+        resume_schedule (state, &cert_check_data, cert_check_offset,
+                         &cert_check_initial_delay);
+        resume_schedule (state, &auto_attach_data, auto_attach_offset,
+                         &auto_attach_initial_delay);
+        g_key_file_free (state);
+    }
 
-    g_timeout_add (cert_check_initial_delay * 1000,
+    cert_check_data.timer_source = g_timeout_add (cert_check_initial_delay * 1000,
                (GSourceFunc) initial_cert_check, (gpointer) &cert_check_data);
-    g_timeout_add (auto_attach_initial_delay * 1000,
+    auto_attach_data.timer_source = g_timeout_add (auto_attach_initial_delay * 1000,
                (GSourceFunc) initial_cert_check, (gpointer) &auto_attach_data);
 
     // NB: we only use cert_interval_seconds when calculating the next update
     // time. This works for most users, since the cert_interval aligns with
     // runs of heal_interval (i.e., heal_interval % cert_interval = 0)
-    log_update (cert_check_initial_delay, NEXT_CERT_UPDATE_FILE);
-    log_update (auto_attach_initial_delay, NEXT_AUTO_ATTACH_UPDATE_FILE);
+    job_scheduled (&cert_check_data, cert_check_initial_delay);
+    job_scheduled (&auto_attach_data, auto_attach_initial_delay);
+
+    saved_argc = argc;
+    saved_argv = argv;
+    g_unix_signal_add (SIGHUP, reload_on_signal, NULL);
+    watch_init ();
 
     GMainLoop *main_loop = g_main_loop_new (NULL, FALSE);
     g_main_loop_run (main_loop);
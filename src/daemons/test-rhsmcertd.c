@@ -0,0 +1,347 @@
+/**
+ * Copyright (c) 2019 Red Hat, Inc.
+ *
+ * This software is licensed to you under the GNU General Public License,
+ * version 2 (GPLv2). There is NO WARRANTY for this software, express or
+ * implied, including the implied warranties of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+ * along with this software; if not, see
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * Red Hat trademarks are not licensed under GPLv2. No permission is
+ * granted to use or replicate Red Hat trademarks that are incorporated
+ * in this software or its documentation.
+ */
+
+/*
+ * Unit tests of the scheduling in rhsmcertd. The daemon is a single file
+ * of static functions, so it is included here with its main () renamed.
+ */
+#define main rhsmcertd_main
+#include "rhsmcertd.c"
+#undef main
+
+#include <glib/gstdio.h>
+
+#define TEST_UUID "2b1f5a3e-6c1d-4a8e-9f2b-0c7d3e4a5b6c"
+#define TEST_INTERVAL 14400
+/* Seconds a test may take between scheduling and checking the delay */
+#define SLACK 5
+
+typedef struct {
+    gchar *dir;
+    struct CertCheckData cert_check;
+    struct CertCheckData auto_attach;
+} stateFixture;
+
+void setup (stateFixture *fixture, gconstpointer testData) {
+    (void) testData;
+    fixture->dir = g_dir_make_tmp ("rhsmcertdTest-XXXXXX", NULL);
+    g_assert_nonnull (fixture->dir);
+    state_file = g_build_filename (fixture->dir, "rhsmcertd.state", NULL);
+    g_strlcpy (boot_id, "test-boot", sizeof (boot_id));
+
+    memset (&fixture->cert_check, 0, sizeof (fixture->cert_check));
+    fixture->cert_check.name = "cert-check";
+    fixture->cert_check.interval_seconds = TEST_INTERVAL;
+    memset (&fixture->auto_attach, 0, sizeof (fixture->auto_attach));
+    fixture->auto_attach.name = "auto-attach";
+    fixture->auto_attach.interval_seconds = 86400;
+    fixture->auto_attach.heal = true;
+    jobs[0] = &fixture->cert_check;
+    jobs[1] = &fixture->auto_attach;
+}
+
+void teardown (stateFixture *fixture, gconstpointer testData) {
+    (void) testData;
+    g_unlink (state_file);
+    g_rmdir (fixture->dir);
+    g_free ((gchar *) state_file);
+    g_free (fixture->dir);
+    state_file = STATE_FILE;
+    jobs[0] = NULL;
+    jobs[1] = NULL;
+}
+
+/* Save the schedule of cert_check, due in due_in seconds */
+static void
+saveDueIn (stateFixture *fixture, long long due_in)
+{
+    fixture->cert_check.last_run = time (NULL) + due_in - TEST_INTERVAL;
+    fixture->cert_check.next_due = time (NULL) + due_in;
+    fixture->cert_check.next_due_boottime = boottime () + due_in;
+    save_state ();
+}
+
+/* The initial delay of cert_check after the saved state was loaded */
+static int
+resumedDelay (stateFixture *fixture, int splay_offset, int delay)
+{
+    GKeyFile *state = load_state ();
+    g_assert_nonnull (state);
+    resume_schedule (state, &fixture->cert_check, splay_offset, &delay);
+    g_key_file_free (state);
+    return delay;
+}
+
+void testSplayHash (void) {
+    /* The same as test/bench/splay_sim.py gives */
+    g_assert_cmpuint (splay_hash (TEST_UUID, "cert-check"), ==,
+                      0xab66e622b0a965bfULL);
+    g_assert_cmpuint (splay_hash (TEST_UUID, "cert-check"), !=,
+                      splay_hash (TEST_UUID, "auto-attach"));
+}
+
+void testUuidSplay (void) {
+    time_t now = 1570000000;
+    g_assert_cmpint (uuid_splay (TEST_UUID, "cert-check", TEST_INTERVAL, now),
+                     ==, 12039);
+    g_assert_cmpint (uuid_splay (TEST_UUID, "auto-attach", 86400, now),
+                     ==, 24431);
+}
+
+void testUuidSplaySlot (void) {
+    /* Whenever the daemon starts, the first run falls on the same slot */
+    int slot = (int) (splay_hash (TEST_UUID, "cert-check") % TEST_INTERVAL);
+    time_t now;
+    for (now = 1570000000; now < 1570000000 + 2 * TEST_INTERVAL; now += 997) {
+        int splay = uuid_splay (TEST_UUID, "cert-check", TEST_INTERVAL, now);
+        g_assert_cmpint (splay, >=, 0);
+        g_assert_cmpint (splay, <, TEST_INTERVAL);
+        g_assert_cmpint ((now + INITIAL_DELAY_SECONDS + splay) % TEST_INTERVAL,
+                         ==, slot);
+    }
+}
+
+void testUuidSplayNoInterval (void) {
+    g_assert_cmpint (uuid_splay (TEST_UUID, "cert-check", 0, 1570000000), ==, 0);
+}
+
+/* The range of retry_delay () over many rolls of the jitter */
+static void
+retryDelayRange (int failures, int interval, int wait_seconds,
+                 long long *min, long long *max)
+{
+    struct CertCheckData cert_data = { 0 };
+    int i;
+
+    cert_data.interval_seconds = interval;
+    cert_data.failures = failures;
+    *min = *max = retry_delay (&cert_data, wait_seconds);
+    for (i = 0; i < 10000; i++) {
+        long long delay = retry_delay (&cert_data, wait_seconds);
+        *min = MIN (*min, delay);
+        *max = MAX (*max, delay);
+    }
+}
+
+void testRetryDelayBackoff (void) {
+    long long min, max;
+
+    retryDelayRange (1, TEST_INTERVAL, 0, &min, &max);
+    g_assert_cmpint (min, >=, 1);
+    g_assert_cmpint (max, <=, RETRY_BASE_SECONDS);
+
+    retryDelayRange (3, TEST_INTERVAL, 0, &min, &max);
+    g_assert_cmpint (min, >=, 1);
+    g_assert_cmpint (max, >, 2 * RETRY_BASE_SECONDS);
+    g_assert_cmpint (max, <=, 4 * RETRY_BASE_SECONDS);
+}
+
+void testRetryDelayCapped (void) {
+    long long min, max;
+
+    retryDelayRange (10, 600, 0, &min, &max);
+    g_assert_cmpint (max, <=, 600);
+
+    /* No overflow of the shift however many runs failed */
+    retryDelayRange (1000, TEST_INTERVAL, 0, &min, &max);
+    g_assert_cmpint (min, >=, 1);
+    g_assert_cmpint (max, <=, TEST_INTERVAL);
+}
+
+void testRetryDelayRateLimited (void) {
+    long long min, max;
+
+    retryDelayRange (1, TEST_INTERVAL, 300, &min, &max);
+    g_assert_cmpint (min, >, 300);
+    g_assert_cmpint (max, <=, 300 + RETRY_BASE_SECONDS);
+
+    retryDelayRange (1, TEST_INTERVAL, 2 * TEST_INTERVAL, &min, &max);
+    g_assert_cmpint (min, ==, TEST_INTERVAL);
+}
+
+void testScheduleRetry (void) {
+    struct CertCheckData cert_data = { 0 };
+    cert_data.interval_seconds = TEST_INTERVAL;
+    cert_data.failures = 1;
+    cert_data.next_due = time (NULL) + TEST_INTERVAL;
+
+    schedule_retry (&cert_data, 0);
+    g_assert_cmpuint (cert_data.retry_source, !=, 0);
+    g_source_remove (cert_data.retry_source);
+}
+
+void testScheduleRetryBeforeNextRun (void) {
+    struct CertCheckData cert_data = { 0 };
+    cert_data.interval_seconds = TEST_INTERVAL;
+    cert_data.failures = 1;
+    cert_data.next_due = time (NULL) + 600;
+
+    /* The server asked to wait past the regular run */
+    schedule_retry (&cert_data, 900);
+    g_assert_cmpuint (cert_data.retry_source, ==, 0);
+}
+
+void testJobDone (void) {
+    struct CertCheckData cert_data = { 0 };
+    cert_data.interval_seconds = TEST_INTERVAL;
+    cert_data.failures = 2;
+    cert_data.pid = 1;
+
+    job_done (&cert_data, 0, 0);
+    g_assert_cmpint (cert_data.pid, ==, 0);
+    g_assert_cmpint (cert_data.failures, ==, 0);
+    g_assert_cmpuint (cert_data.retry_source, ==, 0);
+}
+
+void testJobDoneTimedOut (void) {
+    struct CertCheckData cert_data = { 0 };
+    cert_data.interval_seconds = TEST_INTERVAL;
+    cert_data.next_due = time (NULL) + TEST_INTERVAL;
+
+    /* The worker exited 0 on the SIGTERM of worker_timeout () */
+    cert_data.timed_out = true;
+    job_done (&cert_data, 0, 0);
+    g_assert_false (cert_data.timed_out);
+    g_assert_cmpint (cert_data.failures, ==, 1);
+    g_assert_cmpuint (cert_data.retry_source, !=, 0);
+    g_source_remove (cert_data.retry_source);
+}
+
+void testJobDoneNoRetry (void) {
+    struct CertCheckData cert_data = { 0 };
+    cert_data.interval_seconds = TEST_INTERVAL;
+    cert_data.failures = 2;
+
+    job_done (&cert_data, EXIT_NO_RETRY, 0);
+    g_assert_cmpint (cert_data.failures, ==, 0);
+    g_assert_cmpuint (cert_data.retry_source, ==, 0);
+}
+
+void testLoadMissingState (stateFixture *fixture, gconstpointer ignored) {
+    (void) fixture;
+    (void) ignored;
+    g_assert_null (load_state ());
+}
+
+void testLoadBadState (stateFixture *fixture, gconstpointer ignored) {
+    (void) fixture;
+    (void) ignored;
+    g_assert_true (g_file_set_contents (state_file, "not [a key file", -1, NULL));
+    g_assert_null (load_state ());
+}
+
+void testLoadOtherJob (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    /* Only auto-attach was saved, cert-check keeps its own delay */
+    fixture->auto_attach.next_due = time (NULL) + 1000;
+    save_state ();
+    g_assert_cmpint (resumedDelay (fixture, 0, 4321), ==, 4321);
+}
+
+void testResumeSameBoot (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    saveDueIn (fixture, 3000);
+    int delay = resumedDelay (fixture, 0, 0);
+    g_assert_cmpint (delay, <=, 3000);
+    g_assert_cmpint (delay, >=, 3000 - SLACK);
+}
+
+void testResumeSameBootClockChanged (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    /* The wall clock was set back an hour, boottime goes by */
+    saveDueIn (fixture, 3000);
+    fixture->cert_check.next_due += 3600;
+    save_state ();
+    int delay = resumedDelay (fixture, 0, 0);
+    g_assert_cmpint (delay, <=, 3000);
+    g_assert_cmpint (delay, >=, 3000 - SLACK);
+}
+
+void testResumeOtherBoot (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    saveDueIn (fixture, 3000);
+    fixture->cert_check.next_due_boottime = 0;
+    save_state ();
+    g_strlcpy (boot_id, "next-boot", sizeof (boot_id));
+    int delay = resumedDelay (fixture, 0, 0);
+    g_assert_cmpint (delay, <=, 3000);
+    g_assert_cmpint (delay, >=, 3000 - SLACK);
+}
+
+void testResumeCapped (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    /* Due later than a whole interval away, e.g. the interval got shorter */
+    saveDueIn (fixture, 3 * TEST_INTERVAL);
+    g_assert_cmpint (resumedDelay (fixture, 0, 0), ==, TEST_INTERVAL);
+}
+
+void testResumeOverdue (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    saveDueIn (fixture, -5 * TEST_INTERVAL);
+    /* The splay is scaled down to INITIAL_DELAY_OFFSET_MAX */
+    g_assert_cmpint (resumedDelay (fixture, TEST_INTERVAL / 2, 0), ==,
+                     INITIAL_DELAY_SECONDS + INITIAL_DELAY_OFFSET_MAX / 2);
+}
+
+void testResumeOverdueRecentRun (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    /* A retry ran after the last regular run */
+    saveDueIn (fixture, -600);
+    fixture->cert_check.last_run = time (NULL) - 1000;
+    save_state ();
+    fixture->cert_check.last_run = 0;
+    int delay = resumedDelay (fixture, TEST_INTERVAL / 2, 0);
+    g_assert_cmpint (delay, <=, TEST_INTERVAL - 1000 + SLACK);
+    g_assert_cmpint (delay, >=, TEST_INTERVAL - 1000);
+    g_assert_cmpint (fixture->cert_check.last_run, !=, 0);
+}
+
+void testResumeOverdueLastRunInFuture (stateFixture *fixture, gconstpointer ignored) {
+    (void) ignored;
+    /* The clock went back since, last_run tells nothing */
+    saveDueIn (fixture, -600);
+    fixture->cert_check.last_run = time (NULL) + 1000;
+    save_state ();
+    fixture->cert_check.last_run = 0;
+    g_assert_cmpint (resumedDelay (fixture, 0, 0), ==, INITIAL_DELAY_SECONDS);
+}
+
+int main (int argc, char **argv) {
+    g_test_init (&argc, &argv, NULL);
+    log_path = "/dev/null";
+    g_test_add_func ("/splay/test splay hash", testSplayHash);
+    g_test_add_func ("/splay/test uuid splay", testUuidSplay);
+    g_test_add_func ("/splay/test uuid splay slot", testUuidSplaySlot);
+    g_test_add_func ("/splay/test uuid splay no interval", testUuidSplayNoInterval);
+    g_test_add_func ("/retry/test retry delay backoff", testRetryDelayBackoff);
+    g_test_add_func ("/retry/test retry delay capped", testRetryDelayCapped);
+    g_test_add_func ("/retry/test retry delay rate limited", testRetryDelayRateLimited);
+    g_test_add_func ("/retry/test schedule retry", testScheduleRetry);
+    g_test_add_func ("/retry/test schedule retry before next run", testScheduleRetryBeforeNextRun);
+    g_test_add_func ("/retry/test job done", testJobDone);
+    g_test_add_func ("/retry/test job done timed out", testJobDoneTimedOut);
+    g_test_add_func ("/retry/test job done no retry", testJobDoneNoRetry);
+    g_test_add ("/state/test load missing state", stateFixture, NULL, setup, testLoadMissingState, teardown);
+    g_test_add ("/state/test load bad state", stateFixture, NULL, setup, testLoadBadState, teardown);
+    g_test_add ("/state/test load other job", stateFixture, NULL, setup, testLoadOtherJob, teardown);
+    g_test_add ("/state/test resume same boot", stateFixture, NULL, setup, testResumeSameBoot, teardown);
+    g_test_add ("/state/test resume same boot clock changed", stateFixture, NULL, setup, testResumeSameBootClockChanged, teardown);
+    g_test_add ("/state/test resume other boot", stateFixture, NULL, setup, testResumeOtherBoot, teardown);
+    g_test_add ("/state/test resume capped", stateFixture, NULL, setup, testResumeCapped, teardown);
+    g_test_add ("/state/test resume overdue", stateFixture, NULL, setup, testResumeOverdue, teardown);
+    g_test_add ("/state/test resume overdue recent run", stateFixture, NULL, setup, testResumeOverdueRecentRun, teardown);
+    g_test_add ("/state/test resume overdue last run in future", stateFixture, NULL, setup, testResumeOverdueLastRunInFuture, teardown);
+    return g_test_run ();
+}
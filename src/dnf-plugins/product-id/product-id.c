@@ -16,9 +16,7 @@
 
 #include <glib/gstdio.h>
 
-#include <openssl/pem.h>
-#include <openssl/x509.h>
-#include <openssl/err.h>
+#include <rhsmcert.h>
 
 #include <json-c/json.h>
 
@@ -536,65 +534,23 @@ int installProductId(RepoProductId *repoProductId, ProductDb *productDb) {
  * @return
  */
 int findProductId(GString *certContent, GString *result) {
-    int ret_val = 1;
-    BIO *bio = BIO_new_mem_buf(certContent->str, (int) certContent->len);
-    if (bio == NULL) {
-        debug("Unable to create buffer for content of certificate: %s",
-                ERR_error_string(ERR_get_error(), NULL));
+    rhsm_cert *cert = rhsm_cert_from_pem(certContent->str, certContent->len);
+    if (cert == NULL) {
+        debug("Failed to read content of certificate from buffer");
         return -1;
     }
 
-    X509 *x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL);
-    BIO_free(bio);
-    bio = NULL;
-
-    if (x509 == NULL) {
-        debug("Failed to read content of certificate from buffer to X509 structure: %s",
-                ERR_error_string(ERR_get_error(), NULL));
-        return -1;
-    }
-
-    int exts = X509_get_ext_count(x509);
-    gboolean redhat_oid_found = FALSE;
-    for (int i = 0; i < exts; i++) {
-        char oid[MAX_BUFF];
-        X509_EXTENSION *ext = X509_get_ext(x509, i);
-        if (ext == NULL) {
-            debug("Failed to get extension of X509 structure: %s",
-                  ERR_error_string(ERR_get_error(), NULL));
-            ret_val = -1;
-            break;
-        }
-        OBJ_obj2txt(oid, MAX_BUFF, X509_EXTENSION_get_object(ext), 1);
-
-        if (g_str_has_prefix(oid, REDHAT_PRODUCT_OID)) {
-            redhat_oid_found = TRUE;
-            gchar **components = g_strsplit(oid, ".", -1);
-            int comp_id=0;
-            // Because g_strsplit() returns array of NULL terminated pointers,
-            // then we have to make sure that array is long enough to contain
-            // required ID
-            while(components[comp_id] != NULL) {
-                comp_id++;
-            }
-            if (comp_id > 9) {
-                debug("ID of product certificate: %s", components[9]);
-                g_string_assign(result, components[9]);
-            } else {
-                error("Product certificate does not contain required ID");
-                ret_val = -1;
-            }
-            g_strfreev(components);
-            break;
-        }
-    }
-
-    if (redhat_oid_found == FALSE) {
+    char productId[MAX_BUFF];
+    int ret_val = 1;
+    if (rhsm_cert_product_id(cert, productId, MAX_BUFF) == 0) {
+        debug("ID of product certificate: %s", productId);
+        g_string_assign(result, productId);
+    } else {
         warn("Red Hat Product OID: %s not found", REDHAT_PRODUCT_OID);
         ret_val = -1;
     }
 
-    X509_free(x509);
+    rhsm_cert_free(cert);
 
     return ret_val;
 }
@@ -56,11 +56,26 @@ def create_from_file(path):
     return _CertFactory().create_from_file(path)
 
 
+def create_from_files(paths):
+    from rhsm.certificate2 import _CertFactory  # prevent circular deps
+    return _CertFactory().create_from_files(paths)
+
+
 def create_from_pem(pem):
     from rhsm.certificate2 import _CertFactory  # prevent circular deps
     return _CertFactory().create_from_pem(pem)
 
 
+def create_from_metadata(path, metadata):
+    from rhsm.certificate2 import _CertFactory  # prevent circular deps
+    return _CertFactory().create_from_metadata(path, metadata)
+
+
+def to_metadata(cert):
+    from rhsm.certificate2 import _CertFactory  # prevent circular deps
+    return _CertFactory().to_metadata(cert)
+
+
 def parse_tags(tag_str):
     """
     Split a comma separated list of tags from a certificate into a list.
@@ -90,6 +105,24 @@ def get_datetime_from_x509(date):
     return dateutil.parser.parse(date)
 
 
+def get_datetime_from_epoch(seconds):
+    """
+    Convert UTC epoch seconds, as returned by X509.get_validity(), to an
+    aware datetime. Avoids re-parsing the printed ASN1 time.
+    """
+    return dt(1970, 1, 1, tzinfo=GMT()) + timedelta(seconds=seconds)
+
+
+def get_epoch_from_datetime(date):
+    """
+    Inverse of get_datetime_from_epoch, naive datetimes are taken as UTC.
+    """
+    if date.tzinfo is None:
+        date = date.replace(tzinfo=GMT())
+    delta = date - dt(1970, 1, 1, tzinfo=GMT())
+    return delta.days * 86400 + delta.seconds
+
+
 def deprecated(func):
     """
     A decorator that marks a function as deprecated. This will cause a
@@ -14,7 +14,6 @@ from __future__ import print_function, division, absolute_import
 # granted to use or replicate Red Hat trademarks that are incorporated
 # in this software or its documentation.
 #
-import base64
 import logging
 import os
 import posixpath
@@ -30,8 +29,8 @@ from rhsm import _certificate
 
 from rhsm.connection import safe_int
 from rhsm.certificate import Extensions, OID, DateRange, GMT, \
-        get_datetime_from_x509, parse_tags, CertificateException
-from rhsm.pathtree import PathTree
+        get_datetime_from_epoch, get_epoch_from_datetime, parse_tags, \
+        CertificateException
 from rhsm import ourjson as json
 
 REDHAT_OID_NAMESPACE = "1.3.6.1.4.1.2312.9"
@@ -49,6 +48,13 @@ IDENTITY_CERT = 3
 
 CONTENT_ACCESS_CERT_TYPE = "OrgLevel"
 
+# Layout of the plain data written by _CertFactory.to_metadata, entries
+# with another version are parsed again from the PEM.
+METADATA_VERSION = 1
+
+# Attributes create_from_metadata leaves out, read from the file on first use
+LAZY_ATTRIBUTES = ('x509', 'pem', 'extensions')
+
 
 class _CertFactory(object):
     """
@@ -68,10 +74,30 @@ class _CertFactory(object):
         Create appropriate certificate object from a PEM file on disk.
         """
         try:
-            pem = open(path, 'r').read()
+            sections = _certificate.iter_pem(file=path, compact=True)
         except IOError as err:
             raise CertificateException("Error loading certificate: %s" % err)
-        return self._read_x509(_certificate.load(path), path, pem)
+        x509, payload = self._read_sections(sections)
+        pem = None
+        if payload is not None:
+            # Keep the detached entitlement format to write it back as it
+            # was, see to_pem. The text is from the same mapping of the file.
+            pem = sections.text()
+        return self._read_x509(x509, path, pem, payload)
+
+    def create_from_files(self, paths):
+        """
+        Create certificate objects for many PEM files on disk at once.
+
+        The files are read and decoded in parallel by the native loader,
+        the result is in the same order as paths.
+        """
+        loaded, failed = _certificate.load_many(paths, compact=True)
+        if failed:
+            for path, err in failed:
+                log.error("Error loading certificate: %s: %s" % (path, err))
+            raise CertificateException("Error loading certificate: %s: %s" % failed[0])
+        return [self._read_x509(x509, path, pem) for path, x509, pem in loaded]
 
     def create_from_pem(self, pem, path=None):
         """
@@ -79,9 +105,116 @@ class _CertFactory(object):
         """
         if not pem:
             raise CertificateException("Empty certificate")
-        return self._read_x509(_certificate.load(pem=pem), path, pem)
+        return self._read_pem(pem, path)
 
-    def _read_x509(self, x509, path, pem):
+    def _read_pem(self, pem, path):
+        x509, payload = self._read_sections(
+                _certificate.iter_pem(data=pem, compact=True))
+        return self._read_x509(x509, path, pem, payload)
+
+    def _read_sections(self, sections):
+        """
+        Decode the certificate and the v3 entitlement payload (if any) from
+        the sections of a PEM, in a single native pass over it.
+        """
+        x509 = None
+        payload = None
+        try:
+            for label, value in sections:
+                if label == 'CERTIFICATE' and x509 is None:
+                    x509 = value
+                elif label == 'ENTITLEMENT DATA' and payload is None:
+                    payload = value
+        except ValueError as e:
+            log.exception(e)
+            raise CertificateException("Error decompressing/parsing "
+                    "certificate payload: %s" % e)
+        return x509, payload
+
+    def to_metadata(self, cert):
+        """
+        Describe a certificate as plain data for the metadata index, see
+        create_from_metadata. Returns None for certificates that can't be
+        described that way.
+        """
+        if type(cert) not in (IdentityCertificate, ProductCertificate,
+                EntitlementCertificate):
+            return None
+        metadata = {
+            'metadata_version': METADATA_VERSION,
+            'class': type(cert).__name__,
+            'version': str(cert.version),
+            'start': get_epoch_from_datetime(cert.start),
+            'end': get_epoch_from_datetime(cert.end),
+        }
+        if isinstance(cert, EntitlementCertificate):
+            metadata['entitlement_type'] = cert.entitlement_type
+        try:
+            for name, value in vars(cert).items():
+                if name in _METADATA_FIELDS or name in _METADATA_SKIPPED:
+                    continue
+                metadata[name] = self._to_plain(value)
+        except (TypeError, AttributeError) as e:
+            log.debug("Not indexing certificate %s: %s" % (cert.path, e))
+            return None
+        return metadata
+
+    def create_from_metadata(self, path, metadata):
+        """
+        Rebuild the certificate at path from the output of to_metadata,
+        without reading the file. x509, pem and extensions are loaded
+        from the file when first used. Returns None if metadata was
+        written by another version.
+        """
+        if metadata.get('metadata_version') != METADATA_VERSION:
+            return None
+        cls = _METADATA_CERT_CLASSES[metadata['class']]
+        cert = cls.__new__(cls)
+        for name, value in metadata.items():
+            if name not in _METADATA_FIELDS:
+                cert.__dict__[name] = self._from_plain(value)
+        cert.path = path
+        cert.version = Version(metadata['version'])
+        cert.start = get_datetime_from_epoch(metadata['start'])
+        cert.end = get_datetime_from_epoch(metadata['end'])
+        cert.valid_range = DateRange(cert.start, cert.end)
+        if cls is EntitlementCertificate:
+            cert._path_tree_object = None
+            cert._entitlement_type = metadata['entitlement_type']
+        cert._lazy_path = path
+        return cert
+
+    def _to_plain(self, value):
+        if value is None or isinstance(value, (bool, float) + six.integer_types +
+                six.string_types):
+            return value
+        if isinstance(value, (list, tuple)):
+            return [self._to_plain(item) for item in value]
+        if isinstance(value, dict):
+            return dict((str(key), self._to_plain(item))
+                        for key, item in value.items())
+        if type(value) in (Product, Order, Content, Pool):
+            plain = self._to_plain(vars(value))
+            plain['__class__'] = type(value).__name__
+            return plain
+        raise TypeError("can't index %r" % value)
+
+    def _from_plain(self, value):
+        if isinstance(value, list):
+            return [self._from_plain(item) for item in value]
+        if isinstance(value, dict):
+            fields = dict((key, self._from_plain(item))
+                          for key, item in value.items())
+            if '__class__' not in fields:
+                return fields
+            # Fields were taken from a constructed object, don't validate again
+            cls = _METADATA_CLASSES[fields.pop('__class__')]
+            obj = cls.__new__(cls)
+            obj.__dict__.update(fields)
+            return obj
+        return value
+
+    def _read_x509(self, x509, path, pem, payload=None):
         if not x509:
             if path is not None:
                 raise CertificateException("Error loading certificate: %s" % path)
@@ -91,10 +224,8 @@ class _CertFactory(object):
                 raise CertificateException("Error: none certificate data offered")
         # Load the X509 extensions so we can determine what we're dealing with:
         try:
-            extensions = _Extensions2(x509)
-            redhat_oid = OID(REDHAT_OID_NAMESPACE)
-            # Trim down to only the extensions in the Red Hat namespace:
-            extensions = extensions.branch(redhat_oid)
+            # Only the extensions in the Red Hat namespace, trimmed:
+            extensions = _Extensions2(x509, prefix=REDHAT_OID_NAMESPACE)
             # Check the certificate version, absence of the extension implies v1.0:
             cert_version_str = "1.0"
             if EXT_CERT_VERSION in extensions:
@@ -104,7 +235,8 @@ class _CertFactory(object):
             if version.major == 1:
                 return self._create_v1_cert(version, extensions, x509, path)
             if version.major == 3:
-                return self._create_v3_cert(version, extensions, x509, path, pem)
+                return self._create_v3_cert(version, extensions, x509, path, pem,
+                                            payload)
 
         except CertificateException as e:
             raise e
@@ -133,6 +265,9 @@ class _CertFactory(object):
         else:
             return alt_name.decode('utf-8')
 
+    def _read_validity(self, x509):
+        return [get_datetime_from_epoch(t) for t in x509.get_validity()]
+
     def _read_issuer(self, x509):
         return x509.get_issuer()
 
@@ -140,13 +275,14 @@ class _CertFactory(object):
         return x509.get_subject()
 
     def _create_identity_cert(self, version, extensions, x509, path):
+        start, end = self._read_validity(x509)
         cert = IdentityCertificate(
                 x509=x509,
                 path=path,
                 version=version,
                 serial=x509.get_serial_number(),
-                start=get_datetime_from_x509(x509.get_not_before()),
-                end=get_datetime_from_x509(x509.get_not_after()),
+                start=start,
+                end=end,
                 alt_name=self._read_alt_name(x509),
                 subject=self._read_subject(x509),
                 issuer=self._read_issuer(x509),
@@ -154,14 +290,15 @@ class _CertFactory(object):
         return cert
 
     def _create_v1_prod_cert(self, version, extensions, x509, path):
-        products = self._parse_v1_products(extensions)
+        start, end = self._read_validity(x509)
+        products = self._parse_v1_products(x509.decode_redhat_v1()['products'])
         cert = ProductCertificate(
                 x509=x509,
                 path=path,
                 version=version,
                 serial=x509.get_serial_number(),
-                start=get_datetime_from_x509(x509.get_not_before()),
-                end=get_datetime_from_x509(x509.get_not_after()),
+                start=start,
+                end=end,
                 products=products,
                 subject=self._read_subject(x509),
                 issuer=self._read_issuer(x509),
@@ -169,17 +306,20 @@ class _CertFactory(object):
         return cert
 
     def _create_v1_ent_cert(self, version, extensions, x509, path):
-        order = self._parse_v1_order(extensions)
-        content = self._parse_v1_content(extensions)
-        products = self._parse_v1_products(extensions)
+        start, end = self._read_validity(x509)
+        # Products, order and content are decoded natively in one pass:
+        decoded = x509.decode_redhat_v1()
+        order = self._parse_v1_order(decoded['order'])
+        content = self._parse_v1_content(decoded['content'])
+        products = self._parse_v1_products(decoded['products'])
 
         cert = EntitlementCertificate(
                 x509=x509,
                 path=path,
                 version=version,
                 serial=x509.get_serial_number(),
-                start=get_datetime_from_x509(x509.get_not_before()),
-                end=get_datetime_from_x509(x509.get_not_after()),
+                start=start,
+                end=end,
                 subject=self._read_subject(x509),
                 order=order,
                 content=content,
@@ -189,17 +329,16 @@ class _CertFactory(object):
             )
         return cert
 
-    def _parse_v1_products(self, extensions):
+    def _parse_v1_products(self, decoded_products):
         """
         Returns an ordered list of all the product data in the
         certificate.
+
+        :param decoded_products: the 'products' list of X509.decode_redhat_v1(),
+                                 (product id, {field: value}) tuples
         """
         products = []
-        for prod_namespace in extensions.find('1.*.1'):
-            oid = prod_namespace[0]
-            root = oid.rtrim(1)
-            product_id = oid[1]
-            ext = extensions.branch(root)
+        for product_id, ext in decoded_products:
             product_data = {
                 'name': ext.get('1'),
                 'version': ext.get('2'),
@@ -217,8 +356,10 @@ class _CertFactory(object):
             products.append(Product(id=product_id, **product_data))
         return products
 
-    def _parse_v1_order(self, extensions):
-        order_extensions = extensions.branch(ORDER_NAMESPACE)
+    def _parse_v1_order(self, order_extensions):
+        """
+        :param order_extensions: the 'order' dict of X509.decode_redhat_v1()
+        """
         order_data = {
             'name': order_extensions.get('1'),
             'number': order_extensions.get('2'),
@@ -243,14 +384,15 @@ class _CertFactory(object):
         order = Order(**order_data)
         return order
 
-    def _parse_v1_content(self, extensions):
+    def _parse_v1_content(self, decoded_content):
+        """
+        :param decoded_content: the 'content' list of X509.decode_redhat_v1(),
+                                (content type, {field: value}) tuples
+        """
         content = []
-        ents = extensions.find("2.*.*.1")
-        for ent in ents:
-            oid = ent[0].rtrim(1)
-            content_ext = extensions.branch(oid)
+        for content_type, content_ext in decoded_content:
             content_data = {
-                'content_type': extensions.get(oid),
+                'content_type': content_type,
                 'name': content_ext.get('1'),
                 'label': content_ext.get('2'),
                 'vendor': content_ext.get('5'),
@@ -278,17 +420,14 @@ class _CertFactory(object):
         else:
             return IDENTITY_CERT
 
-    def _create_v3_cert(self, version, extensions, x509, path, pem):
+    def _create_v3_cert(self, version, extensions, x509, path, pem, payload=None):
+        start, end = self._read_validity(x509)
         # At this time, we only support v3 entitlement certificates
-        try:
-            # this is only expected to be available on the client side
-            entitlement_data = pem.split("-----BEGIN ENTITLEMENT DATA-----")[1]
-            entitlement_data = entitlement_data.split("-----END ENTITLEMENT DATA-----")[0].strip()
-        except IndexError:
-            entitlement_data = None
-
-        if entitlement_data:
-            payload = self._decompress_payload(base64.b64decode(entitlement_data))
+        # this is only expected to be available on the client side
+        if payload is None and pem:
+            payload = self._load_payload(pem)
+
+        if payload:
             order = self._parse_v3_order(payload)
             content = self._parse_v3_content(payload)
             products = self._parse_v3_products(payload)
@@ -305,8 +444,8 @@ class _CertFactory(object):
                 version=version,
                 extensions=extensions,
                 serial=x509.get_serial_number(),
-                start=get_datetime_from_x509(x509.get_not_before()),
-                end=get_datetime_from_x509(x509.get_not_after()),
+                start=start,
+                end=end,
                 subject=self._read_subject(x509),
                 order=order,
                 content=content,
@@ -392,6 +531,19 @@ class _CertFactory(object):
             return Pool(id=pool['id'])
         return None
 
+    def _load_payload(self, pem):
+        """
+        Finds the ENTITLEMENT DATA section of the PEM and returns the
+        decoded payload dict, or None if there is no such section. The
+        base64, zlib and JSON decoding all happen natively.
+        """
+        try:
+            return _certificate.load_entitlement(pem=pem)
+        except Exception as e:
+            log.exception(e)
+            raise CertificateException("Error decompressing/parsing "
+                    "certificate payload.")
+
     def _decompress_payload(self, payload):
         """
         Certificate payloads arrive in zlib compressed strings
@@ -428,22 +580,49 @@ class Version(object):
 
 class _Extensions2(Extensions):
 
+    def __init__(self, x509, prefix=None):
+        """
+        :param prefix: only keep the extensions under this oid, with the
+                       prefix trimmed off (same as branch(prefix))
+        """
+        self._x509 = None
+        self._prefix = prefix
+        Extensions.__init__(self, x509)
+
     def _parse(self, x509):
         """
         Override parent method for an X509 object from the new C wrapper.
         """
-        extensions = x509.get_all_extensions()
+        self._x509 = x509
+        extensions = x509.get_extensions(prefix=self._prefix)
         for (key, value) in list(extensions.items()):
             oid = OID(key)
             self[oid] = value
 
+    def find(self, oid, limit=0, ignoreOrder=False):
+        """
+        Same as Extensions.find, but answered by the native extension
+        table of the certificate when there is one.
+        """
+        oid = str(oid)
+        # Patterns anchored at the end can't be rebased onto the prefix
+        if self._x509 is None or oid.startswith('.'):
+            return Extensions.find(self, oid, limit, ignoreOrder)
+        trim = 0
+        if self._prefix is not None:
+            trim = len(OID.split(self._prefix))
+            oid = OID.join(self._prefix, oid)
+        return [(OID(key).ltrim(trim), value)
+                for key, value in self._x509.find_extensions(oid, limit)]
+
 
 class Certificate(object):
     """ Parent class of all x509 certificate types. """
     def __init__(self, x509=None, path=None, version=None, serial=None, start=None,
             end=None, subject=None, pem=None, issuer=None):
 
-        # The rhsm._certificate X509 object for this certificate.
+        # The rhsm._certificate X509 object for this certificate, compact
+        # (without an OpenSSL X509 behind it) when created by _CertFactory.
         # WARNING: May be None in tests
         self.x509 = x509
 
@@ -469,6 +648,26 @@ class Certificate(object):
         self.subject = subject
         self.issuer = issuer
 
+    def __getattr__(self, name):
+        # Only called for missing attributes: certificates rebuilt from the
+        # metadata index read x509, pem and extensions once they are needed.
+        # The file going missing or changing is reported as AttributeError,
+        # as getattr and hasattr expect, caused by the CertificateException.
+        lazy_path = self.__dict__.get('_lazy_path')
+        if name not in LAZY_ATTRIBUTES or lazy_path is None:
+            raise AttributeError(name)
+        try:
+            loaded = _CertFactory().create_from_file(lazy_path)
+            if loaded.serial != self.serial:
+                raise CertificateException("Certificate %s changed on disk" % lazy_path)
+        except CertificateException as e:
+            six.raise_from(AttributeError("%s: %s" % (name, e)), e)
+        for lazy in LAZY_ATTRIBUTES:
+            if lazy in loaded.__dict__:
+                self.__dict__.setdefault(lazy, loaded.__dict__[lazy])
+        del self._lazy_path
+        return self.__dict__[name]
+
     def is_valid(self, on_date=None):
         gmt = datetime.utcnow()
         if on_date:
@@ -504,18 +703,24 @@ class Certificate(object):
     def __hash__(self):
         return self.serial
 
-    def write(self, path):
+    def to_pem(self):
         """
-        Write the certificate to disk.
+        The PEM to write for this certificate.
         """
-        f = open(path, 'w')
         # if we were given the original pem, preserve it
         # ie for certv3 detached format.
         if self.pem is not None:
-            f.write(self.pem)
-        else:
-            f.write(self.x509.as_pem())
-        f.close()
+            return self.pem
+        return self.x509.as_pem()
+
+    def write(self, path):
+        """
+        Write the certificate to disk. The file is replaced atomically,
+        see _certificate.write_files.
+        """
+        directory, name = os.path.split(path)
+        _certificate.write_files(directory or os.curdir,
+                                 [(name, self.to_pem(), 0o666)])
         self.path = path
 
     def delete(self):
@@ -554,9 +759,13 @@ class EntitlementCertificate(ProductCertificate):
         self.pool = pool
         self.extensions = extensions
         self._path_tree_object = None
+        # Known without extensions when rebuilt from the metadata index
+        self._entitlement_type = None
 
     @property
     def entitlement_type(self):
+        if self._entitlement_type is not None:
+            return self._entitlement_type
         if self.extensions.get(EXT_ENT_TYPE):
             return self.extensions.get(EXT_ENT_TYPE).decode('utf-8')
         else:
@@ -566,7 +775,7 @@ class EntitlementCertificate(ProductCertificate):
     def _path_tree(self):
         """
         :return:    PathTree object built from this cert's extensions
-        :rtype:     rhsm.pathtree.PathTree
+        :rtype:     rhsm._certificate.PathTree
 
         :raise: AttributeError if self.version.major < 3
         """
@@ -577,7 +786,7 @@ class EntitlementCertificate(ProductCertificate):
         if not self._path_tree_object:
             # generate and cache the tree
             data = self.extensions[EXT_ENT_PAYLOAD]
-            self._path_tree_object = PathTree(data)
+            self._path_tree_object = _certificate.PathTree(data)
         return self._path_tree_object
 
     def is_expiring(self, on_date=None):
@@ -684,6 +893,41 @@ class EntitlementCertificate(ProductCertificate):
         return key_path
 
 
+class ContentPathIndex(object):
+    """
+    Answers check_path for many entitlement certificates at once.
+
+    The path trees of all v3 certificates are merged into a single native
+    trie, so finding every certificate granting access to a path is one walk
+    rather than one per certificate. v1 certificates carry no path tree and
+    are checked one at a time.
+    """
+    def __init__(self, certs):
+        self._index = _certificate.PathIndex()
+        self._v1_certs = []
+        for cert in certs:
+            if cert.version.major < 3:
+                self._v1_certs.append(cert)
+            elif EXT_ENT_PAYLOAD in cert.extensions:
+                self._index.add(cert, cert._path_tree)
+
+    def match(self, path):
+        """
+        :param path:    path to which access is being requested
+        :type  path:    basestring
+
+        :return:    every certificate whose check_path(path) is True
+        :rtype:     list of EntitlementCertificate
+        """
+        path = posixpath.normpath(path)
+        certs = self._index.match(path)
+        certs.extend(cert for cert in self._v1_certs if cert._check_v1_path(path))
+        return certs
+
+    def match_serials(self, path):
+        return [cert.serial for cert in self.match(path)]
+
+
 class Product(object):
     """
     Represents the product information from a certificate.
@@ -824,3 +1068,15 @@ class Pool(object):
 
     def __eq__(self, other):
         return (self.id == other.id)
+
+
+_METADATA_CERT_CLASSES = dict((cls.__name__, cls) for cls in
+        (IdentityCertificate, ProductCertificate, EntitlementCertificate))
+_METADATA_CLASSES = dict((cls.__name__, cls) for cls in
+        (Product, Order, Content, Pool))
+# Written by to_metadata itself:
+_METADATA_FIELDS = ('metadata_version', 'class', 'version', 'start', 'end',
+        'entitlement_type')
+# Not part of the metadata:
+_METADATA_SKIPPED = LAZY_ATTRIBUTES + ('path', 'valid_range', '_lazy_path',
+        '_path_tree_object', '_entitlement_type')
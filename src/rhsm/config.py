@@ -81,6 +81,13 @@ RHSMCERTD_DEFAULTS = {
         'certcheckinterval': '240',
         'autoattachinterval': '1440',
         'splay': '1',
+        'splaymode': 'random',
+        'workertimeout': '60',
+        'persistentworker': '0',
+        'workermaxjobs': '50',
+        'workermaxmemory': '100',
+        'expiryscheduling': '0',
+        'expirymargin': '60',
         'disable': '0'
         }
 
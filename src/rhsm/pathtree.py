@@ -44,6 +44,10 @@ class PathTree(object):
     3)  Path Tree: This is the tree used to match paths. Each node is a
         dict where keys are path segments (the middle part of /.../) and each
         value is a list of other nodes.
+
+    Certificates use the much faster rhsm._certificate.PathTree, which
+    decodes the same data natively; this class is kept as the reference
+    implementation.
     """
 
     def __init__(self, data):
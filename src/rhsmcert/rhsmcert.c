@@ -0,0 +1,1407 @@
+/*
+ * Copyright (c) 2019 Red Hat, Inc.
+ *
+ * This software is licensed to you under the GNU General Public License,
+ * version 2 (GPLv2). There is NO WARRANTY for this software, express or
+ * implied, including the implied warranties of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+ * along with this software; if not, see
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * Red Hat trademarks are not licensed under GPLv2. No permission is
+ * granted to use or replicate Red Hat trademarks that are incorporated
+ * in this software or its documentation.
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/asn1.h>
+#include <openssl/asn1t.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "rhsmcert.h"
+
+#define MAX_BUF 256
+
+/* OpenSSL pre version 1.1 compatibility defines */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	#define X509_EXTENSION_get_data(o) ((o)->value)
+	#define X509_EXTENSION_get_object(o) ((o)->object)
+	#define ASN1_STRING_get0_data(o) ASN1_STRING_data(o)
+#endif
+
+void
+rhsm_ext_table_free (rhsm_ext *table, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		free (table[i].oid);
+		free (table[i].value);
+	}
+	free (table);
+}
+
+size_t
+rhsm_extension_value (X509_EXTENSION *ext, char **output)
+{
+	int tag;
+	long len;
+	int tc;
+	const unsigned char *p = X509_EXTENSION_get_data(ext)->data;
+
+	ASN1_get_object (&p, &len, &tag, &tc, X509_EXTENSION_get_data(ext)->length);
+
+	size_t size;
+	switch (tag) {
+		case V_ASN1_UTF8STRING:
+			{
+				ASN1_UTF8STRING *str =
+					ASN1_item_unpack (X509_EXTENSION_get_data(ext),
+							  ASN1_ITEM_rptr
+							  (ASN1_UTF8STRING));
+				*output = strndup ((const char *)
+						   ASN1_STRING_get0_data (str),
+						   str->length);
+				size = str->length;
+				ASN1_UTF8STRING_free (str);
+				return size;
+			}
+		case V_ASN1_OCTET_STRING:
+			{
+				ASN1_OCTET_STRING *octstr =
+					ASN1_item_unpack (X509_EXTENSION_get_data(ext),
+							  ASN1_ITEM_rptr
+							  (ASN1_OCTET_STRING));
+				*output = malloc (octstr->length);
+				memcpy (*output, octstr->data, octstr->length);
+				size = octstr->length;
+				ASN1_OCTET_STRING_free (octstr);
+				return size;
+			}
+		default:
+			{
+				BIO *bio = BIO_new (BIO_s_mem ());
+				X509V3_EXT_print (bio, ext, 0, 0);
+
+				size_t size = BIO_ctrl_pending (bio);
+				char *buf = malloc (sizeof (char) * size);
+				BIO_read (bio, buf, size);
+				*output = buf;
+				BIO_free (bio);
+				return size;
+			}
+	}
+}
+
+static int
+compare_ext_entries (const void *a, const void *b)
+{
+	return strcmp (((const rhsm_ext *) a)->oid,
+		       ((const rhsm_ext *) b)->oid);
+}
+
+/* Decode every extension of x509 in certificate order */
+static int
+ext_table_decode (X509 *x509, rhsm_ext **output)
+{
+	int count = X509_get_ext_count (x509);
+	rhsm_ext *table = calloc (count + 1, sizeof (rhsm_ext));
+	if (table == NULL) {
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		X509_EXTENSION *ext = X509_get_ext (x509, i);
+		char oid[MAX_BUF];
+
+		OBJ_obj2txt (oid, MAX_BUF, X509_EXTENSION_get_object (ext), 1);
+		table[i].oid = strdup (oid);
+		if (table[i].oid == NULL) {
+			rhsm_ext_table_free (table, i);
+			return -1;
+		}
+		table[i].length = rhsm_extension_value (ext, &table[i].value);
+	}
+
+	*output = table;
+	return count;
+}
+
+/* Decode every extension of x509, returns the entry count or -1 */
+int
+rhsm_ext_table_build (X509 *x509, rhsm_ext **output)
+{
+	int count = ext_table_decode (x509, output);
+	if (count > 0) {
+		qsort (*output, count, sizeof (rhsm_ext), compare_ext_entries);
+	}
+	return count;
+}
+
+/* ASN1_UTCTIME_print output as a malloc'ed string */
+char *
+rhsm_time_text (ASN1_UTCTIME *time)
+{
+	BIO *bio = BIO_new (BIO_s_mem ());
+	if (bio == NULL) {
+		return NULL;
+	}
+	ASN1_UTCTIME_print (bio, time);
+
+	size_t size = BIO_ctrl_pending (bio);
+	char *buf = malloc (size + 1);
+	if (buf != NULL) {
+		BIO_read (bio, buf, size);
+		buf[size] = '\0';
+	}
+	BIO_free (bio);
+	return buf;
+}
+
+/* Seconds since the epoch of an ASN1 time, in UTC */
+int
+rhsm_asn1_time_to_epoch (const ASN1_TIME *time, long long *seconds)
+{
+	int days;
+	int secs;
+	ASN1_TIME *epoch = ASN1_TIME_set (NULL, 0);
+	int ok = epoch != NULL && ASN1_TIME_diff (&days, &secs, epoch, time);
+	ASN1_TIME_free (epoch);
+	if (!ok) {
+		return -1;
+	}
+	*seconds = (long long) days * 86400 + secs;
+	return 0;
+}
+
+int
+rhsm_x509_validity (X509 *x509, long long *not_before, long long *not_after)
+{
+	if (rhsm_asn1_time_to_epoch (X509_get_notBefore (x509), not_before) < 0 ||
+	    rhsm_asn1_time_to_epoch (X509_get_notAfter (x509), not_after) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compact certificates keep what the tools read, in one block, and drop
+ * the OpenSSL X509 as soon as it is loaded. Anything else decodes the DER
+ * again with rhsm_cert_decode.
+ */
+static char *
+compact_copy (char **p, const void *data, size_t length)
+{
+	char *copy = *p;
+	memcpy (copy, data, length);
+	copy[length] = '\0';
+	*p += length + 1;
+	return copy;
+}
+
+static size_t
+name_size (X509_NAME *name)
+{
+	size_t size = 0;
+	int i;
+	for (i = 0; i < X509_NAME_entry_count (name); i++) {
+		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
+		ASN1_OBJECT *obj = X509_NAME_ENTRY_get_object (entry);
+		ASN1_STRING *data = X509_NAME_ENTRY_get_data (entry);
+		size += 2 * sizeof (char *) +
+			strlen (OBJ_nid2sn (OBJ_obj2nid (obj))) + 1 +
+			strlen ((const char *) ASN1_STRING_get0_data (data)) + 1;
+	}
+	return size;
+}
+
+static void
+name_copy (X509_NAME *name, char **pairs, char **p)
+{
+	int i;
+	for (i = 0; i < X509_NAME_entry_count (name); i++) {
+		X509_NAME_ENTRY *entry = X509_NAME_get_entry (name, i);
+		const char *key =
+			OBJ_nid2sn (OBJ_obj2nid (X509_NAME_ENTRY_get_object (entry)));
+		const char *value = (const char *)
+			ASN1_STRING_get0_data (X509_NAME_ENTRY_get_data (entry));
+		pairs[2 * i] = compact_copy (p, key, strlen (key));
+		pairs[2 * i + 1] = compact_copy (p, value, strlen (value));
+	}
+}
+
+/* Read one DER header, *p is left on the contents */
+static int
+der_header (const unsigned char **p, const unsigned char *end, long *length,
+	    int *tag, int *xclass)
+{
+	if (*p >= end ||
+	    ASN1_get_object (p, length, tag, xclass, end - *p) & 0x80) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The extnValue contents of every extension in a certificate DER, in
+ * certificate order, so that the decoded values can be found in their own
+ * extension instead of searching the whole DER. Returns -1 if the DER is
+ * not laid out as expected, or does not have count extensions.
+ */
+static int
+der_ext_values (const unsigned char *der, long der_length,
+		const unsigned char **values, long *lengths, int count)
+{
+	const unsigned char *p = der;
+	const unsigned char *end = der + der_length;
+	long length;
+	int tag;
+	int xclass;
+
+	/* Certificate, then tbsCertificate */
+	if (der_header (&p, end, &length, &tag, &xclass) < 0) {
+		return -1;
+	}
+	end = p + length;
+	if (der_header (&p, end, &length, &tag, &xclass) < 0) {
+		return -1;
+	}
+	end = p + length;
+
+	/* Skip to extensions [3] */
+	for (;;) {
+		if (der_header (&p, end, &length, &tag, &xclass) < 0) {
+			return count == 0 ? 0 : -1;
+		}
+		if (xclass == V_ASN1_CONTEXT_SPECIFIC && tag == 3) {
+			break;
+		}
+		p += length;
+	}
+
+	if (der_header (&p, end, &length, &tag, &xclass) < 0 ||
+	    tag != V_ASN1_SEQUENCE) {
+		return -1;
+	}
+	end = p + length;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		if (der_header (&p, end, &length, &tag, &xclass) < 0 ||
+		    tag != V_ASN1_SEQUENCE) {
+			return -1;
+		}
+		const unsigned char *ext_end = p + length;
+
+		/* extnID, then critical if present, then extnValue */
+		if (der_header (&p, ext_end, &length, &tag, &xclass) < 0 ||
+		    tag != V_ASN1_OBJECT) {
+			return -1;
+		}
+		p += length;
+		if (der_header (&p, ext_end, &length, &tag, &xclass) < 0) {
+			return -1;
+		}
+		if (tag == V_ASN1_BOOLEAN) {
+			p += length;
+			if (der_header (&p, ext_end, &length, &tag,
+					&xclass) < 0) {
+				return -1;
+			}
+		}
+		if (tag != V_ASN1_OCTET_STRING || p + length != ext_end) {
+			return -1;
+		}
+		values[i] = p;
+		lengths[i] = length;
+		p = ext_end;
+	}
+	return p == end ? 0 : -1;
+}
+
+/*
+ * Where the decoded value of an extension is in its extnValue contents,
+ * that is the contents of the UTF8String or OCTET STRING they hold. NULL
+ * for values that were printed rather than unwrapped.
+ */
+static const unsigned char *
+der_ext_value_find (const unsigned char *contents, long contents_length,
+		    const char *value, size_t length)
+{
+	const unsigned char *p = contents;
+	long inner_length;
+	int tag;
+	int xclass;
+
+	if (der_header (&p, contents + contents_length, &inner_length, &tag,
+			&xclass) == 0 &&
+	    (tag == V_ASN1_UTF8STRING || tag == V_ASN1_OCTET_STRING) &&
+	    (size_t) inner_length == length &&
+	    memcmp (p, value, length) == 0) {
+		return p;
+	}
+	return NULL;
+}
+
+rhsm_cert *
+rhsm_cert_from_x509 (X509 *x509)
+{
+	rhsm_ext *table = NULL;
+	int ext_count = ext_table_decode (x509, &table);
+	if (ext_count < 0) {
+		return NULL;
+	}
+
+	BIGNUM *bn = ASN1_INTEGER_to_BN (X509_get_serialNumber (x509), NULL);
+	char *serial = bn != NULL ? BN_bn2hex (bn) : NULL;
+	BN_free (bn);
+	char *not_before = rhsm_time_text (X509_get_notBefore (x509));
+	char *not_after = rhsm_time_text (X509_get_notAfter (x509));
+	unsigned char *der = NULL;
+	int der_length = i2d_X509 (x509, &der);
+	X509_NAME *subject = X509_get_subject_name (x509);
+	X509_NAME *issuer = X509_get_issuer_name (x509);
+
+	rhsm_cert *compact = NULL;
+	if (serial == NULL || not_before == NULL || not_after == NULL ||
+	    der_length < 0) {
+		goto out;
+	}
+
+	/*
+	 * Extension values found verbatim in their extension (the Red Hat
+	 * ones, including the v3 entitlement payload) point into the DER
+	 * instead of being copied.
+	 */
+	const unsigned char **shared = calloc (ext_count + 1,
+					       sizeof (unsigned char *));
+	const unsigned char **contents = calloc (ext_count + 1,
+						 sizeof (unsigned char *));
+	long *contents_length = calloc (ext_count + 1, sizeof (long));
+	if (shared == NULL || contents == NULL || contents_length == NULL) {
+		goto out_shared;
+	}
+	int found = der_ext_values (der, der_length, contents,
+				    contents_length, ext_count) == 0;
+	size_t size = sizeof (rhsm_cert) + sizeof (rhsm_ext) * ext_count +
+		name_size (subject) + name_size (issuer) + der_length +
+		strlen (serial) + strlen (not_before) + strlen (not_after) + 3;
+	int i;
+	for (i = 0; i < ext_count; i++) {
+		size += strlen (table[i].oid) + 1;
+		if (found && table[i].length > 0) {
+			shared[i] = der_ext_value_find (contents[i],
+							contents_length[i],
+							table[i].value,
+							table[i].length);
+		}
+		if (shared[i] == NULL) {
+			size += table[i].length + 1;
+		}
+	}
+
+	compact = malloc (size);
+	if (compact == NULL) {
+		goto out_shared;
+	}
+
+	char *p = (char *) (compact + 1);
+	compact->ext_table = (rhsm_ext *) p;
+	compact->ext_count = ext_count;
+	p += sizeof (rhsm_ext) * ext_count;
+	compact->subject = (char **) p;
+	compact->subject_count = X509_NAME_entry_count (subject);
+	p += 2 * sizeof (char *) * compact->subject_count;
+	compact->issuer = (char **) p;
+	compact->issuer_count = X509_NAME_entry_count (issuer);
+	p += 2 * sizeof (char *) * compact->issuer_count;
+
+	compact->der = (unsigned char *) p;
+	compact->der_length = der_length;
+	memcpy (p, der, der_length);
+	p += der_length;
+
+	for (i = 0; i < ext_count; i++) {
+		rhsm_ext *entry = &compact->ext_table[i];
+		entry->oid = compact_copy (&p, table[i].oid,
+					   strlen (table[i].oid));
+		entry->length = table[i].length;
+		if (shared[i] != NULL) {
+			entry->value = (char *) compact->der +
+				(shared[i] - der);
+		} else {
+			entry->value = compact_copy (&p, table[i].value,
+						     table[i].length);
+		}
+	}
+	qsort (compact->ext_table, ext_count, sizeof (rhsm_ext),
+	       compare_ext_entries);
+
+	name_copy (subject, compact->subject, &p);
+	name_copy (issuer, compact->issuer, &p);
+	compact->serial = compact_copy (&p, serial, strlen (serial));
+	compact->not_before_text = compact_copy (&p, not_before,
+						 strlen (not_before));
+	compact->not_after_text = compact_copy (&p, not_after,
+						strlen (not_after));
+	compact->validity_ok = rhsm_x509_validity (x509, &compact->not_before,
+						   &compact->not_after) == 0;
+
+out_shared:
+	free (shared);
+	free (contents);
+	free (contents_length);
+out:
+	rhsm_ext_table_free (table, ext_count);
+	OPENSSL_free (serial);
+	free (not_before);
+	free (not_after);
+	OPENSSL_free (der);
+	return compact;
+}
+
+void
+rhsm_cert_free (rhsm_cert *cert)
+{
+	/* Everything is in the one block */
+	free (cert);
+}
+
+/* The first certificate in pem */
+rhsm_cert *
+rhsm_cert_from_pem (const char *pem, size_t length)
+{
+	BIO *bio = BIO_new_mem_buf ((void *) pem, length);
+	if (bio == NULL) {
+		return NULL;
+	}
+	X509 *x509 = PEM_read_bio_X509 (bio, NULL, NULL, NULL);
+	BIO_free (bio);
+	if (x509 == NULL) {
+		ERR_clear_error ();
+		return NULL;
+	}
+
+	rhsm_cert *cert = rhsm_cert_from_x509 (x509);
+	X509_free (x509);
+	return cert;
+}
+
+/*
+ * Map a regular file read only. Empty files give a zero length result
+ * that needs no mapping. *error is an errno value.
+ */
+char *
+rhsm_map_file (const char *path, size_t *length, int *error)
+{
+	static char empty[1];
+
+	*error = 0;
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		*error = errno;
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat (fd, &st) < 0) {
+		*error = errno;
+		close (fd);
+		return NULL;
+	}
+	if (!S_ISREG (st.st_mode)) {
+		*error = S_ISDIR (st.st_mode) ? EISDIR : EINVAL;
+		close (fd);
+		return NULL;
+	}
+	*length = st.st_size;
+	if (st.st_size == 0) {
+		close (fd);
+		return empty;
+	}
+
+	void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		*error = errno;
+		return NULL;
+	}
+	return map;
+}
+
+void
+rhsm_unmap_file (char *map, size_t length)
+{
+	if (map != NULL && length > 0) {
+		munmap (map, length);
+	}
+}
+
+/*
+ * Load the first certificate of a PEM file. The file is decoded straight
+ * from a read only mapping, without copying it. *error is an errno value,
+ * EINVAL if the file holds no certificate.
+ */
+rhsm_cert *
+rhsm_cert_load (const char *path, int *error)
+{
+	size_t length;
+	char *map = rhsm_map_file (path, &length, error);
+	if (map == NULL) {
+		return NULL;
+	}
+
+	rhsm_cert *cert = length > 0 ? rhsm_cert_from_pem (map, length) : NULL;
+	rhsm_unmap_file (map, length);
+	if (cert == NULL) {
+		*error = EINVAL;
+	}
+	return cert;
+}
+
+const rhsm_ext *
+rhsm_cert_find_extension (const rhsm_cert *cert, const char *oid)
+{
+	int low = 0;
+	int high = cert->ext_count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int cmp = strcmp (cert->ext_table[mid].oid, oid);
+		if (cmp == 0) {
+			return &cert->ext_table[mid];
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Product certificates describe their products under
+ * RHSM_OID_PRODUCT <id>.<field>. Returns -1 if there is none or the id
+ * doesn't fit in size.
+ */
+int
+rhsm_cert_product_id (const rhsm_cert *cert, char *id, size_t size)
+{
+	size_t prefix_length = strlen (RHSM_OID_PRODUCT);
+	int low = 0;
+	int high = cert->ext_count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (strcmp (cert->ext_table[mid].oid, RHSM_OID_PRODUCT) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	/* The sorted table puts the matches right after the prefix */
+	for (; low < cert->ext_count; low++) {
+		const char *oid = cert->ext_table[low].oid;
+		if (strncmp (oid, RHSM_OID_PRODUCT, prefix_length) != 0) {
+			break;
+		}
+		const char *start = oid + prefix_length;
+		const char *end = strchr (start, '.');
+		if (end == NULL || end == start) {
+			continue;
+		}
+		if ((size_t) (end - start) >= size) {
+			return -1;
+		}
+		memcpy (id, start, end - start);
+		id[end - start] = '\0';
+		return 0;
+	}
+	return -1;
+}
+
+/* Decode the DER of a compact certificate again, for the rarely used calls */
+X509 *
+rhsm_cert_decode (const rhsm_cert *compact)
+{
+	const unsigned char *p = compact->der;
+	return d2i_X509 (NULL, &p, compact->der_length);
+}
+
+char *
+rhsm_read_file (const char *path, size_t *length, int *error)
+{
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		*error = errno;
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat (fd, &st) < 0) {
+		*error = errno;
+		close (fd);
+		return NULL;
+	}
+	if (!S_ISREG (st.st_mode)) {
+		*error = S_ISDIR (st.st_mode) ? EISDIR : EINVAL;
+		close (fd);
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	char *buf = malloc (size + 1);
+	if (buf == NULL) {
+		*error = ENOMEM;
+		close (fd);
+		return NULL;
+	}
+
+	size_t total = 0;
+	while (total < size) {
+		ssize_t n = read (fd, buf + total, size - total);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			*error = errno;
+			free (buf);
+			close (fd);
+			return NULL;
+		}
+		if (n == 0) {
+			break;
+		}
+		total += n;
+	}
+	close (fd);
+
+	buf[total] = '\0';
+	*length = total;
+	return buf;
+}
+
+static int
+has_suffix (const char *name, const char *suffix)
+{
+	size_t name_len = strlen (name);
+	size_t suffix_len = strlen (suffix);
+	return name_len >= suffix_len &&
+		strcmp (name + name_len - suffix_len, suffix) == 0;
+}
+
+static int
+compare_paths (const void *a, const void *b)
+{
+	return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+void
+rhsm_dir_list_free (char **paths, size_t count)
+{
+	size_t i;
+	for (i = 0; paths != NULL && i < count; i++) {
+		free (paths[i]);
+	}
+	free (paths);
+}
+
+/*
+ * The files in dir_name ending in suffix but not exclude, sorted.
+ * Sub-directories are skipped. Returns NULL with errno set on failure.
+ */
+char **
+rhsm_dir_list (const char *dir_name, const char *suffix, const char *exclude,
+	       size_t *count)
+{
+	DIR *dir = opendir (dir_name);
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	*count = 0;
+	size_t allocated = 64;
+	char **paths = malloc (sizeof (char *) * allocated);
+	struct dirent *entry;
+	while (paths != NULL && (entry = readdir (dir)) != NULL) {
+		if (!has_suffix (entry->d_name, suffix) ||
+		    (exclude != NULL && has_suffix (entry->d_name, exclude))) {
+			continue;
+		}
+
+		if (*count == allocated) {
+			char **grown = realloc (paths, sizeof (char *) *
+						allocated * 2);
+			if (grown == NULL) {
+				rhsm_dir_list_free (paths, *count);
+				paths = NULL;
+				break;
+			}
+			paths = grown;
+			allocated *= 2;
+		}
+
+		size_t path_len = strlen (dir_name) + strlen (entry->d_name) + 2;
+		char *path = malloc (path_len);
+		if (path == NULL) {
+			rhsm_dir_list_free (paths, *count);
+			paths = NULL;
+			break;
+		}
+		snprintf (path, path_len, "%s/%s", dir_name, entry->d_name);
+
+		struct stat st;
+		if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+		    stat (path, &st) == 0 && S_ISDIR (st.st_mode))) {
+			free (path);
+			continue;
+		}
+		paths[(*count)++] = path;
+	}
+	closedir (dir);
+
+	if (paths == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* readdir order is arbitrary, keep the listing stable */
+	qsort (paths, *count, sizeof (char *), compare_paths);
+	return paths;
+}
+
+/*
+ * The earliest notAfter of the certificates in a directory, for callers
+ * that only need to know when something will expire. Unreadable files are
+ * skipped. Returns the number of certificates seen, or -1 with errno set
+ * if the directory can't be read.
+ */
+int
+rhsm_dir_earliest_expiry (const char *dir_name, const char *suffix,
+			  const char *exclude, long long *not_after)
+{
+	size_t count;
+	char **paths = rhsm_dir_list (dir_name, suffix, exclude, &count);
+	if (paths == NULL) {
+		return -1;
+	}
+
+	int seen = 0;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		int error;
+		rhsm_cert *cert = rhsm_cert_load (paths[i], &error);
+		if (cert == NULL) {
+			continue;
+		}
+		if (cert->validity_ok) {
+			if (seen == 0 || cert->not_after < *not_after) {
+				*not_after = cert->not_after;
+			}
+			seen++;
+		}
+		rhsm_cert_free (cert);
+	}
+	rhsm_dir_list_free (paths, count);
+	return seen;
+}
+
+/*
+ * A trust store of every certificate in the files of dir_name ending in
+ * suffix (a file may hold several). Files without certificates are
+ * skipped. Returns NULL with errno set if the directory can't be read,
+ * *count is the number of certificates added.
+ */
+X509_STORE *
+rhsm_store_from_dir (const char *dir_name, const char *suffix, int *count)
+{
+	size_t path_count;
+	char **paths = rhsm_dir_list (dir_name, suffix, NULL, &path_count);
+	if (paths == NULL) {
+		return NULL;
+	}
+
+	X509_STORE *store = X509_STORE_new ();
+	if (store == NULL) {
+		rhsm_dir_list_free (paths, path_count);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	*count = 0;
+	size_t i;
+	for (i = 0; i < path_count; i++) {
+		size_t length;
+		int error;
+		char *map = rhsm_map_file (paths[i], &length, &error);
+		if (map == NULL) {
+			continue;
+		}
+
+		BIO *bio = BIO_new_mem_buf (map, length);
+		X509 *x509;
+		while (bio != NULL &&
+		       (x509 = PEM_read_bio_X509 (bio, NULL, NULL, NULL)) != NULL) {
+			if (X509_STORE_add_cert (store, x509)) {
+				(*count)++;
+			}
+			X509_free (x509);
+		}
+		BIO_free (bio);
+		rhsm_unmap_file (map, length);
+		/* Reading stops with an error at the end of each file */
+		ERR_clear_error ();
+	}
+
+	rhsm_dir_list_free (paths, path_count);
+	return store;
+}
+
+/*
+ * Verify the chain of x509 against store, as of the given epoch time, or
+ * now if at is negative. Returns an X509_V_ code, X509_V_OK if it
+ * verifies. The store can be shared by threads verifying at once.
+ */
+int
+rhsm_verify (X509_STORE *store, X509 *x509, long long at)
+{
+	X509_STORE_CTX *ctx = X509_STORE_CTX_new ();
+	if (ctx == NULL) {
+		return X509_V_ERR_OUT_OF_MEM;
+	}
+
+	int result = X509_V_ERR_OUT_OF_MEM;
+	if (X509_STORE_CTX_init (ctx, store, x509, NULL)) {
+		if (at >= 0) {
+			X509_STORE_CTX_set_time (ctx, 0, (time_t) at);
+		}
+		if (X509_verify_cert (ctx) == 1) {
+			result = X509_V_OK;
+		} else {
+			result = X509_STORE_CTX_get_error (ctx);
+			if (result == X509_V_OK) {
+				result = X509_V_ERR_UNSPECIFIED;
+			}
+		}
+	}
+	X509_STORE_CTX_free (ctx);
+	ERR_clear_error ();
+	return result;
+}
+
+/*
+ * Check that the private key at key_path belongs to the certificate at
+ * cert_path. Returns one of the RHSM_KEY_ states.
+ */
+int
+rhsm_key_pair_check (const char *cert_path, const char *key_path)
+{
+	size_t length;
+	int error;
+	char *map = rhsm_map_file (key_path, &length, &error);
+	if (map == NULL) {
+		return error == ENOENT || error == EACCES ? RHSM_KEY_MISSING :
+			RHSM_KEY_INVALID;
+	}
+	BIO *bio = BIO_new_mem_buf (map, length);
+	EVP_PKEY *key = bio != NULL ?
+		PEM_read_bio_PrivateKey (bio, NULL, NULL, NULL) : NULL;
+	BIO_free (bio);
+	rhsm_unmap_file (map, length);
+	if (key == NULL) {
+		ERR_clear_error ();
+		return RHSM_KEY_INVALID;
+	}
+
+	X509 *x509 = NULL;
+	map = rhsm_map_file (cert_path, &length, &error);
+	if (map != NULL) {
+		bio = BIO_new_mem_buf (map, length);
+		x509 = bio != NULL ?
+			PEM_read_bio_X509 (bio, NULL, NULL, NULL) : NULL;
+		BIO_free (bio);
+		rhsm_unmap_file (map, length);
+	}
+
+	int result = RHSM_KEY_CERT_INVALID;
+	if (x509 != NULL) {
+		result = X509_check_private_key (x509, key) == 1 ? RHSM_KEY_OK :
+			RHSM_KEY_MISMATCH;
+	}
+	X509_free (x509);
+	EVP_PKEY_free (key);
+	ERR_clear_error ();
+	return result;
+}
+
+/*
+ * Persistent certificate metadata index.
+ *
+ * Parsing every PEM under /etc/pki on each run is most of the startup cost
+ * of the tools, while the certificates themselves rarely change. The index
+ * file maps each certificate path, together with the (inode, mtime, size)
+ * it had when parsed, to a JSON blob of its metadata (written by
+ * rhsm.certificate2). It is mmap'ed and looked up in place, so only
+ * certificates that changed since the index was written need to be parsed
+ * again.
+ *
+ * Layout, native byte order (the file never leaves the host):
+ *   rhsm_index_header
+ *   rhsm_index_record[count], sorted by path
+ *   NUL terminated paths and the JSON blobs the records point at
+ */
+#define RHSM_INDEX_MAGIC "RHSMIDX"
+#define RHSM_INDEX_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t length;
+} rhsm_index_header;
+
+int
+rhsm_index_key_stat (const char *path, rhsm_index_key *key)
+{
+	struct stat st;
+	if (stat (path, &st) < 0 || !S_ISREG (st.st_mode)) {
+		return -1;
+	}
+	key->inode = st.st_ino;
+	key->mtime = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->size = st.st_size;
+	return 0;
+}
+
+int
+rhsm_index_key_matches (rhsm_index_record *record, rhsm_index_key *key)
+{
+	return record->inode == key->inode && record->mtime == key->mtime &&
+		record->mtime_nsec == key->mtime_nsec &&
+		record->size == key->size;
+}
+
+void
+rhsm_index_close (rhsm_index *index)
+{
+	if (index->map != NULL) {
+		munmap (index->map, index->length);
+	}
+	memset (index, 0, sizeof (rhsm_index));
+}
+
+/*
+ * Map an index file, checking every record stays inside it. A missing or
+ * malformed index is treated as empty. The mapping is private and
+ * writable so JSON strings can be unescaped in place.
+ */
+void
+rhsm_index_open (const char *path, rhsm_index *index)
+{
+	memset (index, 0, sizeof (rhsm_index));
+
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	/* Only trust an index written by root or by ourselves */
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid ()) ||
+	    (size_t) st.st_size < sizeof (rhsm_index_header)) {
+		close (fd);
+		return;
+	}
+
+	char *map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+	index->map = map;
+	index->length = st.st_size;
+
+	rhsm_index_header *header = (rhsm_index_header *) map;
+	if (memcmp (header->magic, RHSM_INDEX_MAGIC,
+		    sizeof (RHSM_INDEX_MAGIC)) != 0 ||
+	    header->version != RHSM_INDEX_VERSION ||
+	    header->length != (uint64_t) st.st_size ||
+	    header->count > (st.st_size - sizeof (rhsm_index_header)) /
+	    sizeof (rhsm_index_record)) {
+		rhsm_index_close (index);
+		return;
+	}
+
+	rhsm_index_record *records =
+		(rhsm_index_record *) (map + sizeof (rhsm_index_header));
+	uint32_t i;
+	for (i = 0; i < header->count; i++) {
+		rhsm_index_record *record = &records[i];
+		if (record->path_offset >= index->length ||
+		    record->path_length >= index->length - record->path_offset ||
+		    map[record->path_offset + record->path_length] != '\0' ||
+		    record->data_offset > index->length ||
+		    record->data_length > index->length - record->data_offset) {
+			rhsm_index_close (index);
+			return;
+		}
+	}
+
+	index->records = records;
+	index->count = header->count;
+}
+
+rhsm_index_record *
+rhsm_index_find (rhsm_index *index, const char *path)
+{
+	uint32_t low = 0;
+	uint32_t high = index->count;
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		int cmp = strcmp (index->map + index->records[mid].path_offset,
+				  path);
+		if (cmp == 0) {
+			return &index->records[mid];
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return NULL;
+}
+
+static int
+compare_index_entries (const void *a, const void *b)
+{
+	return strcmp (((const rhsm_index_entry *) a)->path,
+		       ((const rhsm_index_entry *) b)->path);
+}
+
+static int
+write_all (int fd, const void *data, size_t length)
+{
+	const char *p = data;
+	while (length > 0) {
+		ssize_t n = write (fd, p, length);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * Sort entries by path, write them to a temporary file next to path and
+ * rename it over.
+ */
+int
+rhsm_index_write (const char *path, rhsm_index_entry *entries, size_t count)
+{
+	qsort (entries, count, sizeof (rhsm_index_entry), compare_index_entries);
+
+	size_t path_len = strlen (path);
+	char *tmp_path = malloc (path_len + 32);
+	if (tmp_path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf (tmp_path, path_len + 32, "%s.%d.tmp", path, (int) getpid ());
+
+	rhsm_index_record *records = calloc (count + 1, sizeof (rhsm_index_record));
+	if (records == NULL) {
+		free (tmp_path);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	uint64_t offset = sizeof (rhsm_index_header) +
+		sizeof (rhsm_index_record) * count;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		records[i].inode = entries[i].key.inode;
+		records[i].mtime = entries[i].key.mtime;
+		records[i].mtime_nsec = entries[i].key.mtime_nsec;
+		records[i].size = entries[i].key.size;
+		records[i].path_offset = offset;
+		records[i].path_length = strlen (entries[i].path);
+		offset += records[i].path_length + 1;
+		records[i].data_offset = offset;
+		records[i].data_length = entries[i].length;
+		offset += entries[i].length;
+	}
+
+	rhsm_index_header header;
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, RHSM_INDEX_MAGIC, sizeof (RHSM_INDEX_MAGIC));
+	header.version = RHSM_INDEX_VERSION;
+	header.count = count;
+	header.length = offset;
+
+	int fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int result = fd < 0 ? -1 : 0;
+	if (result == 0) {
+		result = write_all (fd, &header, sizeof (header));
+	}
+	if (result == 0) {
+		result = write_all (fd, records, sizeof (rhsm_index_record) * count);
+	}
+	for (i = 0; result == 0 && i < count; i++) {
+		result = write_all (fd, entries[i].path,
+				    records[i].path_length + 1);
+		if (result == 0) {
+			result = write_all (fd, entries[i].data,
+					    entries[i].length);
+		}
+	}
+	if (result == 0) {
+		result = fsync (fd);
+	}
+	if (fd >= 0 && close (fd) < 0) {
+		result = -1;
+	}
+	if (result == 0) {
+		result = rename (tmp_path, path);
+	}
+	if (result < 0) {
+		int error = errno;
+		unlink (tmp_path);
+		errno = error;
+	}
+
+	free (records);
+	free (tmp_path);
+	return result;
+}
+
+#define STAGING_PREFIX ".staging-"
+
+/*
+ * Remove the directory name in parent_fd with everything in it, down to
+ * depth levels of subdirectories.
+ */
+static int
+remove_dir_at (int parent_fd, const char *name, int depth)
+{
+	int fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		return -1;
+	}
+	DIR *dir = fdopendir (fd);
+	if (dir == NULL) {
+		close (fd);
+		return -1;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir (dir)) != NULL) {
+		if (strcmp (entry->d_name, ".") == 0 ||
+		    strcmp (entry->d_name, "..") == 0) {
+			continue;
+		}
+		if (unlinkat (fd, entry->d_name, 0) < 0 &&
+		    (errno == EISDIR || errno == EPERM) && depth > 0) {
+			remove_dir_at (fd, entry->d_name, depth - 1);
+		}
+	}
+	closedir (dir);
+	return unlinkat (parent_fd, name, AT_REMOVEDIR);
+}
+
+/*
+ * Remove the staging directories a rhsm_write_files that died left in
+ * dir_fd. A live one holds a lock on its staging directory.
+ */
+static void
+remove_stale_stages (int dir_fd)
+{
+	int fd = dup (dir_fd);
+	if (fd < 0) {
+		return;
+	}
+	DIR *dir = fdopendir (fd);
+	if (dir == NULL) {
+		close (fd);
+		return;
+	}
+	/* fdopendir shares the offset with dir_fd, start from the top */
+	rewinddir (dir);
+
+	struct dirent *entry;
+	while ((entry = readdir (dir)) != NULL) {
+		if (strncmp (entry->d_name, STAGING_PREFIX,
+			     strlen (STAGING_PREFIX)) != 0) {
+			continue;
+		}
+		int stage_fd = openat (dir_fd, entry->d_name,
+				       O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (stage_fd < 0) {
+			continue;
+		}
+		if (flock (stage_fd, LOCK_EX | LOCK_NB) == 0) {
+			remove_dir_at (dir_fd, entry->d_name, 1);
+		}
+		close (stage_fd);
+	}
+	closedir (dir);
+}
+
+/*
+ * Group commit: write a batch of files into dir_name so that the
+ * directory only ever holds complete files.
+ *
+ * Every file is written and synced in a fresh hidden staging directory
+ * inside dir_name (so on the same filesystem), then renamed into dir_name
+ * in the order given, keeping a hard link to the file it replaces, and
+ * dir_name is synced once. If anything fails, the files renamed so far
+ * are put back the way they were, so either the whole batch is installed
+ * or none of it. Only a process dying during the renames can leave part
+ * of a batch installed; the staging directory it leaves behind is removed
+ * by the next call. Names must not contain '/'.
+ */
+int
+rhsm_write_files (const char *dir_name, const rhsm_file *files, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const char *name = files[i].name;
+		if (name[0] == '\0' || strchr (name, '/') != NULL ||
+		    strcmp (name, ".") == 0 || strcmp (name, "..") == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	size_t dir_len = strlen (dir_name);
+	char *stage = malloc (dir_len + 32);
+	char *replaced = calloc (count + 1, 1);
+	if (stage == NULL || replaced == NULL) {
+		free (stage);
+		free (replaced);
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf (stage, dir_len + 32, "%s/" STAGING_PREFIX "XXXXXX", dir_name);
+
+	int dir_fd = open (dir_name, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		remove_stale_stages (dir_fd);
+	}
+	if (dir_fd < 0 || mkdtemp (stage) == NULL) {
+		int error = errno;
+		if (dir_fd >= 0) {
+			close (dir_fd);
+		}
+		free (stage);
+		free (replaced);
+		errno = error;
+		return -1;
+	}
+
+	/* The new files go to stage/new, the ones they replace to stage/old */
+	int stage_fd = open (stage, O_RDONLY | O_DIRECTORY);
+	int new_fd = -1;
+	int old_fd = -1;
+	int result = stage_fd < 0 ? -1 : flock (stage_fd, LOCK_EX);
+	if (result == 0) {
+		result = mkdirat (stage_fd, "new", 0700);
+	}
+	if (result == 0) {
+		result = mkdirat (stage_fd, "old", 0700);
+	}
+	if (result == 0) {
+		new_fd = openat (stage_fd, "new", O_RDONLY | O_DIRECTORY);
+		old_fd = openat (stage_fd, "old", O_RDONLY | O_DIRECTORY);
+		if (new_fd < 0 || old_fd < 0) {
+			result = -1;
+		}
+	}
+
+	for (i = 0; result == 0 && i < count; i++) {
+		int fd = openat (new_fd, files[i].name,
+				 O_WRONLY | O_CREAT | O_EXCL, files[i].mode);
+		if (fd < 0) {
+			result = -1;
+			break;
+		}
+		result = write_all (fd, files[i].data, files[i].length);
+		if (result == 0) {
+			result = fsync (fd);
+		}
+		if (close (fd) < 0) {
+			result = -1;
+		}
+	}
+
+	size_t renamed = 0;
+	for (i = 0; result == 0 && i < count; i++) {
+		result = linkat (dir_fd, files[i].name, old_fd, files[i].name, 0);
+		if (result == 0) {
+			replaced[i] = 1;
+		} else if (errno == ENOENT) {
+			result = 0;
+		}
+		if (result == 0) {
+			result = renameat (new_fd, files[i].name, dir_fd,
+					   files[i].name);
+		}
+		if (result == 0) {
+			renamed = i + 1;
+		}
+	}
+	if (result == 0) {
+		result = fsync (dir_fd);
+	}
+
+	int error = errno;
+	if (result < 0 && renamed > 0) {
+		/* Put back what was there before, latest first */
+		for (i = renamed; i-- > 0;) {
+			if (replaced[i]) {
+				renameat (old_fd, files[i].name, dir_fd,
+					  files[i].name);
+			} else {
+				unlinkat (dir_fd, files[i].name, 0);
+			}
+		}
+		fsync (dir_fd);
+	}
+
+	if (new_fd >= 0) {
+		close (new_fd);
+	}
+	if (old_fd >= 0) {
+		close (old_fd);
+	}
+	if (stage_fd >= 0) {
+		close (stage_fd);
+	}
+	remove_dir_at (dir_fd, stage + dir_len + 1, 1);
+	close (dir_fd);
+	free (stage);
+	free (replaced);
+	errno = error;
+	return result;
+}
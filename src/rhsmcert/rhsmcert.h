@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2019 Red Hat, Inc.
+ *
+ * This software is licensed to you under the GNU General Public License,
+ * version 2 (GPLv2). There is NO WARRANTY for this software, express or
+ * implied, including the implied warranties of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+ * along with this software; if not, see
+ * http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * Red Hat trademarks are not licensed under GPLv2. No permission is
+ * granted to use or replicate Red Hat trademarks that are incorporated
+ * in this software or its documentation.
+ */
+
+/*
+ * librhsmcert: certificate handling shared by the C parts of
+ * subscription-manager (the rhsm._certificate python module, the libdnf
+ * product-id plugin and rhsmcertd). It only depends on OpenSSL.
+ *
+ * Functions returning int return 0 (or a count) on success and -1 on
+ * failure, with errno set where noted.
+ */
+#ifndef RHSMCERT_H
+#define RHSMCERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/asn1.h>
+#include <openssl/x509.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RHSM_OID_NAMESPACE "1.3.6.1.4.1.2312.9."
+#define RHSM_OID_PRODUCT RHSM_OID_NAMESPACE "1."
+
+/*
+ * A decoded extension. UTF8String and OCTET STRING values are unwrapped,
+ * anything else is what openssl x509 -text prints for it. value is the
+ * length bytes, it is not NUL-terminated: in a compact certificate it may
+ * point into the DER.
+ */
+typedef struct {
+	char *oid;
+	char *value;
+	size_t length;
+} rhsm_ext;
+
+/*
+ * A compact certificate: what the tools read from a certificate, in one
+ * allocation, without the OpenSSL X509 (many small allocations, several
+ * times the size of the DER). The extension table is sorted by oid.
+ */
+typedef struct {
+	rhsm_ext *ext_table;
+	int ext_count;
+	char *serial;		/* hex */
+	char *not_before_text;
+	char *not_after_text;
+	long long not_before;	/* UTC epoch seconds */
+	long long not_after;
+	int validity_ok;	/* 0 if the dates could not be converted */
+	char **subject;		/* alternating short name and value */
+	int subject_count;
+	char **issuer;
+	int issuer_count;
+	unsigned char *der;
+	size_t der_length;
+} rhsm_cert;
+
+/* Compact certificates, free with rhsm_cert_free */
+rhsm_cert *rhsm_cert_from_x509 (X509 *x509);
+rhsm_cert *rhsm_cert_from_pem (const char *pem, size_t length);
+rhsm_cert *rhsm_cert_load (const char *path, int *error);
+void rhsm_cert_free (rhsm_cert *cert);
+
+/* Decode the DER of a compact certificate again, free with X509_free */
+X509 *rhsm_cert_decode (const rhsm_cert *cert);
+
+/* The extension with exactly this dotted oid, or NULL */
+const rhsm_ext *rhsm_cert_find_extension (const rhsm_cert *cert,
+					  const char *oid);
+
+/* Copy the id of the first product in a product certificate to id */
+int rhsm_cert_product_id (const rhsm_cert *cert, char *id, size_t size);
+
+/* Extension tables of a full X509 */
+size_t rhsm_extension_value (X509_EXTENSION *ext, char **output);
+int rhsm_ext_table_build (X509 *x509, rhsm_ext **output);
+void rhsm_ext_table_free (rhsm_ext *table, int count);
+
+/* Validity */
+char *rhsm_time_text (ASN1_UTCTIME *time);
+int rhsm_asn1_time_to_epoch (const ASN1_TIME *time, long long *seconds);
+int rhsm_x509_validity (X509 *x509, long long *not_before,
+			long long *not_after);
+
+/* Files and directories */
+char *rhsm_read_file (const char *path, size_t *length, int *error);
+char *rhsm_map_file (const char *path, size_t *length, int *error);
+void rhsm_unmap_file (char *map, size_t length);
+char **rhsm_dir_list (const char *dir_name, const char *suffix,
+		      const char *exclude, size_t *count);
+void rhsm_dir_list_free (char **paths, size_t count);
+int rhsm_dir_earliest_expiry (const char *dir_name, const char *suffix,
+			      const char *exclude, long long *not_after);
+
+/* Chain verification */
+X509_STORE *rhsm_store_from_dir (const char *dir_name, const char *suffix,
+				 int *count);
+int rhsm_verify (X509_STORE *store, X509 *x509, long long at);
+
+/* Certificate and private key pairing */
+enum {
+	RHSM_KEY_OK,
+	RHSM_KEY_MISSING,	/* no such key file, or not readable */
+	RHSM_KEY_INVALID,	/* not a private key */
+	RHSM_KEY_MISMATCH,	/* the key of another certificate */
+	RHSM_KEY_CERT_INVALID,	/* the certificate can't be read */
+};
+
+int rhsm_key_pair_check (const char *cert_path, const char *key_path);
+
+/*
+ * Certificate metadata index, see rhsmcert.c for the layout. Records are
+ * keyed by path and the (inode, mtime, size) of the file when it was
+ * indexed.
+ */
+typedef struct {
+	uint64_t inode;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint64_t size;
+} rhsm_index_key;
+
+typedef struct {
+	uint64_t inode;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint64_t size;
+	uint64_t path_offset;
+	uint64_t data_offset;
+	uint32_t path_length;
+	uint32_t data_length;
+} rhsm_index_record;
+
+typedef struct {
+	char *map;
+	size_t length;
+	rhsm_index_record *records;
+	uint32_t count;
+} rhsm_index;
+
+typedef struct {
+	char *path;
+	rhsm_index_key key;
+	const char *data;
+	size_t length;
+} rhsm_index_entry;
+
+void rhsm_index_open (const char *path, rhsm_index *index);
+void rhsm_index_close (rhsm_index *index);
+rhsm_index_record *rhsm_index_find (rhsm_index *index, const char *path);
+int rhsm_index_key_stat (const char *path, rhsm_index_key *key);
+int rhsm_index_key_matches (rhsm_index_record *record, rhsm_index_key *key);
+int rhsm_index_write (const char *path, rhsm_index_entry *entries,
+		      size_t count);
+
+/* Group commit of many files into a directory, see rhsmcert.c */
+typedef struct {
+	const char *name;	/* file name, without any directory */
+	const void *data;
+	size_t length;
+	unsigned int mode;	/* for open (), so the umask applies */
+} rhsm_file;
+
+int rhsm_write_files (const char *dir_name, const rhsm_file *files,
+		      size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RHSMCERT_H */
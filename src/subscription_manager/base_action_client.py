@@ -19,7 +19,8 @@ import logging
 
 from subscription_manager import injection as inj
 
-from rhsm.connection import GoneException, ExpiredIdentityCertException
+from rhsm.connection import GoneException, ExpiredIdentityCertException, \
+    RateLimitExceededException
 
 log = logging.getLogger(__name__)
 
@@ -67,6 +68,10 @@ class BaseActionClient(object):
         # raise this so it can be exposed clearly
         except ExpiredIdentityCertException as e:
             raise
+        # the other libs would only be turned away too, and rhsmcertd
+        # uses this to back off
+        except RateLimitExceededException as e:
+            raise
         except Exception as e:
             log.warning("Exception caught while running %s update" % lib)
             log.exception(e)
@@ -18,13 +18,17 @@ from __future__ import print_function, division, absolute_import
 #
 import logging
 import os
+import six
 
-from rhsm.certificate import Key, create_from_file
+from rhsm import _certificate
+from rhsm import ourjson as json
+from rhsm.certificate import Key, create_from_files, create_from_metadata, \
+        to_metadata
 from rhsm.config import initConfig
 from subscription_manager.injection import require, ENT_DIR
 
 from rhsmlib.services import config
-from rhsm.certificate2 import CONTENT_ACCESS_CERT_TYPE
+from rhsm.certificate2 import CONTENT_ACCESS_CERT_TYPE, ContentPathIndex
 
 log = logging.getLogger(__name__)
 
@@ -102,28 +106,135 @@ class CertificateDirectory(Directory):
 
     KEY = 'key.pem'
 
+    # Metadata indexes of the certificate directories are kept here,
+    # indexing is off when it doesn't exist.
+    INDEX_DIR = '/var/lib/rhsm/cache'
+
     def __init__(self, path):
         super(CertificateDirectory, self).__init__(path)
         self.create()
         self._listing = None
+        # Every certificate loaded so far by path, list() after
+        # list_valid() or list_expired() reuses them
+        self._loaded = {}
 
     def refresh(self):
         # simply clear the cache. the next list() will reload.
         self._listing = None
+        self._loaded = {}
 
     def list(self):
         if self._listing is not None:
             return self._listing
-        listing = []
+        paths = []
         for _p, fn in Directory.list(self):
             if not fn.endswith('.pem') or fn.endswith(self.KEY):
                 continue
-            path = self.abspath(fn)
-            listing.append(create_from_file(path))
+            paths.append(self.abspath(fn))
+        listing = self._load(paths)
         self._listing = listing
         return listing
 
+    def _index_path(self):
+        if not os.path.isdir(self.INDEX_DIR):
+            return None
+        name = self.path.strip('/').replace('/', '_')
+        return os.path.join(self.INDEX_DIR, 'certindex-%s.bin' % name)
+
+    def _load(self, paths, all_paths=None):
+        """
+        Certificate objects for paths, in order. Those unchanged since the
+        metadata index was written are rebuilt from it, the rest are read
+        and parsed (in parallel, off the GIL) and the index updated.
+
+        When paths are only some of the certificates, all_paths lists every
+        one of them so the index keeps the entries of the others. Paths
+        loaded before, since the last refresh(), are not loaded again.
+        """
+        certs = {}
+        for path in paths:
+            if path in self._loaded:
+                certs[path] = self._loaded[path]
+        todo = [path for path in paths if path not in certs]
+        if todo:
+            certs.update(zip(todo, self._load_paths(todo, all_paths or paths)))
+            self._loaded.update(certs)
+        return [certs[path] for path in paths]
+
+    def _load_paths(self, paths, all_paths):
+        index = self._index_path()
+        if index is None:
+            return create_from_files(paths)
+        found, indexed = _certificate.index_lookup(index, all_paths)
+
+        certs = {}
+        stale = []
+        for path in paths:
+            metadata = found.get(path, (None, None))[1]
+            cert = None
+            if metadata is not None:
+                try:
+                    cert = create_from_metadata(path, metadata)
+                except Exception as e:
+                    log.debug("Bad index entry for %s: %s" % (path, e))
+            if cert is None:
+                stale.append(path)
+            else:
+                certs[path] = cert
+        if stale:
+            certs.update(zip(stale, create_from_files(stale)))
+
+        if stale or indexed != len(all_paths):
+            self._update_index(index, all_paths, found, set(stale), certs)
+        return [certs[path] for path in paths]
+
+    def _update_index(self, index, paths, found, stale, certs):
+        entries = []
+        for path in paths:
+            if path not in found:
+                continue
+            data = None
+            if path in stale:
+                metadata = to_metadata(certs[path])
+                if metadata is None:
+                    continue
+                data = json.dumps(metadata).encode('utf-8')
+            # The key is from before the file was parsed, if it has changed
+            # since the entry just won't match next time.
+            entries.append((path, found[path][0], data))
+        try:
+            _certificate.index_update(index, entries)
+        except EnvironmentError as e:
+            log.debug("Could not update certificate index %s: %s" % (index, e))
+
+    def _list_by_validity(self, states):
+        """
+        Unless everything is loaded already, check dates natively and only
+        build certificate objects for the certs in the given
+        _certificate.scan_validity states. Returns None when the caller
+        should filter list() instead, including when some file could not
+        be read, so errors are reported the usual way.
+        """
+        if self._listing is not None:
+            return None
+        try:
+            scan = _certificate.scan_validity(self.path, exclude=self.KEY)
+        except EnvironmentError:
+            return None
+        if scan['failed']:
+            return None
+        paths = []
+        for state in states:
+            paths.extend(scan[state])
+        all_paths = []
+        for state in ('valid', 'expiring', 'expired', 'future'):
+            all_paths.extend(scan[state])
+        return self._load(sorted(paths), sorted(all_paths))
+
     def list_valid(self):
+        valid = self._list_by_validity(('valid', 'expiring'))
+        if valid is not None:
+            return valid
         valid = []
         for c in self.list():
             if c.is_valid():
@@ -131,6 +242,9 @@ class CertificateDirectory(Directory):
         return valid
 
     def list_expired(self):
+        expired = self._list_by_validity(('expired',))
+        if expired is not None:
+            return expired
         expired = []
         for c in self.list():
             if c.is_expired():
@@ -238,6 +352,10 @@ class ProductDirectory(ProductCertificateDirectory):
         self.installed_prod_dir.refresh()
         self.default_prod_dir.refresh()
 
+    def _list_by_validity(self, states):
+        # Merging the two directories needs every cert, see list()
+        return None
+
     # In productid.py, ProductDirectory.path is used as path to write new certs
     # to. Souse  the installed_prod_dir (/etc/pki/product) as that is
     # meant to be writable
@@ -262,6 +380,11 @@ class EntitlementDirectory(CertificateDirectory):
 
     def __init__(self):
         super(EntitlementDirectory, self).__init__(self.productpath())
+        self._path_index = None
+
+    def refresh(self):
+        super(EntitlementDirectory, self).refresh()
+        self._path_index = None
 
     def _check_key(self, cert):
         """
@@ -289,11 +412,39 @@ class EntitlementDirectory(CertificateDirectory):
             cert_writer.write(key, cert)
         return True
 
+    def _check_keys(self, certs):
+        """
+        Return the certificates that have a key, checking all the
+        cert/key pairs in one native call. Certificates whose key is
+        missing go through _check_key for the old style key.pem. A key
+        that can't be read or doesn't match its certificate is logged,
+        the certificate is kept as before.
+        """
+        on_disk = [cert for cert in certs
+                   if isinstance(cert.path, six.string_types)]
+        states = _certificate.check_key_pairs(
+            [(cert.path, cert.key_path()) for cert in on_disk])
+        missing = set()
+        for cert, state in zip(on_disk, states):
+            if state == _certificate.KEY_MISSING:
+                missing.add(id(cert))
+            elif state != _certificate.KEY_OK:
+                log.warning("Key %s does not match certificate %s (state %s)" %
+                            (cert.key_path(), cert.path, state))
+        checked = set(id(cert) for cert in on_disk)
+        return [cert for cert in certs
+                if (id(cert) in checked and id(cert) not in missing) or
+                self._check_key(cert)]
+
     def list_valid(self):
-        return [x for x in self.list() if self._check_key(x) and x.is_valid()]
+        return [x for x in self.list_valid_with_content_access()
+                if x.entitlement_type != CONTENT_ACCESS_CERT_TYPE]
 
     def list_valid_with_content_access(self):
-        return [x for x in self.list_with_content_access() if self._check_key(x) and x.is_valid()]
+        certs = self._list_by_validity(('valid', 'expiring'))
+        if certs is None:
+            certs = [x for x in self.list_with_content_access() if x.is_valid()]
+        return self._check_keys(certs)
 
     def list(self):
         certs = super(EntitlementDirectory, self).list()
@@ -302,6 +453,16 @@ class EntitlementDirectory(CertificateDirectory):
     def list_with_content_access(self):
         return super(EntitlementDirectory, self).list()
 
+    def list_for_path(self, path):
+        """
+        Returns all entitlement certificates (content access included)
+        granting access to the given content path. The merged path index
+        is built once and reused until the directory is refreshed.
+        """
+        if self._path_index is None:
+            self._path_index = ContentPathIndex(self.list_with_content_access())
+        return self._path_index.match(path)
+
     def list_for_product(self, product_id):
         """
         Returns all entitlement certificates providing access to the given
@@ -362,13 +523,27 @@ class Writer(object):
         self.ent_dir = require(ENT_DIR)
 
     def write(self, key, cert):
-        serial = cert.serial
-        ent_dir_path = self.ent_dir.productpath()
+        self.write_many([(key, cert)])
 
-        key_filename = '%s-key.pem' % str(serial)
-        key_path = Path.join(ent_dir_path, key_filename)
-        key.write(key_path)
+    def write_many(self, pairs):
+        """
+        Write the keys and certificates of many entitlements as one batch.
 
-        cert_filename = '%s.pem' % str(serial)
-        cert_path = Path.join(ent_dir_path, cert_filename)
-        cert.write(cert_path)
+        Everything is staged inside the entitlement directory, synced and
+        then renamed in, keys first, so readers never see a partial file or
+        a certificate without its key. If writing fails, the files renamed
+        so far are put back, see rhsm_write_files in rhsmcert.c.
+        """
+        ent_dir_path = Path.abs(self.ent_dir.productpath())
+        keys = []
+        certs = []
+        for key, cert in pairs:
+            serial = str(cert.serial)
+            keys.append(('%s-key.pem' % serial, key.content, 0o600))
+            certs.append(('%s.pem' % serial, cert.to_pem(), 0o666))
+        _certificate.write_files(ent_dir_path, keys + certs)
+
+        for key, cert in pairs:
+            serial = str(cert.serial)
+            key.path = os.path.join(ent_dir_path, '%s-key.pem' % serial)
+            cert.path = os.path.join(ent_dir_path, '%s.pem' % serial)
@@ -327,8 +327,7 @@ class EntitlementCertBundlesInstaller(object):
     def install(self, cert_bundles):
         """Fetch entitliement certs, install them, and update the report."""
         bundle_installer = EntitlementCertBundleInstaller(self.report)
-        for cert_bundle in cert_bundles:
-            bundle_installer.install(cert_bundle)
+        bundle_installer.install_many(cert_bundles)
         self.exceptions = bundle_installer.exceptions
         self.post_install()
 
@@ -357,11 +356,13 @@ class EntitlementCertBundleInstaller(object):
     Split a bundle into an certificate.EntitlementCertificate and a
     certificate.Key, and persist them.
 
-    pre_install() is called before the cert bundle is installed.
-    post_install() is called after the cert bundle is installed.
-    Note that EntitlementCertBundlesInstaller's pre and post install
-    hooks are before and after installing the full list of ent cert
-    bundles, while this is pre/post each ent cert bundle.
+    pre_install() and post_install() are called once for each cert
+    bundle. install_many() writes its bundles as one batch, so it calls
+    pre_install() for every bundle before any of them is written, and
+    post_install() for every bundle once the batch is written (or has
+    failed). Note that EntitlementCertBundlesInstaller's pre and post
+    install hooks are before and after installing the full list of ent
+    cert bundles.
     """
 
     def __init__(self, report):
@@ -370,22 +371,38 @@ class EntitlementCertBundleInstaller(object):
 
     def install(self, bundle):
         """Persist an ent cert and it's key after splitting it from the bundle."""
-        self.pre_install(bundle)
-
-        cert_bundle_writer = Writer()
-        try:
-            key, cert = self.build_cert(bundle)
-            cert_bundle_writer.write(key, cert)
+        self.install_many([bundle])
+
+    def install_many(self, bundles):
+        """Persist the ent certs and keys of many bundles in one batch.
+
+        Bundles that can't be split are skipped, the rest are written
+        together by Writer.write_many: if writing fails none of them are
+        installed, unless the process dies while they are renamed in.
+        """
+        built = []
+        for bundle in bundles:
+            self.pre_install(bundle)
+            try:
+                built.append((bundle, self.build_cert(bundle)))
+            except Exception as e:
+                self.install_exception(bundle, e)
 
-            self.report.added.append(cert)
-        except Exception as e:
-            self.install_exception(bundle, e)
+        if built:
+            cert_bundle_writer = Writer()
+            try:
+                cert_bundle_writer.write_many([pair for bundle, pair in built])
+                self.report.added.extend(cert for bundle, (key, cert) in built)
+            except Exception as e:
+                for bundle, pair in built:
+                    self.install_exception(bundle, e)
 
-        self.post_install(bundle)
+        for bundle in bundles:
+            self.post_install(bundle)
 
     # TODO: add subman plugin, slot, and conduit
     def pre_install(self, bundle):
-        """Hook called before an ent cert bundle is installed."""
+        """Hook called before an ent cert bundle, and the rest of its batch, is installed."""
         log.debug("Ent cert bundle pre_install")
 
     # should probably be in python-rhsm/certificate
@@ -407,7 +424,7 @@ class EntitlementCertBundleInstaller(object):
         self.report._exceptions.append(exception)
 
     def post_install(self, bundle):
-        """Hook called after an ent cert bundle is installed."""
+        """Hook called after an ent cert bundle, and the rest of its batch, is installed."""
         log.debug("ent cert bundle post_install")
 
 
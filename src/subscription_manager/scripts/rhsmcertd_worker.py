@@ -27,7 +27,11 @@ if six.PY2:
     reload(sys)
     sys.setdefaultencoding('utf-8')
 
+import math
+import os
+import resource
 import signal
+import socket
 import logging
 import dbus.mainloop.glib
 
@@ -53,11 +57,31 @@ from subscription_manager.utils import generate_correlation_id
 from subscription_manager.i18n import ugettext as _
 
 
+# Exit codes rhsmcertd.c reads, keep them in step.
+# Not registered or disabled by configuration: rhsmcertd does not retry
+EXIT_NO_RETRY = 99
+# Rate limited, plus the minutes the server asked to wait (0 when it did
+# not say)
+EXIT_RATE_LIMITED = 100
+RATE_LIMITED_MAX_MINUTES = 99
+
+# Commands rhsmcertd sends to a worker started with --serve
+SERVE_COMMANDS = {
+    'cert-check': False,
+    'auto-attach': True,
+}
+
+
+terminating = False
+
+
 def exit_on_signal(_signumber, _stackframe):
+    global terminating
+    terminating = True
     sys.exit(0)
 
 
-def _main(options, log):
+def _setup():
     # Set default mainloop
     dbus.mainloop.glib.DBusGMainLoop(set_as_default=True)
 
@@ -66,6 +90,8 @@ def _main(options, log):
     # without finally statements, we get confusing behavior (ex. see bz#1431659)
     signal.signal(signal.SIGTERM, exit_on_signal)
 
+
+def _main(options, log):
     cp_provider = inj.require(inj.CP_PROVIDER)
     correlation_id = generate_correlation_id()
     log.info('X-Correlation-ID: %s', correlation_id)
@@ -75,12 +101,12 @@ def _main(options, log):
     log.debug('check for rhsmcertd disable')
     if '1' == cfg.get('rhsmcertd', 'disable') and not options.force:
         log.warning('The rhsmcertd process has been disabled by configuration.')
-        sys.exit(-1)
+        sys.exit(EXIT_NO_RETRY)
 
     if not ConsumerIdentity.existsAndValid():
         log.error('Either the consumer is not registered or the certificates' +
                   ' are corrupted. Certificate update using daemon failed.')
-        sys.exit(-1)
+        sys.exit(EXIT_NO_RETRY)
     print(_('Updating entitlement certificates & repositories'))
 
     cp = cp_provider.get_consumer_auth_cp()
@@ -99,6 +125,13 @@ def _main(options, log):
             if update_report:
                 print(update_report)
 
+        # Some libs keep going after an error and only report it, but
+        # rhsmcertd has to know it should back off
+        for update_report in actionclient.update_reports:
+            for e in getattr(update_report, '_exceptions', None) or []:
+                if isinstance(e, connection.RateLimitExceededException):
+                    raise e
+
     except connection.ExpiredIdentityCertException as e:
         log.critical(_("Your identity certificate has expired"))
         raise e
@@ -133,31 +166,126 @@ def _main(options, log):
         raise ge
 
 
-def main():
-    logutil.init_logger()
-    log = logging.getLogger('rhsm-app.' + __name__)
+def _rate_limited(retry_after):
+    minutes = 0
+    if retry_after:
+        minutes = min(int(math.ceil(retry_after / 60)), RATE_LIMITED_MAX_MINUTES)
+    return EXIT_RATE_LIMITED + minutes
 
-    parser = OptionParser(usage=USAGE,
-                          formatter=WrappedIndentedHelpFormatter())
-    parser.add_option("--autoheal", dest="autoheal", action="store_true",
-            default=False, help="perform an autoheal check")
-    parser.add_option("--force", dest="force", action="store_true",
-            default=False, help=SUPPRESS_HELP)
-    (options, args) = parser.parse_args()
+
+def _run(options, log):
+    """
+    Run one cert check or auto-attach and return the exit code for it.
+    """
     try:
         _main(options, log)
+    except connection.RateLimitExceededException as e:
+        log.warning("Rate limited while updating certificates: %s", e.msg)
+        return _rate_limited(e.retry_after)
     except SystemExit as se:
         # sys.exit triggers an exception in older Python versions, which
         # in this case  we can safely ignore as we do not want to log the
         # stack trace. We need to check the code, since we want to signal
         # exit with failure to the caller. Otherwise, we will exit with 0
+        if se.code == EXIT_NO_RETRY:
+            return EXIT_NO_RETRY
         if se.code:
-            sys.exit(-1)
+            return 255
     except Exception as e:
         log.error("Error while updating certificates using daemon")
         print(_('Unable to update entitlement certificates and repositories'))
         log.exception(e)
-        sys.exit(-1)
+        return 255
+    return 0
+
+
+def _refresh():
+    """
+    Forget what the previous job of a --serve worker learned about the
+    system, another tool may have changed it since.
+    """
+    inj.require(inj.IDENTITY).reload()
+    inj.require(inj.CP_PROVIDER).clean()
+    inj.require(inj.ENT_DIR).refresh()
+    inj.require(inj.PROD_DIR).refresh()
+
+
+def _peak_rss_kb():
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def _serve(options, log):
+    """
+    Run jobs for rhsmcertd until it closes its end of the socket.
+
+    rhsmcertd writes one command per line and waits for a line with the
+    exit code of the job. After workerMaxJobs jobs, or once the peak RSS
+    grew by more than workerMaxMemory MB, the reply carries " exit" and the
+    worker goes away; rhsmcertd starts a fresh one for the next job.
+    """
+    cfg = config.initConfig()
+    try:
+        max_jobs = cfg.get_int('rhsmcertd', 'workerMaxJobs') or 0
+        max_growth_kb = (cfg.get_int('rhsmcertd', 'workerMaxMemory') or 0) * 1024
+    except ValueError as e:
+        log.warning('Invalid worker limits in configuration, ignoring: %s', e)
+        max_jobs = max_growth_kb = 0
+
+    sock = socket.fromfd(options.serve, socket.AF_UNIX, socket.SOCK_STREAM)
+    os.close(options.serve)
+    commands = sock.makefile('rb')
+    start_rss_kb = _peak_rss_kb()
+    jobs = 0
+
+    try:
+        for line in commands:
+            command = line.strip().decode('ascii', 'replace')
+            if command not in SERVE_COMMANDS:
+                log.error('Unknown rhsmcertd command: %s', command)
+                code = 255
+            else:
+                if jobs:
+                    _refresh()
+                options.autoheal = SERVE_COMMANDS[command]
+                code = _run(options, log)
+                jobs += 1
+                if terminating:
+                    # _run took the SIGTERM for a failed job
+                    sys.exit(0)
+
+            growth_kb = _peak_rss_kb() - start_rss_kb
+            retire = (max_jobs and jobs >= max_jobs) or \
+                (max_growth_kb and growth_kb > max_growth_kb)
+            sock.sendall(('%d%s\n' % (code, ' exit' if retire else '')).encode('ascii'))
+            if retire:
+                log.info('Worker retiring after %d jobs, peak RSS grew by %d kB',
+                         jobs, growth_kb)
+                break
+    finally:
+        commands.close()
+        sock.close()
+
+
+def main():
+    logutil.init_logger()
+    log = logging.getLogger('rhsm-app.' + __name__)
+
+    parser = OptionParser(usage=USAGE,
+                          formatter=WrappedIndentedHelpFormatter())
+    parser.add_option("--autoheal", dest="autoheal", action="store_true",
+            default=False, help="perform an autoheal check")
+    parser.add_option("--force", dest="force", action="store_true",
+            default=False, help=SUPPRESS_HELP)
+    parser.add_option("--serve", dest="serve", type="int", metavar="FD",
+            default=None, help=SUPPRESS_HELP)
+    (options, args) = parser.parse_args()
+    _setup()
+    if options.serve is not None:
+        _serve(options, log)
+    else:
+        code = _run(options, log)
+        if code:
+            sys.exit(code)
 
 
 if __name__ == '__main__':
@@ -230,6 +230,7 @@ Requires(preun): %{?suse_version:aaa_base} %{!?suse_version:chkconfig, initscrip
 
 BuildRequires: %{?suse_version:python-devel >= 2.6} %{!?suse_version:%{py_package_prefix}-devel}
 BuildRequires: openssl-devel
+BuildRequires: zlib-devel
 BuildRequires: gcc
 BuildRequires: %{py_package_prefix}-setuptools
 BuildRequires: gettext
@@ -0,0 +1,351 @@
+#!/usr/bin/python
+from __future__ import print_function, division, absolute_import
+
+#
+# Copyright (c) 2019 Red Hat, Inc.
+#
+# This software is licensed to you under the GNU General Public License,
+# version 2 (GPLv2). There is NO WARRANTY for this software, express or
+# implied, including the implied warranties of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+# along with this software; if not, see
+# http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+#
+# Red Hat trademarks are not licensed under GPLv2. No permission is
+# granted to use or replicate Red Hat trademarks that are incorporated
+# in this software or its documentation.
+#
+
+# Certificate microbenchmarks for rhsm._certificate and rhsm.certificate2.
+#
+# Generates synthetic identity, product, v1 entitlement, v3 entitlement and
+# SCA (content access) certificates with the openssl command, then times
+# load, get_extension, get_all_extensions, as_pem, as_text and the whole
+# certificate2 create_from_file pipeline on each. Every operation reports
+# its throughput, p50/p99 latency and the peak RSS of the process so far
+# (ru_maxrss, so it only ever grows over a run).
+#
+# Results are written as JSON; pass the JSON of an earlier run as
+# --baseline to see the change in throughput of every operation, and
+# --max-regression to fail when anything got slower than that.
+#
+# from top level of tree, after building the extension in place:
+#    PYTHONPATH=src:. python test/bench/cert_bench.py [--output results.json]
+#        [--baseline old.json [--max-regression 10]] [--iterations N]
+#        [--contents N] [--extra-extensions N] [--value-size N]
+
+import base64
+import json
+import optparse
+import os
+import platform
+import random
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+from rhsm import _certificate
+from rhsm import certificate2
+
+timer = getattr(time, 'perf_counter', time.time)
+
+RH_OID = "1.3.6.1.4.1.2312.9"
+# Filler extensions live outside the namespace the certificate code parses
+FILLER_OID = "1.3.6.1.4.1.2312.99"
+PRODUCT_ID = "100000000000002"
+
+KINDS = ["identity", "product", "entitlement_v1", "entitlement_v3", "sca"]
+
+# The extension each kind looks up in the get_extension benchmark
+LOOKUP_OID = {
+    "identity": "2.5.29.17",
+    "product": "%s.1.%s.1" % (RH_OID, PRODUCT_ID),
+    "entitlement_v1": "%s.4.1" % RH_OID,
+    "entitlement_v3": "%s.6" % RH_OID,
+    "sca": "%s.8" % RH_OID,
+}
+
+
+def openssl(*args):
+    subprocess.check_call(("openssl",) + args, stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE)
+
+
+def utf8_extension(oid, value):
+    return "%s = ASN1:UTF8String:%s" % (oid, value)
+
+
+def product_extensions():
+    prefix = "%s.1.%s" % (RH_OID, PRODUCT_ID)
+    return [utf8_extension(prefix + ".1", "Awesome OS for x86_64 Bits"),
+            utf8_extension(prefix + ".2", "3.11"),
+            utf8_extension(prefix + ".3", "x86_64"),
+            utf8_extension(prefix + ".4", "awesomeos-x86_64")]
+
+
+def content_extensions(count):
+    lines = []
+    for i in range(count):
+        prefix = "%s.2.%d.1" % (RH_OID, 10000 + i)
+        lines += [utf8_extension(prefix, "yum"),
+                  utf8_extension(prefix + ".1", "content-%d" % i),
+                  utf8_extension(prefix + ".2", "content-label-%d" % i),
+                  utf8_extension(prefix + ".5", "Red Hat"),
+                  utf8_extension(prefix + ".6", "/content/dist/bench/%d/os" % i),
+                  utf8_extension(prefix + ".7", "/etc/pki/rpm-gpg/RPM-GPG-KEY"),
+                  utf8_extension(prefix + ".8", str(i % 2)),
+                  utf8_extension(prefix + ".9", "3600")]
+    return lines
+
+
+def order_extensions():
+    prefix = "%s.4" % RH_OID
+    return [utf8_extension(prefix + ".1", "Awesome OS for x86_64"),
+            utf8_extension(prefix + ".2", "ff80808139d94b400139d94c018c0164"),
+            utf8_extension(prefix + ".3", "awesomeos-x86_64"),
+            utf8_extension(prefix + ".5", "10"),
+            utf8_extension(prefix + ".6", "2012-09-18T00:00:00Z"),
+            utf8_extension(prefix + ".7", "2013-09-18T00:00:00Z"),
+            utf8_extension(prefix + ".10", "67"),
+            utf8_extension(prefix + ".13", "12331131231")]
+
+
+def entitlement_payload(contents):
+    content = [{
+        "id": str(10000 + i),
+        "type": "yum",
+        "name": "content-%d" % i,
+        "label": "content-label-%d" % i,
+        "vendor": "Red Hat",
+        "path": "/content/dist/bench/%d/$releasever/$basearch/os" % i,
+        "gpg_url": "file:///etc/pki/rpm-gpg/RPM-GPG-KEY-redhat-release",
+        "enabled": bool(i % 2),
+        "metadata_expire": 3600,
+    } for i in range(contents)]
+    return {
+        "consumer": "bad3da4f-34bd-4391-85fb-87cf95673bb3",
+        "quantity": 1,
+        "subscription": {"sku": "awesomeos-x86_64",
+                         "name": "Awesome OS for x86_64",
+                         "warning": 30, "sockets": 1, "stacking_id": "1"},
+        "order": {"number": "ff80808139d94b400139d94c018c0164",
+                  "quantity": 10, "start": "2012-09-18T00:00:00Z",
+                  "end": "2013-09-18T00:00:00Z", "contract": "67",
+                  "account": "12331131231"},
+        "products": [{"id": PRODUCT_ID,
+                      "name": "Awesome OS for x86_64 Bits",
+                      "version": "3.11",
+                      "architectures": ["x86_64"],
+                      "content": content}],
+    }
+
+
+def pem_section(label, data):
+    encoded = base64.b64encode(data).decode('ascii')
+    lines = [encoded[i:i + 64] for i in range(0, len(encoded), 64)]
+    return "-----BEGIN %s-----\n%s\n-----END %s-----\n" % (
+        label, "\n".join(lines), label)
+
+
+def kind_extensions(kind, options):
+    if kind == "identity":
+        lines = ["subjectAltName = DNS:bench.example.com"]
+    elif kind == "product":
+        lines = product_extensions()
+    elif kind == "entitlement_v1":
+        lines = (product_extensions() + order_extensions() +
+                 content_extensions(options.contents))
+    else:
+        lines = [utf8_extension("%s.6" % RH_OID, "3.0")]
+        if kind == "sca":
+            lines.append(utf8_extension("%s.8" % RH_OID, "OrgLevel"))
+    value = "x" * options.value_size
+    lines += [utf8_extension("%s.%d" % (FILLER_OID, i), value)
+              for i in range(options.extra_extensions)]
+    return lines
+
+
+def generate(directory, options):
+    """
+    Write one certificate of each kind to directory, returning
+    {kind: path}. v3 and SCA certificates get an ENTITLEMENT DATA
+    section with options.contents content sets, and a dummy signature.
+    """
+    key = os.path.join(directory, "key.pem")
+    openssl("genrsa", "-out", key, "2048")
+
+    rng = random.Random(options.seed)
+    paths = {}
+    for kind in KINDS:
+        config = os.path.join(directory, kind + ".cnf")
+        with open(config, "w") as f:
+            f.write("[req]\ndistinguished_name = dn\nprompt = no\n")
+            f.write("[dn]\nCN = %032x\n" % rng.getrandbits(128))
+            f.write("[ext]\n")
+            f.write("\n".join(kind_extensions(kind, options)) + "\n")
+
+        path = os.path.join(directory, kind + ".pem")
+        openssl("req", "-new", "-x509", "-sha256", "-days", "365",
+                "-key", key, "-config", config, "-extensions", "ext",
+                "-set_serial", str(rng.getrandbits(63)), "-out", path)
+
+        if kind in ("entitlement_v3", "sca"):
+            payload = json.dumps(entitlement_payload(options.contents))
+            signature = bytes(bytearray(rng.getrandbits(8)
+                                        for i in range(256)))
+            with open(path, "a") as f:
+                f.write(pem_section("ENTITLEMENT DATA",
+                                    zlib.compress(payload.encode('utf-8'))))
+                f.write(pem_section("RSA SIGNATURE", signature))
+        paths[kind] = path
+    return paths
+
+
+def operations(kind, path):
+    """The (name, callable) pairs timed for one certificate"""
+    with open(path) as f:
+        pem = f.read()
+    x509 = _certificate.load(pem=pem)
+    oid = LOOKUP_OID[kind]
+    factory = certificate2._CertFactory()
+    return [
+        ("load", lambda: _certificate.load(pem=pem)),
+        ("load_compact", lambda: _certificate.load(pem=pem, compact=True)),
+        ("get_extension", lambda: x509.get_extension(oid)),
+        ("get_all_extensions", x509.get_all_extensions),
+        ("as_pem", x509.as_pem),
+        ("as_text", x509.as_text),
+        ("create_from_file", lambda: factory.create_from_file(path)),
+    ]
+
+
+def percentile(ordered, percent):
+    index = int(round(percent / 100.0 * (len(ordered) - 1)))
+    return ordered[index]
+
+
+def measure(function, iterations, warmup):
+    for i in range(warmup):
+        function()
+
+    latencies = []
+    start = timer()
+    for i in range(iterations):
+        before = timer()
+        function()
+        latencies.append(timer() - before)
+    elapsed = timer() - start
+
+    latencies.sort()
+    return {
+        "iterations": iterations,
+        "ops_per_sec": iterations / elapsed,
+        "p50_us": percentile(latencies, 50) * 1e6,
+        "p99_us": percentile(latencies, 99) * 1e6,
+        "peak_rss_kb": resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+    }
+
+
+def compare(results, baseline, max_regression):
+    """
+    Print the throughput change of every operation also in baseline,
+    returns False if one regressed by more than max_regression percent.
+    """
+    old = dict(((r["cert"], r["op"]), r) for r in baseline["results"])
+    ok = True
+    print("%-16s %-20s %12s %12s %8s" % ("cert", "op", "baseline/s", "now/s",
+                                         "change"))
+    for result in results:
+        before = old.get((result["cert"], result["op"]))
+        if before is None:
+            continue
+        change = 100.0 * (result["ops_per_sec"] / before["ops_per_sec"] - 1)
+        flag = ""
+        if max_regression is not None and change < -max_regression:
+            flag = " REGRESSION"
+            ok = False
+        print("%-16s %-20s %12.0f %12.0f %+7.1f%%%s" % (
+            result["cert"], result["op"], before["ops_per_sec"],
+            result["ops_per_sec"], change, flag))
+    return ok
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("--iterations", type="int", default=2000,
+                      help="timed calls per operation")
+    parser.add_option("--warmup", type="int", default=100,
+                      help="untimed calls before each operation")
+    parser.add_option("--contents", type="int", default=20,
+                      help="content sets in each entitlement certificate")
+    parser.add_option("--extra-extensions", type="int", default=0,
+                      help="filler extensions added to every certificate")
+    parser.add_option("--value-size", type="int", default=32,
+                      help="bytes in each filler extension value")
+    parser.add_option("--kinds", default=",".join(KINDS),
+                      help="certificate kinds to run, from %s" % ", ".join(KINDS))
+    parser.add_option("--seed", type="int", default=0,
+                      help="seed for subjects, serials and signatures")
+    parser.add_option("--output", help="write the JSON results to this file "
+                      "(default stdout)")
+    parser.add_option("--baseline", help="JSON results of an earlier run to "
+                      "compare with")
+    parser.add_option("--max-regression", type="float",
+                      help="with --baseline, exit 1 when an operation's "
+                      "throughput dropped by more than this percentage")
+    options, args = parser.parse_args()
+
+    kinds = options.kinds.split(",")
+    unknown = set(kinds) - set(KINDS)
+    if unknown:
+        parser.error("unknown certificate kinds: %s" % ", ".join(sorted(unknown)))
+
+    directory = tempfile.mkdtemp(prefix="cert-bench-")
+    try:
+        paths = generate(directory, options)
+        results = []
+        for kind in kinds:
+            for name, function in operations(kind, paths[kind]):
+                result = measure(function, options.iterations, options.warmup)
+                result.update({"cert": kind, "op": name,
+                               "cert_bytes": os.path.getsize(paths[kind])})
+                results.append(result)
+    finally:
+        shutil.rmtree(directory)
+
+    report = {
+        "meta": {
+            "time": int(time.time()),
+            "python": platform.python_version(),
+            "platform": platform.platform(),
+            "options": {
+                "iterations": options.iterations,
+                "warmup": options.warmup,
+                "contents": options.contents,
+                "extra_extensions": options.extra_extensions,
+                "value_size": options.value_size,
+                "seed": options.seed,
+            },
+        },
+        "results": results,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if options.output:
+        with open(options.output, "w") as f:
+            f.write(text + "\n")
+    elif not options.baseline:
+        print(text)
+
+    if options.baseline:
+        with open(options.baseline) as f:
+            baseline = json.load(f)
+        if not compare(results, baseline, options.max_regression):
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
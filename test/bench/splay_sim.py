@@ -0,0 +1,177 @@
+#!/usr/bin/python
+from __future__ import print_function, division, absolute_import
+
+#
+# Copyright (c) 2019 Red Hat, Inc.
+#
+# This software is licensed to you under the GNU General Public License,
+# version 2 (GPLv2). There is NO WARRANTY for this software, express or
+# implied, including the implied warranties of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+# along with this software; if not, see
+# http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+#
+# Red Hat trademarks are not licensed under GPLv2. No permission is
+# granted to use or replicate Red Hat trademarks that are incorporated
+# in this software or its documentation.
+#
+
+# Simulates the checks of a fleet of rhsmcertd daemons and plots the
+# expected number of requests per minute, for the random splay and for the
+# splay derived from the consumer uuid (splayMode = uuid in rhsm.conf).
+#
+# All hosts restart within --restart-window minutes of the start of the
+# simulation, then each one runs its checks every --interval minutes. With
+# --restarts the fleet is restarted again that many times, spread over the
+# simulation, to show how the schedules move.
+#
+#    python test/bench/splay_sim.py [--hosts N] [--interval MINUTES] [--csv FILE]
+
+import csv
+import optparse
+import random
+import uuid as uuidlib
+
+# Same as rhsmcertd.c
+INITIAL_DELAY_SECONDS = 120
+
+FNV_OFFSET = 14695981039346656037
+FNV_PRIME = 1099511628211
+MASK_64 = (1 << 64) - 1
+
+
+def splay_hash(uuid, job):
+    """
+    FNV-1a of "uuid:job", the same as splay_hash () in rhsmcertd.c.
+    """
+    value = FNV_OFFSET
+    for byte in bytearray(("%s:%s" % (uuid, job)).encode('ascii')):
+        value = ((value ^ byte) * FNV_PRIME) & MASK_64
+    return value
+
+
+def uuid_splay(uuid, job, interval, now):
+    """
+    The same as uuid_splay () in rhsmcertd.c
+    """
+    if interval <= 0:
+        return 0
+    slot = splay_hash(uuid, job) % interval
+    start = now + INITIAL_DELAY_SECONDS
+    return (slot - start) % interval
+
+
+def random_splay(rng, interval):
+    # gen_random () in rhsmcertd.c, inclusive of the interval
+    return rng.randint(0, interval)
+
+
+def check_times(restarts, interval, end, splay):
+    """
+    The seconds at which one host runs its check. restarts is the sorted
+    list of times the host was (re)started, splay returns the offset for a
+    start at the given time.
+    """
+    times = []
+    for i, started in enumerate(restarts):
+        stopped = restarts[i + 1] if i + 1 < len(restarts) else end
+        when = started + INITIAL_DELAY_SECONDS + splay(started)
+        while when < stopped:
+            times.append(when)
+            when += interval
+    return times
+
+
+def simulate(options, mode, rng):
+    interval = options.interval * 60
+    end = options.duration * 60
+    window = options.restart_window * 60
+    minutes = [0] * options.duration
+    splay_rng = random.Random(options.seed + 1)
+
+    for _ in range(options.hosts):
+        uuid = str(uuidlib.UUID(int=rng.getrandbits(128), version=4))
+        restarts = [rng.uniform(0, window)]
+        for n in range(1, options.restarts + 1):
+            restarts.append(end * n // (options.restarts + 1) + rng.uniform(0, window))
+        restarts.sort()
+
+        if mode == 'uuid':
+            def splay(started):
+                return uuid_splay(uuid, options.job, interval, int(started))
+        else:
+            def splay(_started):
+                return random_splay(splay_rng, interval)
+
+        for when in check_times(restarts, interval, end, splay):
+            minutes[int(when // 60)] += 1
+    return minutes
+
+
+def summary(counts):
+    ordered = sorted(counts)
+    busy = [c for c in counts if c]
+    return {
+        'peak': ordered[-1],
+        'p99': ordered[min(len(ordered) - 1, int(len(ordered) * 0.99))],
+        'mean': sum(counts) / len(counts),
+        'idle': len(counts) - len(busy),
+    }
+
+
+def plot(name, counts, rows, width):
+    # One row per bucket of minutes, with the peak minute of the bucket
+    bucket = max(1, -(-len(counts) // rows))
+    peaks = [max(counts[i:i + bucket]) for i in range(0, len(counts), bucket)]
+    scale = max(peaks) or 1
+    print("%s: peak requests per minute, %d minutes per row" % (name, bucket))
+    for i, peak in enumerate(peaks):
+        print("%6d | %-*s %d" % (i * bucket, width, '#' * int(round(peak * width / scale)), peak))
+    print()
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("--hosts", type="int", default=40000)
+    parser.add_option("--interval", type="int", default=240,
+            help="check interval in minutes (default %default)")
+    parser.add_option("--job", default="cert-check",
+            choices=["cert-check", "auto-attach"])
+    parser.add_option("--duration", type="int", default=None,
+            help="minutes to simulate (default two intervals)")
+    parser.add_option("--restart-window", type="int", default=5,
+            help="minutes over which the fleet restarts (default %default)")
+    parser.add_option("--restarts", type="int", default=0,
+            help="number of further fleet restarts (default %default)")
+    parser.add_option("--mode", default="both", choices=["random", "uuid", "both"])
+    parser.add_option("--seed", type="int", default=0)
+    parser.add_option("--rows", type="int", default=48)
+    parser.add_option("--width", type="int", default=60)
+    parser.add_option("--csv", help="write the requests per minute to this file")
+    options, _args = parser.parse_args()
+    if options.duration is None:
+        options.duration = 2 * options.interval
+
+    modes = ['random', 'uuid'] if options.mode == 'both' else [options.mode]
+    results = {}
+    for mode in modes:
+        # The same fleet and restarts for every mode
+        results[mode] = simulate(options, mode, random.Random(options.seed))
+        plot(mode, results[mode], options.rows, options.width)
+
+    print("%-8s %8s %8s %8s %8s" % ("mode", "peak", "p99", "mean", "idle"))
+    for mode in modes:
+        stats = summary(results[mode])
+        print("%-8s %8d %8d %8.1f %8d" % (mode, stats['peak'], stats['p99'],
+                                          stats['mean'], stats['idle']))
+
+    if options.csv:
+        with open(options.csv, 'w') as f:
+            writer = csv.writer(f)
+            writer.writerow(['minute'] + modes)
+            for minute in range(options.duration):
+                writer.writerow([minute] + [results[mode][minute] for mode in modes])
+
+
+if __name__ == '__main__':
+    main()
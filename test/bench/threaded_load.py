@@ -0,0 +1,86 @@
+#!/usr/bin/python
+from __future__ import print_function, division, absolute_import
+
+#
+# Copyright (c) 2019 Red Hat, Inc.
+#
+# This software is licensed to you under the GNU General Public License,
+# version 2 (GPLv2). There is NO WARRANTY for this software, express or
+# implied, including the implied warranties of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+# along with this software; if not, see
+# http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+#
+# Red Hat trademarks are not licensed under GPLv2. No permission is
+# granted to use or replicate Red Hat trademarks that are incorporated
+# in this software or its documentation.
+#
+
+# Threaded stress test for rhsm._certificate.
+#
+# Runs load() + get_all_extensions() concurrently from an increasing number
+# of python threads and prints the throughput and speedup over a single
+# thread. Since the OpenSSL work is done without the GIL, the speedup should
+# grow close to linearly up to the number of cores.
+#
+# from top level of tree, after building the extension in place:
+#    PYTHONPATH=src:. python test/bench/threaded_load.py [--iterations N] [--max-threads N]
+
+import optparse
+import multiprocessing
+import threading
+import time
+
+from rhsm import _certificate
+from test.rhsm.unit import certdata
+
+PEMS = [
+    certdata.PRODUCT_CERT_V1_0,
+    certdata.ENTITLEMENT_CERT_V1_0,
+    certdata.ENTITLEMENT_CERT_V3_0,
+    certdata.IDENTITY_CERT,
+]
+
+
+def worker(iterations):
+    for i in range(iterations):
+        x509 = _certificate.load(pem=PEMS[i % len(PEMS)])
+        x509.get_all_extensions()
+
+
+def run(threads, iterations):
+    pool = [threading.Thread(target=worker, args=(iterations,))
+            for i in range(threads)]
+    start = time.time()
+    for thread in pool:
+        thread.start()
+    for thread in pool:
+        thread.join()
+    return time.time() - start
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("--iterations", type="int", default=2000,
+                      help="certificates loaded per thread")
+    parser.add_option("--max-threads", type="int",
+                      default=multiprocessing.cpu_count(),
+                      help="largest thread count to try")
+    options, args = parser.parse_args()
+
+    # warm up
+    worker(100)
+
+    base = None
+    print("%8s %12s %10s %10s" % ("threads", "certs/sec", "speedup", "efficiency"))
+    for threads in range(1, options.max_threads + 1):
+        elapsed = run(threads, options.iterations)
+        rate = threads * options.iterations / elapsed
+        if base is None:
+            base = rate
+        speedup = rate / base
+        print("%8d %12.0f %9.2fx %9.0f%%" % (threads, rate, speedup, 100 * speedup / threads))
+
+
+if __name__ == '__main__':
+    main()
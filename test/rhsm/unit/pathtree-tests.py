@@ -16,7 +16,9 @@ from __future__ import print_function, division, absolute_import
 from collections import deque
 import os
 import unittest
+import zlib
 
+from rhsm import _certificate
 from rhsm.bitstream import GhettoBitStream
 from rhsm.huffman import HuffmanNode
 from rhsm.pathtree import PathTree, PATH_END
@@ -25,6 +27,35 @@ DATA = os.path.join(os.path.dirname(os.path.abspath(__file__)),
                     'entitlement_data.bin')
 
 
+def encode_tree(nodes):
+    """
+    Encode a path tree the way the v3 entitlement certificates do. nodes
+    lists the (word, child) edges of each node, the root first.
+    """
+    words = sorted(set(word for edges in nodes for word, _ in edges))
+    word_leaves = [HuffmanNode(weight, word) for weight, word in enumerate(words + [''], 1)]
+    HuffmanNode.build_tree(word_leaves)
+    word_codes = dict((leaf.value, leaf.code) for leaf in word_leaves)
+    path_leaves = [HuffmanNode(weight, None) for weight in range(1, len(nodes))]
+    HuffmanNode.build_tree(path_leaves)
+
+    bits = ''
+    for edges in nodes:
+        for word, child in edges:
+            bits += word_codes[word] + path_leaves[child - 1].code
+        bits += word_codes['']
+    bits += '0' * (-len(bits) % 8)
+
+    count = len(nodes)
+    if count < 128:
+        header = [count]
+    else:
+        size = (count.bit_length() + 7) // 8
+        header = [128 + size] + [(count >> (8 * i)) & 0xff for i in reversed(range(size))]
+    data = zlib.compress('\0'.join(words + ['']).encode('utf-8'))
+    return data + bytes(bytearray(header + [int(bits[i:i + 8], 2) for i in range(0, len(bits), 8)]))
+
+
 class TestPathTree(unittest.TestCase):
     def test_get_leaf_from_dict(self):
         codes = {'1010': 'abc'}
@@ -153,3 +184,94 @@ class TestPathTree(unittest.TestCase):
             self.assertTrue(pt.match_path('/foo/jarjar/binks'))
             self.assertTrue(pt.match_path('/foo/jarjar/bar'))
             self.assertFalse(pt.match_path('/foo/jarjar/notbinks'))
+
+
+class TestNativePathTree(unittest.TestCase):
+    def setUp(self):
+        self.data = open(DATA, 'rb').read()
+
+    def test_match_path(self):
+        pt = _certificate.PathTree(self.data)
+        self.assertTrue(pt.match_path('/foo/path'))
+        self.assertTrue(pt.match_path('/foo/path/'))
+        # the '2' should match against "$releasever"
+        self.assertTrue(pt.match_path('/foo/path/always/2'))
+        self.assertTrue(pt.match_path('/foo/path/bar'))
+        self.assertTrue(pt.match_path('/foo/path/bar/a/b/c'))
+        self.assertFalse(pt.match_path('/foo'))
+        self.assertFalse(pt.match_path('/bar'))
+
+    def test_match_path_listing(self):
+        pt = _certificate.PathTree(self.data)
+        self.assertTrue(pt.match_path('/foo/listing'))
+        self.assertFalse(pt.match_path('/foo/listing/bar'))
+
+    def test_same_as_python(self):
+        py_tree = PathTree(self.data)
+        native_tree = _certificate.PathTree(self.data)
+        for path in ['/', '/foo', '/foo/path/never', '/foo/path/always',
+                     '/foo/path/always/7Server/x86_64', '/foo/never/path',
+                     '/listing', '/foo/path/listing']:
+            self.assertEqual(py_tree.match_path(path),
+                             native_tree.match_path(path), path)
+
+    def test_relative_path(self):
+        pt = _certificate.PathTree(self.data)
+        self.assertRaises(ValueError, pt.match_path, 'foo/path')
+
+    def test_bad_data(self):
+        self.assertRaises(ValueError, _certificate.PathTree, b'not a path tree')
+        # a valid word list with no node data after it
+        self.assertRaises(ValueError, _certificate.PathTree,
+                          zlib.compress(b'foo\0'))
+
+
+class TestNativePathIndex(unittest.TestCase):
+    def setUp(self):
+        self.tree = _certificate.PathTree(open(DATA, 'rb').read())
+
+    def test_empty(self):
+        index = _certificate.PathIndex()
+        self.assertEqual(0, len(index))
+        self.assertEqual([], index.match('/foo/path'))
+
+    def test_match(self):
+        index = _certificate.PathIndex()
+        index.add('a', self.tree)
+        index.add('b', self.tree)
+        self.assertEqual(2, len(index))
+        self.assertEqual(['a', 'b'], index.match('/foo/path/always/2'))
+        self.assertEqual(['a', 'b'], index.match('/foo/listing'))
+        self.assertEqual([], index.match('/foo'))
+        self.assertEqual([], index.match('/foo/listing/bar'))
+
+    def test_same_as_tree(self):
+        index = _certificate.PathIndex()
+        index.add(1, self.tree)
+        for path in ['/', '/foo', '/foo/path/never', '/foo/path/always',
+                     '/foo/path/always/7Server/x86_64', '/foo/never/path',
+                     '/listing', '/foo/path/listing', '/foo/path/bar/a/b/c']:
+            expected = [1] if self.tree.match_path(path) else []
+            self.assertEqual(expected, index.match(path), path)
+
+    def test_relative_path(self):
+        index = _certificate.PathIndex()
+        self.assertRaises(ValueError, index.match, 'foo/path')
+
+    def test_add_not_a_tree(self):
+        index = _certificate.PathIndex()
+        self.assertRaises(TypeError, index.add, 'a', 'not a tree')
+
+    def test_failed_add(self):
+        # /a/a/.../a, deeper than the index takes
+        deep = _certificate.PathTree(encode_tree([[('a', i + 1)] for i in range(299)] + [[]]))
+        self.assertTrue(deep.match_path('/a' * 299))
+        index = _certificate.PathIndex()
+        self.assertRaises(ValueError, index.add, 'deep', deep)
+        self.assertEqual(0, len(index))
+
+        # The next tree gets the same id, none of the deep one must stick
+        index.add('b', _certificate.PathTree(encode_tree([[('foo', 1)], []])))
+        self.assertEqual([], index.match('/a/listing'))
+        self.assertEqual([], index.match('/a' * 299))
+        self.assertEqual(['b'], index.match('/foo/bar'))
@@ -25,10 +25,13 @@ import os
 from mock import patch, MagicMock
 from shutil import rmtree
 
+from rhsm.certificate import Key, create_from_files, create_from_pem
+
+from . import certdata
 from .stubs import StubProduct, StubEntitlementCertificate, \
     StubProductCertificate
 from subscription_manager.certdirectory import Path, EntitlementDirectory, \
-    ProductDirectory, ProductCertificateDirectory, Directory
+    ProductDirectory, ProductCertificateDirectory, Directory, Writer
 from subscription_manager.repolib import YumRepoFile
 from subscription_manager.productid import ProductDatabase
 
@@ -118,6 +121,72 @@ class TestEntitlementDirectoryCheckKey(unittest.TestCase):
         self.assertFalse(ret)
 
 
+class TestEntitlementDirectoryCheckKeys(unittest.TestCase):
+
+    def _cert(self, name):
+        cert = MagicMock()
+        cert.path = '/etc/pki/entitlement/%s.pem' % name
+        cert.key_path.return_value = '/etc/pki/entitlement/%s-key.pem' % name
+        return cert
+
+    @patch('subscription_manager.certdirectory._certificate.check_key_pairs')
+    def test_check_keys(self, mock_check):
+        from rhsm import _certificate
+        ent_dir = EntitlementDirectory()
+        certs = [self._cert(name) for name in ('ok', 'missing', 'mismatch')]
+        stub = MagicMock()
+        stub.path = None
+        mock_check.return_value = [_certificate.KEY_OK, _certificate.KEY_MISSING,
+                                   _certificate.KEY_MISMATCH]
+        with patch.object(ent_dir, '_check_key', return_value=False) as mock_check_key:
+            result = ent_dir._check_keys(certs + [stub])
+
+        # One native call for every certificate on disk
+        mock_check.assert_called_once_with(
+            [(cert.path, cert.key_path()) for cert in certs])
+        # Missing keys and certificates without a path use the old check
+        self.assertEqual([certs[1], stub],
+                         [c[0][0] for c in mock_check_key.call_args_list])
+        self.assertEqual([certs[0], certs[2]], result)
+
+
+class WriterTest(unittest.TestCase):
+
+    def setUp(self):
+        self.ent_dir = tempfile.mkdtemp()
+        self.addCleanup(rmtree, self.ent_dir)
+        mock_ent_dir = MagicMock()
+        mock_ent_dir.productpath.return_value = self.ent_dir
+        require_patcher = patch('subscription_manager.certdirectory.require',
+                                return_value=mock_ent_dir)
+        require_patcher.start()
+        self.addCleanup(require_patcher.stop)
+
+    def test_write_many(self):
+        pairs = [(Key('key one'), create_from_pem(certdata.ENTITLEMENT_CERT_V1_0)),
+                 (Key('key two'), create_from_pem(certdata.ENTITLEMENT_CERT_V3_0))]
+        Writer().write_many(pairs)
+
+        names = []
+        for key, cert in pairs:
+            names += ['%s.pem' % cert.serial, '%s-key.pem' % cert.serial]
+            self.assertEqual(os.path.join(self.ent_dir, '%s.pem' % cert.serial), cert.path)
+            with open(cert.path) as f:
+                self.assertEqual(cert.to_pem(), f.read())
+            with open(key.path) as f:
+                self.assertEqual(key.content, f.read())
+            self.assertEqual(0o600, os.stat(key.path).st_mode & 0o777)
+        # Nothing but the certificates and keys, no staging directory
+        self.assertEqual(sorted(names), sorted(os.listdir(self.ent_dir)))
+
+    def test_write_many_fails_as_a_whole(self):
+        cert = create_from_pem(certdata.ENTITLEMENT_CERT_V1_0)
+        # The same serial twice can't be staged
+        self.assertRaises(OSError, Writer().write_many,
+                          [(Key('one'), cert), (Key('two'), cert)])
+        self.assertEqual([], os.listdir(self.ent_dir))
+
+
 class StubPath(Path):
 
     @staticmethod
@@ -198,7 +267,7 @@ class EntitlementDirectoryWithCertsTest(DirectoryWithCertsTest):
     klass = EntitlementDirectory
 
     def setUp(self):
-        self.patcher = patch('subscription_manager.certdirectory.create_from_file')
+        self.patcher = patch('subscription_manager.certdirectory.create_from_files')
         self.mock_cff = self.patcher.start()
 
         # sub in tmp path
@@ -213,7 +282,7 @@ class EntitlementDirectoryWithCertsTest(DirectoryWithCertsTest):
         self.mock_cert.is_expired.return_value = False
         self.mock_cert.products = [mock_product]
 
-        self.mock_cff.return_value = self.mock_cert
+        self.mock_cff.side_effect = lambda paths: [self.mock_cert for path in paths]
         super(EntitlementDirectoryWithCertsTest, self).setUp()
 
         self.mock_cert.key_path.return_value = self.temp_dir
@@ -261,6 +330,19 @@ class EntitlementDirectoryWithCertsTest(DirectoryWithCertsTest):
         res = self.d.list_for_product('123456789')
         self.assertTrue(isinstance(res, list))
 
+    @patch('subscription_manager.certdirectory.ContentPathIndex')
+    def test_list_for_path(self, mock_index_class):
+        mock_index_class.return_value.match.return_value = [self.mock_cert]
+        self.assertEqual([self.mock_cert], self.d.list_for_path('/foo/path'))
+        self.d.list_for_path('/other/path')
+        self.assertEqual(1, mock_index_class.call_count)
+        mock_index_class.return_value.match.assert_called_with('/other/path')
+
+        # Built again once the directory changed
+        self.d.refresh()
+        self.d.list_for_path('/foo/path')
+        self.assertEqual(2, mock_index_class.call_count)
+
 
 class ProductCertificateDirectoryTest(DirectoryTest):
     klass = ProductCertificateDirectory
@@ -271,7 +353,7 @@ class ProductCertificateDirectoryWithCertsTest(DirectoryWithCertsTest):
 
     def setUp(self):
         self.cleanup_paths = []
-        self.patcher = patch('subscription_manager.certdirectory.create_from_file')
+        self.patcher = patch('subscription_manager.certdirectory.create_from_files')
         self.mock_cff = self.patcher.start()
 
         mock_product = MagicMock()
@@ -283,7 +365,7 @@ class ProductCertificateDirectoryWithCertsTest(DirectoryWithCertsTest):
         self.mock_cert.serial = '37'
         self.mock_cert.is_expired.return_value = False
 
-        self.mock_cff.return_value = self.mock_cert
+        self.mock_cff.side_effect = lambda paths: [self.mock_cert for path in paths]
         self.d = self._get_directory()
 
     def tearDown(self):
@@ -296,6 +378,28 @@ class ProductCertificateDirectoryWithCertsTest(DirectoryWithCertsTest):
         res = self.d.list_valid()
         self.assertEqual(len(res), self.list_len)
 
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_valid_scanned(self, mock_scan):
+        mock_scan.return_value = {'valid': ['/b.pem'], 'expiring': ['/a.pem'],
+                                  'expired': ['/c.pem'], 'future': [], 'failed': []}
+        res = self.d.list_valid()
+        self.mock_cff.assert_called_once_with(['/a.pem', '/b.pem'])
+        self.assertEqual(len(res), 2)
+
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_expired_scanned(self, mock_scan):
+        mock_scan.return_value = {'valid': ['/b.pem'], 'expiring': [],
+                                  'expired': ['/c.pem'], 'future': [], 'failed': []}
+        res = self.d.list_expired()
+        self.mock_cff.assert_called_once_with(['/c.pem'])
+        self.assertEqual(len(res), 1)
+
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_valid_cached_listing(self, mock_scan):
+        self.d.list()
+        self.d.list_valid()
+        self.assertFalse(mock_scan.called)
+
     def test_list_expired_no_expired(self):
         res = self.d.list_expired()
         self.assertTrue(isinstance(res, list))
@@ -373,6 +477,18 @@ class ProductDirectoryTest(ProductCertificateDirectoryWithCertsTest):
         self.list_len = 4
         return self.klass(path=int_temp_dir, default_path=default_temp_dir)
 
+    # The merged listing always filters list(), there is no single dir to scan
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_valid_scanned(self, mock_scan):
+        res = self.d.list_valid()
+        self.assertFalse(mock_scan.called)
+        self.assertEqual(len(res), self.list_len)
+
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_expired_scanned(self, mock_scan):
+        self.d.list_expired()
+        self.assertFalse(mock_scan.called)
+
 
 class AlsoProductDirectoryTest(unittest.TestCase):
     @patch('os.path.exists')
@@ -411,3 +527,79 @@ class AlsoProductDirectoryTest(unittest.TestCase):
         self.assertEqual(1, len(results))
         resulting_ids = [cert.products[0].id for cert in results]
         self.assertTrue("top" in resulting_ids)
+
+
+class CertificateIndexTest(unittest.TestCase):
+
+    def setUp(self):
+        self.cert_dir = tempfile.mkdtemp(prefix='subscription-manager-unit-tests-tmp')
+        self.index_dir = tempfile.mkdtemp(prefix='subscription-manager-unit-tests-tmp')
+        for name, pem in (('1.pem', certdata.PRODUCT_CERT_V1_0),
+                          ('2.pem', certdata.ENTITLEMENT_CERT_V3_0)):
+            with open(os.path.join(self.cert_dir, name), 'w') as f:
+                f.write(pem)
+        index_patcher = patch.object(ProductCertificateDirectory, 'INDEX_DIR', self.index_dir)
+        index_patcher.start()
+        self.addCleanup(index_patcher.stop)
+        cff_patcher = patch('subscription_manager.certdirectory.create_from_files',
+                            side_effect=create_from_files)
+        self.mock_cff = cff_patcher.start()
+        self.addCleanup(cff_patcher.stop)
+
+    def tearDown(self):
+        rmtree(self.cert_dir)
+        rmtree(self.index_dir)
+
+    def _list(self):
+        return ProductCertificateDirectory(path=self.cert_dir).list()
+
+    def test_index_written(self):
+        certs = self._list()
+        self.assertEqual(1, len(os.listdir(self.index_dir)))
+        self.assertEqual(1, self.mock_cff.call_count)
+
+        indexed = self._list()
+        self.assertEqual(1, self.mock_cff.call_count)
+        self.assertEqual([cert.serial for cert in certs],
+                         [cert.serial for cert in indexed])
+        self.assertEqual([cert.path for cert in certs],
+                         [cert.path for cert in indexed])
+        self.assertEqual(certs[0].products[0].name, indexed[0].products[0].name)
+        self.assertEqual(certs[1].pem, indexed[1].pem)
+
+    def test_only_changed_parsed(self):
+        self._list()
+        path = os.path.join(self.cert_dir, '1.pem')
+        with open(path, 'w') as f:
+            f.write(certdata.PRODUCT_CERT_WITH_OS_NAME_V1_0)
+        os.utime(path, (0, 0))
+
+        certs = self._list()
+        self.mock_cff.assert_called_with([path])
+        self.assertEqual(2, len(certs))
+        self._list()
+        self.assertEqual(2, self.mock_cff.call_count)
+
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_subset_keeps_index(self, mock_scan):
+        mock_scan.return_value = {'valid': [os.path.join(self.cert_dir, '1.pem')],
+                                  'expiring': [],
+                                  'expired': [os.path.join(self.cert_dir, '2.pem')],
+                                  'future': [], 'failed': []}
+        self._list()
+        self.assertEqual(1, len(ProductCertificateDirectory(path=self.cert_dir).list_valid()))
+        self.assertEqual(2, len(self._list()))
+        self.assertEqual(1, self.mock_cff.call_count)
+
+    @patch('subscription_manager.certdirectory._certificate.scan_validity')
+    def test_list_reuses_valid(self, mock_scan):
+        valid_path = os.path.join(self.cert_dir, '1.pem')
+        expired_path = os.path.join(self.cert_dir, '2.pem')
+        mock_scan.return_value = {'valid': [valid_path], 'expiring': [],
+                                  'expired': [expired_path], 'future': [], 'failed': []}
+        cert_dir = ProductCertificateDirectory(path=self.cert_dir)
+        valid = cert_dir.list_valid()
+        certs = cert_dir.list()
+        self.mock_cff.assert_called_with([expired_path])
+        self.assertEqual(2, self.mock_cff.call_count)
+        self.assertTrue(valid[0] in certs)
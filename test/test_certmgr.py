@@ -31,7 +31,7 @@ import subscription_manager.injection as inj
 from rhsmlib.facts import hwprobe
 
 from rhsm.profile import RPMProfile
-from rhsm.connection import GoneException
+from rhsm.connection import GoneException, RateLimitExceededException
 from rhsm.certificate import GMT
 
 from .fixture import SubManFixture, set_up_mock_sp_store
@@ -176,6 +176,12 @@ class TestActionClient(ActionClientTestBase):
         report = actionclient.entcertlib.report
         self.assertTrue(self.stub_ent1.serial in report.valid)
 
+    @mock.patch.object(entcertlib.EntCertActionInvoker, 'update')
+    def test_rate_limit_exception(self, mock_update):
+        mock_update.side_effect = RateLimitExceededException(429, headers={'retry-after': '120'})
+        actionclient = action_client.ActionClient()
+        self.assertRaises(RateLimitExceededException, actionclient.update)
+
     @mock.patch.object(entcertlib.EntCertActionInvoker, 'update')
     @mock.patch('subscription_manager.base_action_client.log')
     def test_entcertlib_update_exception(self, mock_log, mock_update):
@@ -0,0 +1,74 @@
+from __future__ import print_function, division, absolute_import
+
+#
+# Copyright (c) 2019 Red Hat, Inc.
+#
+# This software is licensed to you under the GNU General Public License,
+# version 2 (GPLv2). There is NO WARRANTY for this software, express or
+# implied, including the implied warranties of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. You should have received a copy of GPLv2
+# along with this software; if not, see
+# http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+#
+# Red Hat trademarks are not licensed under GPLv2. No permission is
+# granted to use or replicate Red Hat trademarks that are incorporated
+# in this software or its documentation.
+#
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+
+import mock
+
+from rhsm.connection import RateLimitExceededException
+from subscription_manager.scripts import rhsmcertd_worker
+
+
+class TestRhsmcertdWorkerMain(unittest.TestCase):
+    def setUp(self):
+        for name, value in [('sys.argv', ['rhsmcertd-worker']),
+                            ('subscription_manager.logutil.init_logger', mock.DEFAULT),
+                            ('subscription_manager.scripts.rhsmcertd_worker._setup', mock.DEFAULT)]:
+            patcher = mock.patch(name, value)
+            patcher.start()
+            self.addCleanup(patcher.stop)
+        patcher = mock.patch('subscription_manager.scripts.rhsmcertd_worker._main')
+        self.mock_main = patcher.start()
+        self.addCleanup(patcher.stop)
+
+    def _exit_code(self):
+        try:
+            rhsmcertd_worker.main()
+        except SystemExit as e:
+            return e.code
+        return 0
+
+    def test_success(self):
+        self.assertEqual(0, self._exit_code())
+
+    def test_error(self):
+        self.mock_main.side_effect = Exception("boom")
+        self.assertEqual(255, self._exit_code())
+
+    def test_exit(self):
+        self.mock_main.side_effect = SystemExit(1)
+        self.assertEqual(255, self._exit_code())
+
+    def test_no_retry(self):
+        # Not registered, or disabled by configuration
+        self.mock_main.side_effect = SystemExit(rhsmcertd_worker.EXIT_NO_RETRY)
+        self.assertEqual(rhsmcertd_worker.EXIT_NO_RETRY, self._exit_code())
+
+    def test_rate_limited(self):
+        self.mock_main.side_effect = RateLimitExceededException(429, headers={'retry-after': '90'})
+        self.assertEqual(rhsmcertd_worker.EXIT_RATE_LIMITED + 2, self._exit_code())
+
+    def test_rate_limited_without_retry_after(self):
+        self.mock_main.side_effect = RateLimitExceededException(429)
+        self.assertEqual(rhsmcertd_worker.EXIT_RATE_LIMITED, self._exit_code())
+
+    def test_rate_limited_wait_is_capped(self):
+        self.mock_main.side_effect = RateLimitExceededException(429, headers={'retry-after': '99999'})
+        self.assertEqual(rhsmcertd_worker.EXIT_RATE_LIMITED + rhsmcertd_worker.RATE_LIMITED_MAX_MINUTES,
+                         self._exit_code())